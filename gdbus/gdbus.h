@@ -217,6 +217,14 @@ struct GDBusSecurityTable {
 
 void g_dbus_set_flags(int flags);
 
+typedef void (* GDBusMethodTimeFunction) (DBusMessage *message, gint64 usec);
+
+void g_dbus_set_method_time_function(GDBusMethodTimeFunction function);
+
+typedef void (* GDBusFlushFunction) (void);
+
+void g_dbus_set_flush_function(GDBusFlushFunction function);
+
 gboolean g_dbus_register_interface(DBusConnection *connection,
 					const char *path, const char *name,
 					const GDBusMethodTable *methods,
@@ -249,14 +249,26 @@ static DBusMessage *introspect(DBusConnection *connection,
 	return reply;
 }
 
+static GDBusMethodTimeFunction method_time_function = NULL;
+
+/* sends out the messages the application holds back */
+static GDBusFlushFunction flush_function = NULL;
+
 static DBusHandlerResult process_message(DBusConnection *connection,
 			DBusMessage *message, const GDBusMethodTable *method,
 							void *iface_user_data)
 {
 	DBusMessage *reply;
+	gint64 start = 0;
+
+	if (method_time_function != NULL)
+		start = g_get_monotonic_time();
 
 	reply = method->function(connection, message, iface_user_data);
 
+	if (method_time_function != NULL && start > 0)
+		method_time_function(message, g_get_monotonic_time() - start);
+
 	if (method->flags & G_DBUS_METHOD_FLAG_NOREPLY) {
 		if (reply != NULL)
 			dbus_message_unref(reply);
@@ -271,6 +283,9 @@ static DBusHandlerResult process_message(DBusConnection *connection,
 	if (reply == NULL)
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 
+	if (flush_function != NULL)
+		flush_function();
+
 	dbus_connection_send(connection, reply, NULL);
 	dbus_message_unref(reply);
 
@@ -1403,6 +1418,9 @@ gboolean g_dbus_unregister_interface(DBusConnection *connection,
 	if (path == NULL)
 		return FALSE;
 
+	if (flush_function != NULL)
+		flush_function();
+
 	if (dbus_connection_get_object_path_data(connection, path,
 						(void *) &data) == FALSE)
 		return FALSE;
@@ -1498,6 +1516,9 @@ gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message)
 {
 	dbus_bool_t result;
 
+	if (flush_function != NULL)
+		flush_function();
+
 	if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
 		dbus_message_set_no_reply(message, TRUE);
 	else if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL) {
@@ -1506,8 +1527,10 @@ gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message)
 		const char *name = dbus_message_get_member(message);
 		const GDBusArgInfo *args;
 
-		if (!check_signal(connection, path, interface, name, &args))
+		if (!check_signal(connection, path, interface, name, &args)) {
+			dbus_message_unref(message);
 			return FALSE;
+		}
 	}
 
 	result = dbus_connection_send(connection, message, NULL);
@@ -1778,3 +1801,13 @@ void g_dbus_set_flags(int flags)
 {
 	global_flags = flags;
 }
+
+void g_dbus_set_method_time_function(GDBusMethodTimeFunction function)
+{
+	method_time_function = function;
+}
+
+void g_dbus_set_flush_function(GDBusFlushFunction function)
+{
+	flush_function = function;
+}
@@ -179,6 +179,14 @@ int connman_dbus_get_selinux_context(DBusConnection *connection,
                                connman_dbus_get_context_cb_t func,
                                void *user_data);
 
+typedef void (* connman_dbus_get_unix_user_cb_t) (unsigned int uid,
+						void *user_data, int err);
+
+int connman_dbus_get_connection_unix_user(DBusConnection *connection,
+				const char *bus_name,
+				connman_dbus_get_unix_user_cb_t func,
+				void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,6 +50,23 @@ struct connman_debug_desc {
 	unsigned int flags;
 } __attribute__((aligned(8)));
 
+/*
+ * Rate limiting state of a call site. It is kept apart from the debug
+ * descriptor, whose layout the plugins share, and is only touched by
+ * connman_debug_print().
+ */
+struct connman_debug_ratelimit {
+	struct connman_debug_desc *desc;
+	struct connman_debug_ratelimit *next;
+	unsigned int interval;
+	unsigned int burst;
+	unsigned int suppressed;
+};
+
+void connman_debug_print(struct connman_debug_ratelimit *ratelimit,
+					const char *format, ...)
+				__attribute__((format(printf, 2, 3)));
+
 #define CONNMAN_DEBUG_DEFINE(name) \
 	static struct connman_debug_desc __debug_alias_ ## name \
 	__attribute__((used, section("__debug"), aligned(8))) = { \
@@ -61,16 +78,23 @@ struct connman_debug_desc {
  * @fmt: format string
  * @arg...: list of arguments
  *
- * Simple macro around connman_debug() which also include the function
- * name it is called in.
+ * Simple macro around connman_debug_print() which also include the
+ * function name it is called in. The format string is checked at
+ * compile time, but the arguments are only evaluated when debugging
+ * is enabled for the call site.
  */
 #define DBG(fmt, arg...) do { \
 	static struct connman_debug_desc __connman_debug_desc \
 	__attribute__((used, section("__debug"), aligned(8))) = { \
 		.file = __FILE__, .flags = CONNMAN_DEBUG_FLAG_DEFAULT, \
 	}; \
-	if (__connman_debug_desc.flags & CONNMAN_DEBUG_FLAG_PRINT) \
-		connman_debug("%s:%s() " fmt, \
+	static struct connman_debug_ratelimit __connman_debug_ratelimit = { \
+		.desc = &__connman_debug_desc, \
+	}; \
+	if (__builtin_expect(__connman_debug_desc.flags & \
+				CONNMAN_DEBUG_FLAG_PRINT, 0)) \
+		connman_debug_print(&__connman_debug_ratelimit, \
+					"%s:%s() " fmt, \
 					__FILE__, __FUNCTION__ , ## arg); \
 } while (0)
 
@@ -30,6 +30,7 @@ extern "C" {
 
 connman_bool_t connman_setting_get_bool(const char *key);
 char **connman_setting_get_string_list(const char *key);
+unsigned int connman_setting_get_uint(const char *key);
 unsigned int *connman_setting_get_uint_list(const char *key);
 
 unsigned int connman_timeout_input_request(void);
@@ -87,6 +87,8 @@ static int agent_send_next_request(void)
 	agent_request = agent_queue->data;
 	agent_queue = g_list_remove(agent_queue, agent_request);
 
+	__connman_dbus_flush_property_changes();
+
 	if (dbus_connection_send_with_reply(connection, agent_request->msg,
 					&agent_request->call,
 					agent_request->timeout)	== FALSE)
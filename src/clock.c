@@ -321,6 +321,8 @@ static const GDBusMethodTable clock_methods[] = {
 static const GDBusSignalTable clock_signals[] = {
 	{ GDBUS_SIGNAL("PropertyChanged",
 			GDBUS_ARGS({ "name", "s" }, { "value", "v" })) },
+	{ GDBUS_SIGNAL("PropertiesChanged",
+			GDBUS_ARGS({ "properties", "a{sv}" })) },
 	{ },
 };
 
@@ -381,7 +381,7 @@ static struct gateway_data *add_gateway(struct connman_service *service,
 
 	data->service = service;
 
-	data->order = __connman_service_get_order(service);
+	data->order = __connman_service_update_order(service);
 
 	/*
 	 * If the service is already in the hash, then we
@@ -769,7 +769,7 @@ static void update_order(void)
 	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
 		struct gateway_data *data = value;
 
-		data->order = __connman_service_get_order(data->service);
+		data->order = __connman_service_update_order(data->service);
 	}
 }
 
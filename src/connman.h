@@ -30,6 +30,10 @@ dbus_bool_t __connman_dbus_append_objpath_dict_array(DBusMessage *msg,
 int __connman_dbus_init(DBusConnection *conn);
 void __connman_dbus_cleanup(void);
 
+void __connman_dbus_flush_property_changes(void);
+int __connman_dbus_register_properties_changed(const char *owner);
+int __connman_dbus_unregister_properties_changed(const char *owner);
+
 DBusMessage *__connman_error_failed(DBusMessage *msg, int errnum);
 DBusMessage *__connman_error_invalid_arguments(DBusMessage *msg);
 DBusMessage *__connman_error_permission_denied(DBusMessage *msg);
@@ -56,6 +60,26 @@ DBusMessage *__connman_error_invalid_property(DBusMessage *msg);
 int __connman_manager_init(void);
 void __connman_manager_cleanup(void);
 
+enum connman_metric {
+	CONNMAN_METRIC_DNSPROXY_QUERY,
+	CONNMAN_METRIC_DNSPROXY_REPLY,
+	CONNMAN_METRIC_RTNL_MESSAGE,
+	CONNMAN_METRIC_DBUS_METHOD,
+	CONNMAN_METRIC_DHCP_LEASE,
+	CONNMAN_METRIC_DHCP_LEASE_LOST,
+	CONNMAN_METRIC_DHCP_NO_LEASE,
+	CONNMAN_METRIC_IPTABLES_COMMIT,
+	CONNMAN_METRIC_MAX,
+};
+
+int __connman_metrics_init(void);
+void __connman_metrics_cleanup(void);
+
+gint64 __connman_metrics_start(void);
+void __connman_metrics_stop(enum connman_metric metric, gint64 start);
+void __connman_metrics_count(enum connman_metric metric);
+void __connman_metrics_dump(void);
+
 int __connman_clock_init(void);
 void __connman_clock_cleanup(void);
 
@@ -71,9 +95,12 @@ int __connman_agent_init(void);
 void __connman_agent_cleanup(void);
 
 void __connman_counter_send_usage(const char *path,
-					DBusMessage *message);
+					connman_dbus_append_cb_t function,
+					void *user_data);
+uint64_t __connman_counter_get_threshold(const char *path);
 int __connman_counter_register(const char *owner, const char *path,
-						unsigned int interval);
+				unsigned int accuracy, unsigned int interval,
+				connman_bool_t batch);
 int __connman_counter_unregister(const char *owner, const char *path);
 
 int __connman_counter_init(void);
@@ -281,13 +308,15 @@ void __connman_ipconfig_enable_ipv6(struct connman_ipconfig *ipconfig);
 int __connman_ipconfig_init(void);
 void __connman_ipconfig_cleanup(void);
 
-struct rtnl_link_stats;
+struct rtnl_link_stats64;
 
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats);
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats);
+						struct rtnl_link_stats64 *stats,
+						connman_bool_t stats64);
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats,
+						connman_bool_t stats64);
 void __connman_ipconfig_newaddr(int index, int family, const char *label,
 				unsigned char prefixlen, const char *address);
 void __connman_ipconfig_deladdr(int index, int family, const char *label,
@@ -565,7 +594,27 @@ int __connman_provider_init(void);
 int __connman_service_init(void);
 void __connman_service_cleanup(void);
 
+int __connman_serviceindex_init(void);
+void __connman_serviceindex_cleanup(void);
+int __connman_serviceindex_add(const char *identifier, gpointer data);
+void __connman_serviceindex_remove(const char *identifier);
+gpointer __connman_serviceindex_lookup(const char *identifier);
+int __connman_serviceindex_set_path(const char *identifier, const char *path);
+gpointer __connman_serviceindex_lookup_path(const char *path);
+int __connman_serviceindex_add_network(const char *identifier,
+							gpointer network);
+void __connman_serviceindex_remove_network(gpointer network);
+gpointer __connman_serviceindex_lookup_network(gpointer network);
+unsigned int __connman_serviceindex_size(void);
+connman_bool_t __connman_serviceindex_check(void);
+
 void __connman_service_list_struct(DBusMessageIter *iter);
+guint64 __connman_service_get_generation(void);
+connman_bool_t __connman_service_generation_known(guint64 generation);
+void __connman_service_list_struct_since(DBusMessageIter *iter,
+							guint64 generation);
+void __connman_service_list_removed_since(DBusMessageIter *iter,
+							guint64 generation);
 
 struct connman_service *__connman_service_lookup_from_index(int index);
 struct connman_service *__connman_service_lookup_from_ident(const char *identifier);
@@ -588,6 +637,7 @@ connman_bool_t __connman_service_is_connected_state(struct connman_service *serv
 const char *__connman_service_get_ident(struct connman_service *service);
 const char *__connman_service_get_path(struct connman_service *service);
 unsigned int __connman_service_get_order(struct connman_service *service);
+unsigned int __connman_service_update_order(struct connman_service *service);
 void __connman_service_update_ordering(void);
 struct connman_network *__connman_service_get_network(struct connman_service *service);
 enum connman_service_security __connman_service_get_security(struct connman_service *service);
@@ -680,13 +730,15 @@ void __connman_service_set_agent_passphrase(struct connman_service *service,
 						const char *agent_passphrase);
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_error, unsigned int tx_error,
-			unsigned int rx_dropped, unsigned int tx_dropped);
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_error, uint64_t tx_error,
+			uint64_t rx_dropped, uint64_t tx_dropped,
+			connman_bool_t stats64);
 
 int __connman_service_counter_register(const char *counter);
 void __connman_service_counter_unregister(const char *counter);
+int __connman_service_request_stats(void);
 
 #include <connman/session.h>
 
@@ -744,6 +796,7 @@ enum connman_device_type __connman_rtnl_get_device_type(int index);
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
 int __connman_rtnl_request_update(void);
+int __connman_rtnl_request_link_update(int index);
 int __connman_rtnl_send(const void *buf, size_t len);
 
 connman_bool_t __connman_session_mode();
@@ -756,14 +809,14 @@ int __connman_session_init(void);
 void __connman_session_cleanup(void);
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
@@ -777,6 +830,11 @@ int  __connman_stats_update(struct connman_service *service,
 int __connman_stats_get(struct connman_service *service,
 				connman_bool_t roaming,
 				struct connman_stats_data *data);
+int __connman_stats_get_range(struct connman_service *service,
+				time_t start, unsigned int interval,
+				unsigned int count,
+				struct connman_stats_data *home,
+				struct connman_stats_data *roaming);
 
 int __connman_iptables_init(void);
 void __connman_iptables_cleanup(void);
@@ -784,6 +842,14 @@ int __connman_iptables_command(const char *format, ...)
 				__attribute__((format(printf, 1, 2)));
 int __connman_iptables_commit(const char *table_name);
 
+typedef void (* iptables_counters_cb_t) (const char *chain_name,
+					unsigned int index, uint64_t packets,
+					uint64_t bytes, void *user_data);
+
+int __connman_iptables_get_counters(const char *table_name,
+					iptables_counters_cb_t cb,
+					void *user_data);
+
 int __connman_dnsproxy_init(void);
 void __connman_dnsproxy_cleanup(void);
 int __connman_dnsproxy_add_listener(int index);
@@ -791,6 +857,50 @@ void __connman_dnsproxy_remove_listener(int index);
 int __connman_dnsproxy_append(int index, const char *domain, const char *server);
 int __connman_dnsproxy_remove(int index, const char *domain, const char *server);
 void __connman_dnsproxy_flush(void);
+void __connman_dnsproxy_list_servers(DBusMessageIter *array);
+
+#define DNS_RR_SIZE 10
+
+struct dns_packet {
+	const unsigned char *buf;
+	unsigned int len;
+	uint16_t qdcount;
+	uint16_t ancount;
+	uint16_t nscount;
+	uint16_t arcount;
+	unsigned int qname;		/* offset of the question name */
+	unsigned int qname_len;
+	uint16_t qtype;
+	uint16_t qclass;
+	unsigned int records;		/* offset of the first record */
+};
+
+struct dns_rr {
+	unsigned int name;		/* offset of the owner name */
+	uint16_t type;
+	uint16_t class;
+	uint32_t ttl;
+	uint16_t rdlen;
+	unsigned int rdata;		/* offset of the rdata */
+};
+
+int __connman_dns_parse(struct dns_packet *pkt, const unsigned char *buf,
+							unsigned int len);
+int __connman_dns_parse_rr(const struct dns_packet *pkt,
+				unsigned int *offset, struct dns_rr *rr);
+int __connman_dns_name_length(const struct dns_packet *pkt,
+							unsigned int offset);
+int __connman_dns_name_copy(const struct dns_packet *pkt,
+				unsigned int offset, unsigned char *out,
+				unsigned int max);
+gboolean __connman_dns_name_equal(const struct dns_packet *pkt,
+					unsigned int offset_a,
+					unsigned int offset_b);
+int __connman_dns_rdata_length(const struct dns_packet *pkt,
+						const struct dns_rr *rr);
+int __connman_dns_rdata_copy(const struct dns_packet *pkt,
+				const struct dns_rr *rr, unsigned char *out,
+				unsigned int max);
 
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
@@ -38,9 +38,32 @@ struct connman_counter {
 	char *owner;
 	char *path;
 	unsigned int interval;
+	uint64_t threshold;
 	guint watch;
+
+	/* pending UsageBatch message */
+	connman_bool_t batch;
+	DBusMessage *batch_msg;
+	DBusMessageIter batch_iter;
+	DBusMessageIter batch_array;
+	guint batch_flush;
 };
 
+static void batch_free(struct connman_counter *counter)
+{
+	if (counter->batch_flush > 0) {
+		g_source_remove(counter->batch_flush);
+		counter->batch_flush = 0;
+	}
+
+	if (counter->batch_msg != NULL) {
+		dbus_message_iter_abandon_container(&counter->batch_iter,
+							&counter->batch_array);
+		dbus_message_unref(counter->batch_msg);
+		counter->batch_msg = NULL;
+	}
+}
+
 static void remove_counter(gpointer user_data)
 {
 	struct connman_counter *counter = user_data;
@@ -51,6 +74,8 @@ static void remove_counter(gpointer user_data)
 
 	__connman_service_counter_unregister(counter->path);
 
+	batch_free(counter);
+
 	g_free(counter->owner);
 	g_free(counter->path);
 	g_free(counter);
@@ -67,12 +92,14 @@ static void owner_disconnect(DBusConnection *conn, void *user_data)
 }
 
 int __connman_counter_register(const char *owner, const char *path,
-						unsigned int interval)
+				unsigned int accuracy, unsigned int interval,
+				connman_bool_t batch)
 {
 	struct connman_counter *counter;
 	int err;
 
-	DBG("owner %s path %s interval %u", owner, path, interval);
+	DBG("owner %s path %s accuracy %u interval %u batch %d", owner, path,
+						accuracy, interval, batch);
 
 	counter = g_hash_table_lookup(counter_table, path);
 	if (counter != NULL)
@@ -84,6 +111,8 @@ int __connman_counter_register(const char *owner, const char *path,
 
 	counter->owner = g_strdup(owner);
 	counter->path = g_strdup(path);
+	counter->threshold = (uint64_t) accuracy * 1024;
+	counter->batch = batch;
 
 	err = __connman_service_counter_register(counter->path);
 	if (err < 0) {
@@ -127,21 +156,127 @@ int __connman_counter_unregister(const char *owner, const char *path)
 	return 0;
 }
 
+/*
+ * The accuracy is the number of bytes the counters have to change
+ * before the counter is notified again.
+ */
+uint64_t __connman_counter_get_threshold(const char *path)
+{
+	struct connman_counter *counter;
+
+	counter = g_hash_table_lookup(counter_table, path);
+	if (counter == NULL)
+		return 0;
+
+	return counter->threshold;
+}
+
+static void batch_send(struct connman_counter *counter)
+{
+	DBusMessage *message = counter->batch_msg;
+
+	if (message == NULL)
+		return;
+
+	dbus_message_iter_close_container(&counter->batch_iter,
+						&counter->batch_array);
+	counter->batch_msg = NULL;
+
+	g_dbus_send_message(connection, message);
+}
+
+static gboolean flush_batch(gpointer user_data)
+{
+	struct connman_counter *counter = user_data;
+
+	counter->batch_flush = 0;
+
+	batch_send(counter);
+
+	return FALSE;
+}
+
+static DBusMessageIter *batch_get_array(struct connman_counter *counter)
+{
+	DBusMessage *message;
+
+	if (counter->batch_msg != NULL)
+		return &counter->batch_array;
+
+	message = dbus_message_new_method_call(counter->owner, counter->path,
+					CONNMAN_COUNTER_INTERFACE, "UsageBatch");
+	if (message == NULL)
+		return NULL;
+
+	dbus_message_set_no_reply(message, TRUE);
+
+	dbus_message_iter_init_append(message, &counter->batch_iter);
+	dbus_message_iter_open_container(&counter->batch_iter,
+				DBUS_TYPE_ARRAY,
+				DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+				DBUS_TYPE_OBJECT_PATH_AS_STRING
+				DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+				DBUS_TYPE_STRING_AS_STRING
+				DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+				DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+				DBUS_TYPE_STRING_AS_STRING
+				DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+				DBUS_STRUCT_END_CHAR_AS_STRING,
+				&counter->batch_array);
+
+	counter->batch_msg = message;
+
+	/* all services are updated from the same netlink burst */
+	counter->batch_flush = g_idle_add(flush_batch, counter);
+
+	return &counter->batch_array;
+}
+
+/*
+ * The function appends the service object path and the home and
+ * roaming dictionaries. Counters which registered for batching get
+ * them collected into one UsageBatch call, the others get a Usage
+ * call per service.
+ */
 void __connman_counter_send_usage(const char *path,
-					DBusMessage *message)
+					connman_dbus_append_cb_t function,
+					void *user_data)
 {
 	struct connman_counter *counter;
+	DBusMessageIter *array, entry, iter;
+	DBusMessage *message;
 
 	counter = g_hash_table_lookup(counter_table, path);
 	if (counter == NULL)
 		return;
 
-	dbus_message_set_destination(message, counter->owner);
-	dbus_message_set_path(message, counter->path);
-	dbus_message_set_interface(message, CONNMAN_COUNTER_INTERFACE);
-	dbus_message_set_member(message, "Usage");
+	if (counter->batch == TRUE) {
+		array = batch_get_array(counter);
+		if (array == NULL)
+			return;
+
+		dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT,
+								NULL, &entry);
+		function(&entry, user_data);
+		dbus_message_iter_close_container(array, &entry);
+
+		return;
+	}
+
+	message = dbus_message_new_method_call(counter->owner, counter->path,
+					CONNMAN_COUNTER_INTERFACE, "Usage");
+	if (message == NULL)
+		return;
+
 	dbus_message_set_no_reply(message, TRUE);
 
+	dbus_message_iter_init_append(message, &iter);
+	function(&iter, user_data);
+
 	g_dbus_send_message(connection, message);
 }
 
@@ -155,6 +290,9 @@ static void release_counter(gpointer key, gpointer value, gpointer user_data)
 	if (counter->watch > 0)
 		g_dbus_remove_watch(connection, counter->watch);
 
+	batch_send(counter);
+	batch_free(counter);
+
 	message = dbus_message_new_method_call(counter->owner, counter->path,
 					CONNMAN_COUNTER_INTERFACE, "Release");
 	if (message == NULL)
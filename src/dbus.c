@@ -227,6 +227,280 @@ void connman_dbus_property_append_array(DBusMessageIter *iter,
 
 static DBusConnection *connection = NULL;
 
+/*
+ * The PropertyChanged signals are collected per object and interface
+ * and sent from an idle callback once per main loop iteration. Only
+ * the latest value of each property is sent.
+ */
+struct pending_property {
+	char *key;
+	DBusMessage *signal;
+};
+
+struct pending_object {
+	char *path;
+	char *interface;
+	GSList *properties;
+};
+
+static GHashTable *pending_objects = NULL;
+static GSList *pending_order = NULL;
+static guint pending_flush = 0;
+
+/* clients which asked for the PropertiesChanged signal */
+static GHashTable *multi_clients = NULL;
+
+static void free_pending_object(gpointer data)
+{
+	struct pending_object *object = data;
+	GSList *list;
+
+	for (list = object->properties; list; list = list->next) {
+		struct pending_property *property = list->data;
+
+		if (property->signal != NULL)
+			dbus_message_unref(property->signal);
+
+		g_free(property->key);
+		g_free(property);
+	}
+
+	g_slist_free(object->properties);
+	g_free(object->path);
+	g_free(object->interface);
+	g_free(object);
+}
+
+static void iter_append_iter(DBusMessageIter *base, DBusMessageIter *iter)
+{
+	int type;
+
+	type = dbus_message_iter_get_arg_type(iter);
+
+	if (dbus_type_is_basic(type)) {
+		/* large enough for the 64 bit types on 32 bit targets */
+		union {
+			dbus_uint64_t u64;
+			double dbl;
+			const char *str;
+		} value;
+
+		dbus_message_iter_get_basic(iter, &value);
+		dbus_message_iter_append_basic(base, type, &value);
+	} else if (dbus_type_is_container(type)) {
+		DBusMessageIter iter_sub, base_sub;
+		char *sig;
+
+		dbus_message_iter_recurse(iter, &iter_sub);
+
+		switch (type) {
+		case DBUS_TYPE_ARRAY:
+		case DBUS_TYPE_VARIANT:
+			sig = dbus_message_iter_get_signature(&iter_sub);
+			break;
+		default:
+			sig = NULL;
+			break;
+		}
+
+		dbus_message_iter_open_container(base, type, sig, &base_sub);
+
+		if (sig != NULL)
+			dbus_free(sig);
+
+		while (dbus_message_iter_get_arg_type(&iter_sub) !=
+							DBUS_TYPE_INVALID) {
+			iter_append_iter(&base_sub, &iter_sub);
+			dbus_message_iter_next(&iter_sub);
+		}
+
+		dbus_message_iter_close_container(base, &base_sub);
+	}
+}
+
+/*
+ * All properties of the object which changed in this iteration in a
+ * single PropertiesChanged(dict properties) signal. It goes only to
+ * the clients which asked for it, so the other clients do not get
+ * every change twice.
+ */
+static void send_properties_changed(struct pending_object *object)
+{
+	DBusMessage *signal, *msg;
+	DBusMessageIter iter, dict;
+	GHashTableIter clients;
+	gpointer owner;
+	GSList *list;
+
+	signal = dbus_message_new_signal(object->path, object->interface,
+							"PropertiesChanged");
+	if (signal == NULL)
+		return;
+
+	dbus_message_iter_init_append(signal, &iter);
+	connman_dbus_dict_open(&iter, &dict);
+
+	for (list = object->properties; list; list = list->next) {
+		struct pending_property *property = list->data;
+		DBusMessageIter value, entry;
+
+		dbus_message_iter_init(property->signal, &value);
+
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+								NULL, &entry);
+
+		/* the key followed by the variant */
+		iter_append_iter(&entry, &value);
+		dbus_message_iter_next(&value);
+		iter_append_iter(&entry, &value);
+
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	connman_dbus_dict_close(&iter, &dict);
+
+	g_hash_table_iter_init(&clients, multi_clients);
+
+	while (g_hash_table_iter_next(&clients, &owner, NULL) == TRUE) {
+		msg = dbus_message_copy(signal);
+		if (msg == NULL)
+			continue;
+
+		dbus_message_set_destination(msg, owner);
+		g_dbus_send_message(connection, msg);
+	}
+
+	dbus_message_unref(signal);
+}
+
+static void send_pending_object(struct pending_object *object)
+{
+	GSList *list;
+
+	if (multi_clients != NULL && g_hash_table_size(multi_clients) > 0)
+		send_properties_changed(object);
+
+	for (list = object->properties; list; list = list->next) {
+		struct pending_property *property = list->data;
+
+		g_dbus_send_message(connection, property->signal);
+		property->signal = NULL;
+	}
+}
+
+static gboolean flush_property_changes(gpointer user_data)
+{
+	GSList *order, *list;
+
+	pending_flush = 0;
+
+	order = pending_order;
+	pending_order = NULL;
+
+	for (list = order; list; list = list->next) {
+		struct pending_object *object = list->data;
+		char *key = g_strconcat(object->path, " ",
+						object->interface, NULL);
+
+		g_hash_table_steal(pending_objects, key);
+		g_free(key);
+
+		send_pending_object(object);
+		free_pending_object(object);
+	}
+
+	g_slist_free(order);
+
+	return FALSE;
+}
+
+/*
+ * Send all pending signals right away. gdbus calls it before sending
+ * any other message or removing an interface, so the signals keep
+ * their order relative to method replies and removal signals.
+ */
+void __connman_dbus_flush_property_changes(void)
+{
+	if (pending_order == NULL)
+		return;
+
+	if (pending_flush > 0) {
+		g_source_remove(pending_flush);
+		pending_flush = 0;
+	}
+
+	flush_property_changes(NULL);
+}
+
+static dbus_bool_t queue_property_changed(const char *path,
+				const char *interface, const char *key,
+				DBusMessage *signal)
+{
+	struct pending_object *object;
+	struct pending_property *property;
+	GSList *list;
+	char *object_key;
+
+	if (pending_objects == NULL)
+		return g_dbus_send_message(connection, signal);
+
+	object_key = g_strconcat(path, " ", interface, NULL);
+
+	object = g_hash_table_lookup(pending_objects, object_key);
+	if (object == NULL) {
+		object = g_try_new0(struct pending_object, 1);
+		if (object == NULL) {
+			g_free(object_key);
+			return g_dbus_send_message(connection, signal);
+		}
+
+		object->path = g_strdup(path);
+		object->interface = g_strdup(interface);
+
+		g_hash_table_replace(pending_objects, object_key, object);
+	} else {
+		g_free(object_key);
+
+		/* the latest change goes last, also among the objects */
+		pending_order = g_slist_remove(pending_order, object);
+	}
+
+	pending_order = g_slist_append(pending_order, object);
+
+	for (list = object->properties; list; list = list->next) {
+		property = list->data;
+
+		if (g_strcmp0(property->key, key) != 0)
+			continue;
+
+		dbus_message_unref(property->signal);
+		property->signal = signal;
+
+		object->properties = g_slist_delete_link(object->properties,
+									list);
+		object->properties = g_slist_append(object->properties,
+								property);
+
+		return TRUE;
+	}
+
+	property = g_try_new0(struct pending_property, 1);
+	if (property == NULL) {
+		dbus_message_unref(signal);
+		return FALSE;
+	}
+
+	property->key = g_strdup(key);
+	property->signal = signal;
+
+	object->properties = g_slist_append(object->properties, property);
+
+	if (pending_flush == 0)
+		pending_flush = g_idle_add(flush_property_changes, NULL);
+
+	return TRUE;
+}
+
 dbus_bool_t connman_dbus_property_changed_basic(const char *path,
 				const char *interface, const char *key,
 							int type, void *val)
@@ -244,9 +518,7 @@ dbus_bool_t connman_dbus_property_changed_basic(const char *path,
 	dbus_message_iter_init_append(signal, &iter);
 	connman_dbus_property_append_basic(&iter, key, type, val);
 
-	g_dbus_send_message(connection, signal);
-
-	return TRUE;
+	return queue_property_changed(path, interface, key, signal);
 }
 
 dbus_bool_t connman_dbus_property_changed_dict(const char *path,
@@ -266,9 +538,7 @@ dbus_bool_t connman_dbus_property_changed_dict(const char *path,
 	dbus_message_iter_init_append(signal, &iter);
 	connman_dbus_property_append_dict(&iter, key, function, user_data);
 
-	g_dbus_send_message(connection, signal);
-
-	return TRUE;
+	return queue_property_changed(path, interface, key, signal);
 }
 
 dbus_bool_t connman_dbus_property_changed_array(const char *path,
@@ -289,9 +559,7 @@ dbus_bool_t connman_dbus_property_changed_array(const char *path,
 	connman_dbus_property_append_array(&iter, key, type,
 						function, user_data);
 
-	g_dbus_send_message(connection, signal);
-
-	return TRUE;
+	return queue_property_changed(path, interface, key, signal);
 }
 
 dbus_bool_t connman_dbus_setting_changed_basic(const char *owner,
@@ -540,6 +808,101 @@ err:
 	return err;
 }
 
+struct unix_user_data {
+	connman_dbus_get_unix_user_cb_t func;
+	void *user_data;
+};
+
+static void get_unix_user_reply(DBusPendingCall *call, void *user_data)
+{
+	struct unix_user_data *data = user_data;
+	DBusMessage *reply;
+	dbus_uint32_t uid = 0;
+	int err = 0;
+
+	reply = dbus_pending_call_steal_reply(call);
+
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		DBG("Failed to retrieve the unix user");
+		err = -EIO;
+		goto done;
+	}
+
+	if (dbus_message_get_args(reply, NULL, DBUS_TYPE_UINT32, &uid,
+					DBUS_TYPE_INVALID) == FALSE) {
+		DBG("Message signature is wrong");
+		err = -EINVAL;
+	}
+
+done:
+	(*data->func)(uid, data->user_data, err);
+
+	dbus_message_unref(reply);
+
+	dbus_pending_call_unref(call);
+}
+
+int connman_dbus_get_connection_unix_user(DBusConnection *connection,
+				const char *bus_name,
+				connman_dbus_get_unix_user_cb_t func,
+				void *user_data)
+{
+	struct unix_user_data *data;
+	DBusPendingCall *call;
+	DBusMessage *msg = NULL;
+	int err;
+
+	if (func == NULL)
+		return -EINVAL;
+
+	data = g_try_new0(struct unix_user_data, 1);
+	if (data == NULL) {
+		DBG("Can't allocate data structure");
+		return -ENOMEM;
+	}
+
+	msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+					DBUS_INTERFACE_DBUS,
+					"GetConnectionUnixUser");
+	if (msg == NULL) {
+		DBG("Can't allocate new message");
+		err = -ENOMEM;
+		goto err;
+	}
+
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &bus_name,
+					DBUS_TYPE_INVALID);
+
+	if (dbus_connection_send_with_reply(connection, msg,
+						&call, -1) == FALSE) {
+		DBG("Failed to execute method call");
+		err = -EINVAL;
+		goto err;
+	}
+
+	if (call == NULL) {
+		DBG("D-Bus connection not available");
+		err = -EINVAL;
+		goto err;
+	}
+
+	data->func = func;
+	data->user_data = user_data;
+
+	dbus_pending_call_set_notify(call, get_unix_user_reply,
+							data, g_free);
+
+	dbus_message_unref(msg);
+
+	return 0;
+
+err:
+	dbus_message_unref(msg);
+	g_free(data);
+
+	return err;
+}
+
 DBusConnection *connman_dbus_get_connection(void)
 {
 	if (connection == NULL)
@@ -548,12 +911,75 @@ DBusConnection *connman_dbus_get_connection(void)
 	return dbus_connection_ref(connection);
 }
 
+static void multi_client_disconnect(DBusConnection *conn, void *user_data)
+{
+	const char *owner = user_data;
+
+	DBG("owner %s", owner);
+
+	g_hash_table_remove(multi_clients, owner);
+}
+
+int __connman_dbus_register_properties_changed(const char *owner)
+{
+	char *key;
+	guint watch;
+
+	DBG("owner %s", owner);
+
+	if (g_hash_table_lookup(multi_clients, owner) != NULL)
+		return -EEXIST;
+
+	key = g_strdup(owner);
+
+	watch = g_dbus_add_disconnect_watch(connection, owner,
+					multi_client_disconnect, key, NULL);
+	if (watch == 0) {
+		g_free(key);
+		return -EIO;
+	}
+
+	g_hash_table_replace(multi_clients, key, GUINT_TO_POINTER(watch));
+
+	return 0;
+}
+
+int __connman_dbus_unregister_properties_changed(const char *owner)
+{
+	gpointer watch;
+
+	DBG("owner %s", owner);
+
+	watch = g_hash_table_lookup(multi_clients, owner);
+	if (watch == NULL)
+		return -ESRCH;
+
+	g_dbus_remove_watch(connection, GPOINTER_TO_UINT(watch));
+	g_hash_table_remove(multi_clients, owner);
+
+	return 0;
+}
+
+static void remove_multi_client(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	g_dbus_remove_watch(connection, GPOINTER_TO_UINT(value));
+}
+
 int __connman_dbus_init(DBusConnection *conn)
 {
 	DBG("");
 
 	connection = conn;
 
+	pending_objects = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, free_pending_object);
+
+	multi_clients = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+
+	g_dbus_set_flush_function(__connman_dbus_flush_property_changes);
+
 	return 0;
 }
 
@@ -561,5 +987,16 @@ void __connman_dbus_cleanup(void)
 {
 	DBG("");
 
+	__connman_dbus_flush_property_changes();
+
+	g_dbus_set_flush_function(NULL);
+
+	g_hash_table_destroy(pending_objects);
+	pending_objects = NULL;
+
+	g_hash_table_foreach(multi_clients, remove_multi_client, NULL);
+	g_hash_table_destroy(multi_clients);
+	multi_clients = NULL;
+
 	connection = NULL;
 }
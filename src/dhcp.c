@@ -45,6 +45,7 @@ struct connman_dhcp {
 	char *pac;
 
 	GDHCPClient *dhcp_client;
+	gint64 start;
 };
 
 static GHashTable *network_table;
@@ -140,6 +141,8 @@ static void no_lease_cb(GDHCPClient *dhcp_client, gpointer user_data)
 
 	DBG("No lease available");
 
+	__connman_metrics_count(CONNMAN_METRIC_DHCP_NO_LEASE);
+
 	dhcp_invalidate(dhcp, TRUE);
 }
 
@@ -149,6 +152,8 @@ static void lease_lost_cb(GDHCPClient *dhcp_client, gpointer user_data)
 
 	DBG("Lease lost");
 
+	__connman_metrics_count(CONNMAN_METRIC_DHCP_LEASE_LOST);
+
 	dhcp_invalidate(dhcp, TRUE);
 }
 
@@ -198,6 +203,13 @@ static void lease_available_cb(GDHCPClient *dhcp_client, gpointer user_data)
 
 	DBG("Lease available");
 
+	/* only the first lease of a request is timed, not the renewals */
+	if (dhcp->start > 0) {
+		__connman_metrics_stop(CONNMAN_METRIC_DHCP_LEASE, dhcp->start);
+		dhcp->start = 0;
+	} else
+		__connman_metrics_count(CONNMAN_METRIC_DHCP_LEASE);
+
 	service = connman_service_lookup_from_network(dhcp->network);
 	if (service == NULL) {
 		connman_error("Can not lookup service");
@@ -455,6 +467,8 @@ static int dhcp_request(struct connman_dhcp *dhcp)
 	 */
 	__connman_ipconfig_clear_address(ipconfig);
 
+	dhcp->start = __connman_metrics_start();
+
 	return g_dhcp_client_start(dhcp_client,
 				__connman_ipconfig_get_dhcp_address(ipconfig));
 }
@@ -0,0 +1,383 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/nameser.h>
+
+#include <glib.h>
+
+#include "connman.h"
+
+/*
+ * DNS packet parser. The packet is never modified or copied, records
+ * are described by offsets into it and the names are only followed
+ * when they are compared or copied. Every access is checked against
+ * the packet length.
+ */
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_POINTERS 32
+
+static inline uint16_t get_uint16(const unsigned char *ptr)
+{
+	return ptr[0] << 8 | ptr[1];
+}
+
+static inline uint32_t get_uint32(const unsigned char *ptr)
+{
+	return (uint32_t) ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
+}
+
+/*
+ * Offset of the label at offset, following the compression pointers.
+ */
+static int label_at(const struct dns_packet *pkt, unsigned int offset,
+								int *hops)
+{
+	while (offset < pkt->len) {
+		unsigned char label = pkt->buf[offset];
+
+		if ((label & NS_CMPRSFLGS) == 0) {
+			if (offset + label + 1 > pkt->len)
+				return -EINVAL;
+
+			return offset;
+		}
+
+		/* the extended label types are not supported */
+		if ((label & NS_CMPRSFLGS) != NS_CMPRSFLGS ||
+						offset + 1 >= pkt->len)
+			return -EINVAL;
+
+		if (++(*hops) > DNS_MAX_POINTERS)
+			return -ELOOP;
+
+		offset = (label & ~NS_CMPRSFLGS) << 8 | pkt->buf[offset + 1];
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Walk the name at offset. The offset following the name in the record
+ * is returned in end, and the name is copied decompressed to out unless
+ * it is NULL. Returns the length of the decompressed name.
+ */
+static int name_walk(const struct dns_packet *pkt, unsigned int offset,
+				unsigned int *end, unsigned char *out)
+{
+	unsigned int len = 0, next = 0;
+	int hops = 0, pos;
+
+	for (;;) {
+		unsigned char label;
+
+		pos = label_at(pkt, offset, &hops);
+		if (pos < 0)
+			return pos;
+
+		/* a pointer ends the name in the record */
+		if (next == 0 && (unsigned int) pos != offset)
+			next = offset + 2;
+
+		label = pkt->buf[pos];
+		if (len + label + 1 > NS_MAXCDNAME)
+			return -EINVAL;
+
+		if (out != NULL)
+			memcpy(out + len, pkt->buf + pos, label + 1);
+
+		len += label + 1;
+		offset = pos + label + 1;
+
+		if (label == 0)
+			break;
+	}
+
+	if (end != NULL)
+		*end = next > 0 ? next : offset;
+
+	return len;
+}
+
+/*
+ * Skip the name at offset without following the compression pointers.
+ */
+static int name_skip(const struct dns_packet *pkt, unsigned int offset)
+{
+	while (offset < pkt->len) {
+		unsigned char label = pkt->buf[offset];
+
+		if ((label & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+			if (offset + 2 > pkt->len)
+				return -EINVAL;
+
+			return offset + 2;
+		}
+
+		if (label & NS_CMPRSFLGS)
+			return -EINVAL;
+
+		offset += label + 1;
+
+		if (label == 0)
+			return offset <= pkt->len ? (int) offset : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+int __connman_dns_parse(struct dns_packet *pkt, const unsigned char *buf,
+							unsigned int len)
+{
+	unsigned int offset = DNS_HEADER_SIZE, end;
+	int i, n;
+
+	memset(pkt, 0, sizeof(*pkt));
+
+	if (len < DNS_HEADER_SIZE)
+		return -EINVAL;
+
+	pkt->buf = buf;
+	pkt->len = len;
+
+	pkt->qdcount = get_uint16(buf + 4);
+	pkt->ancount = get_uint16(buf + 6);
+	pkt->nscount = get_uint16(buf + 8);
+	pkt->arcount = get_uint16(buf + 10);
+
+	for (i = 0; i < pkt->qdcount; i++) {
+		n = name_walk(pkt, offset, &end, NULL);
+		if (n < 0)
+			return n;
+
+		if (end + 4 > len)
+			return -EINVAL;
+
+		if (i == 0) {
+			/*
+			 * The question name must be usable as a string in
+			 * wire format, so it must not be compressed nor
+			 * contain any zero bytes.
+			 */
+			if (end - offset != (unsigned int) n ||
+					strlen((const char *) buf + offset)
+						+ 1 != (unsigned int) n)
+				return -EINVAL;
+
+			pkt->qname = offset;
+			pkt->qname_len = n;
+			pkt->qtype = get_uint16(buf + end);
+			pkt->qclass = get_uint16(buf + end + 2);
+		}
+
+		offset = end + 4;
+	}
+
+	pkt->records = offset;
+
+	return 0;
+}
+
+int __connman_dns_parse_rr(const struct dns_packet *pkt,
+				unsigned int *offset, struct dns_rr *rr)
+{
+	const unsigned char *ptr;
+	int end;
+
+	end = name_skip(pkt, *offset);
+	if (end < 0)
+		return end;
+
+	if ((unsigned int) end + DNS_RR_SIZE > pkt->len)
+		return -EINVAL;
+
+	ptr = pkt->buf + end;
+
+	rr->name = *offset;
+	rr->type = get_uint16(ptr);
+	rr->class = get_uint16(ptr + 2);
+	rr->ttl = get_uint32(ptr + 4);
+	rr->rdlen = get_uint16(ptr + 8);
+	rr->rdata = end + DNS_RR_SIZE;
+
+	if (rr->rdata + rr->rdlen > pkt->len)
+		return -EINVAL;
+
+	*offset = rr->rdata + rr->rdlen;
+
+	return 0;
+}
+
+int __connman_dns_name_length(const struct dns_packet *pkt,
+							unsigned int offset)
+{
+	return name_walk(pkt, offset, NULL, NULL);
+}
+
+int __connman_dns_name_copy(const struct dns_packet *pkt,
+				unsigned int offset, unsigned char *out,
+				unsigned int max)
+{
+	int len;
+
+	len = name_walk(pkt, offset, NULL, NULL);
+	if (len < 0)
+		return len;
+
+	if ((unsigned int) len > max)
+		return -ENOBUFS;
+
+	return name_walk(pkt, offset, NULL, out);
+}
+
+/*
+ * The names are compared case insensitively (RFC 4343).
+ */
+gboolean __connman_dns_name_equal(const struct dns_packet *pkt,
+					unsigned int offset_a,
+					unsigned int offset_b)
+{
+	int hops_a = 0, hops_b = 0;
+
+	for (;;) {
+		int pos_a, pos_b, i;
+		unsigned char label;
+
+		pos_a = label_at(pkt, offset_a, &hops_a);
+		pos_b = label_at(pkt, offset_b, &hops_b);
+		if (pos_a < 0 || pos_b < 0)
+			return FALSE;
+
+		label = pkt->buf[pos_a];
+		if (label != pkt->buf[pos_b])
+			return FALSE;
+
+		for (i = 1; i <= label; i++)
+			if (g_ascii_tolower(pkt->buf[pos_a + i]) !=
+					g_ascii_tolower(pkt->buf[pos_b + i]))
+				return FALSE;
+
+		if (label == 0)
+			return TRUE;
+
+		offset_a = pos_a + label + 1;
+		offset_b = pos_b + label + 1;
+	}
+}
+
+/*
+ * The number of domain names in the rdata of the well known types,
+ * which may be compressed (RFC 3597), and the length of the fixed
+ * fields before them.
+ */
+static int rdata_names(uint16_t type, unsigned int *prefix)
+{
+	*prefix = 0;
+
+	switch (type) {
+	case 2:		/* NS */
+	case 5:		/* CNAME */
+	case 12:	/* PTR */
+		return 1;
+	case 6:		/* SOA */
+		return 2;
+	case 15:	/* MX */
+		*prefix = 2;
+		return 1;
+	case 33:	/* SRV */
+		*prefix = 6;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int rdata_walk(const struct dns_packet *pkt, const struct dns_rr *rr,
+				unsigned char *out, unsigned int max)
+{
+	unsigned int offset = rr->rdata, end = rr->rdata + rr->rdlen;
+	unsigned int prefix, len, next;
+	int names, n;
+
+	names = rdata_names(rr->type, &prefix);
+	if (names == 0)
+		prefix = rr->rdlen;
+
+	if (prefix > rr->rdlen)
+		return -EINVAL;
+
+	if (out != NULL) {
+		if (prefix > max)
+			return -ENOBUFS;
+
+		memcpy(out, pkt->buf + offset, prefix);
+	}
+
+	len = prefix;
+	offset += prefix;
+
+	while (names-- > 0) {
+		n = name_walk(pkt, offset, &next, NULL);
+		if (n < 0)
+			return n;
+
+		if (next > end)
+			return -EINVAL;
+
+		if (out != NULL) {
+			if (len + n > max)
+				return -ENOBUFS;
+
+			name_walk(pkt, offset, NULL, out + len);
+		}
+
+		len += n;
+		offset = next;
+	}
+
+	if (out != NULL) {
+		if (len + end - offset > max)
+			return -ENOBUFS;
+
+		memcpy(out + len, pkt->buf + offset, end - offset);
+	}
+
+	return len + end - offset;
+}
+
+int __connman_dns_rdata_length(const struct dns_packet *pkt,
+						const struct dns_rr *rr)
+{
+	return rdata_walk(pkt, rr, NULL, 0);
+}
+
+int __connman_dns_rdata_copy(const struct dns_packet *pkt,
+				const struct dns_rr *rr, unsigned char *out,
+				unsigned int max)
+{
+	return rdata_walk(pkt, rr, out, max);
+}
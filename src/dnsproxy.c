@@ -23,13 +23,17 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -95,6 +99,19 @@ struct server_data {
 	gboolean enabled;
 	gboolean connected;
 	struct partial_reply *incoming_reply;
+	unsigned int srtt;		/* smoothed RTT in ms, 0 if unknown */
+	unsigned int rttvar;		/* RTT variation in ms */
+	unsigned int failures;		/* failures in a row */
+	time_t last_failure;
+	unsigned int queries;
+	unsigned int replies;
+	unsigned int failed;
+};
+
+struct request_upstream {
+	struct server_data *server;
+	gint64 sent;			/* monotonic time, 0 if not tried */
+	gboolean replied;
 };
 
 struct request_data {
@@ -119,6 +136,13 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	gboolean append_domain;
+	gboolean answered;	/* client already got a reply */
+	gpointer stale;		/* expired cached reply, RFC 8767 */
+	unsigned int stale_len;
+	uint16_t stale_answers;
+	guint stale_timeout;
+	GSList *upstreams;	/* servers to try, best first */
+	guint stagger;
 };
 
 struct listener_data {
@@ -135,7 +159,9 @@ struct cache_data {
 	time_t cache_until;
 	int timeout;
 	uint16_t type;
+	uint16_t class;
 	uint16_t answers;
+	gboolean prefetch;	/* refresh query sent */
 	unsigned int data_len;
 	unsigned char *data; /* contains DNS header + body */
 };
@@ -144,8 +170,11 @@ struct cache_entry {
 	char *key;
 	int want_refresh;
 	int hits;
-	struct cache_data *ipv4;
-	struct cache_data *ipv6;
+	GSList *data;		/* one cache_data per type and class */
+	GList lru_link;		/* position in cache_lru, head is newest */
+	int heap_index;		/* position in cache_heap, -1 if none */
+	time_t expires;		/* heap key, first cache_until of the data */
+	gsize mem;		/* bytes accounted in cache_mem */
 };
 
 struct domain_question {
@@ -171,28 +200,184 @@ struct domain_rr {
  */
 #define MIN_CACHE_TTL (30)
 
+/*
+ * Popular entries are refreshed in the background when a cached
+ * answer has less than CACHE_PREFETCH_PERCENT of its life time left,
+ * so that they do not drop out of the cache.
+ */
+#define CACHE_PREFETCH_HITS 3
+#define CACHE_PREFETCH_PERCENT 10
+
+/*
+ * Expired positive answers are kept for CACHE_STALE_TIME seconds and
+ * served with a TTL of CACHE_STALE_TTL if the servers have not replied
+ * within CACHE_STALE_DELAY milliseconds or fail (RFC 8767).
+ */
+#define CACHE_STALE_TIME (60 * 60 * 24)
+#define CACHE_STALE_TTL 30
+#define CACHE_STALE_DELAY 1800
+
+/*
+ * Upper limit of the answers of a single response that are cached,
+ * larger responses are not cached.
+ */
+#define MAX_CACHE_RESPONSE 4096
+#define CACHE_MAX_RECORDS 64
+#define CACHE_MAX_ALIASES 8
+
 /*
  * We limit the cache size to some sane value so that cached data does
  * not occupy too much memory. Each cached entry occupies on average
  * about 100 bytes memory (depending on DNS name length).
  * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * The value is the default max amount of cached DNS responses (count)
+ * and can be changed with DNSCacheSize in main.conf.
  */
 #define MAX_CACHE_SIZE 256
 
+/*
+ * Default upper limit of the memory used by the cached responses,
+ * can be changed with DNSCacheMemory in main.conf.
+ */
+#define MAX_CACHE_MEMORY (128 * 1024)
+
+/*
+ * With PersistentDNSCache enabled in main.conf the cache is saved to
+ * disk on shutdown, when the default service changes and periodically
+ * (seconds), so that a restart does not begin with a cold cache.
+ */
+#define CACHE_FILE STORAGEDIR "/dnsproxy.cache"
+#define CACHE_FILE_MAGIC 0x7A3D9C15
+#define CACHE_FILE_VERSION 1
+#define CACHE_SAVE_INTERVAL (10 * 60)
+
+/*
+ * The file starts with a header followed by the identifier of the
+ * default service the cache belongs to and by the cached records.
+ * Every part is padded to CACHE_FILE_ALIGN bytes so that the file
+ * can be used as is when mapped into memory.
+ */
+#define CACHE_FILE_ALIGN 8
+#define CACHE_FILE_PAD(len) \
+	((CACHE_FILE_ALIGN - (len) % CACHE_FILE_ALIGN) % CACHE_FILE_ALIGN)
+
+struct cache_file_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t saved;		/* wall clock time of the snapshot */
+	uint32_t count;		/* number of records */
+	uint32_t ident_len;	/* padded length of the identifier */
+};
+
+struct cache_file_record {
+	uint32_t valid;		/* seconds left until valid_until */
+	uint32_t cache;		/* seconds left until cache_until */
+	uint32_t data_len;
+	uint16_t type;
+	uint16_t class;
+	uint16_t answers;
+	uint16_t key_len;	/* includes the terminating \0 */
+	uint32_t reserved;
+};				/* followed by the key and the data */
+
+static gboolean cache_persistent;
+static gboolean cache_dirty;
+static guint cache_save_timer;
+static char *default_ident;
+static struct {
+	void *addr;
+	size_t len;
+} cache_snapshot;		/* mapped until the default service is known */
+
 static int cache_size;
+static gsize cache_mem;
+static unsigned int cache_max_size = MAX_CACHE_SIZE;
+static gsize cache_max_mem = MAX_CACHE_MEMORY;
 static GHashTable *cache;
+static GQueue cache_lru = G_QUEUE_INIT;
+static GPtrArray *cache_heap;
 static int cache_refcount;
+
+static struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long expirations;
+	unsigned long prefetches;
+	unsigned long stale;
+} cache_stats;
+
+/*
+ * The UDP sockets are drained UDP_BATCH_SIZE datagrams at a time, for
+ * at most UDP_BATCH_ROUNDS rounds per wakeup. The datagrams sent while
+ * handling a batch are queued and flushed together at the end.
+ */
+/*
+ * The servers are queried one at a time, best first. The next server
+ * is queried if no reply arrived within the expected round trip time
+ * of the previous one, between SERVER_STAGGER_MIN and SERVER_STAGGER_MAX
+ * milliseconds. Servers that failed within SERVER_FAILURE_TIME seconds
+ * are tried later.
+ */
+#define SERVER_DEFAULT_RTT 200
+#define SERVER_STAGGER_MIN 50
+#define SERVER_STAGGER_MAX 1000
+#define SERVER_FAILURE_TIME 60
+
+/*
+ * TCP connections to the servers are kept open and shared by the
+ * requests, which are pipelined on them (RFC 7766). An idle connection
+ * is closed after TCP_IDLE_TIMEOUT seconds.
+ */
+#define TCP_IDLE_TIMEOUT 30
+
+#define UDP_BATCH_SIZE 16
+#define UDP_BATCH_ROUNDS 4
+#define UDP_BUFFER_SIZE 4096
+
+static struct {
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_in6 addr[UDP_BATCH_SIZE];
+	unsigned char buf[UDP_BATCH_SIZE][UDP_BUFFER_SIZE];
+} udp_rx;
+
+static struct {
+	gboolean active;
+	unsigned int count;
+	int sk[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_in6 addr[UDP_BATCH_SIZE];
+	socklen_t namelen[UDP_BATCH_SIZE];
+} udp_tx;
+
 static GSList *server_list = NULL;
 static GSList *request_list = NULL;
+static GHashTable *request_table = NULL;
 static GHashTable *listener_table = NULL;
-static time_t next_refresh;
 
 static guint16 get_id()
 {
 	return random();
 }
 
+/*
+ * Pick an upstream id that is not used by any pending request so that
+ * the id alone identifies the request when the reply comes back.
+ */
+static guint16 get_unique_id(guint16 exclude)
+{
+	guint16 id;
+
+	do {
+		id = get_id();
+	} while (id == exclude || (request_table != NULL &&
+			g_hash_table_lookup(request_table,
+					GUINT_TO_POINTER(id)) != NULL));
+
+	return id;
+}
+
 static int protocol_offset(int protocol)
 {
 	switch (protocol) {
@@ -231,16 +416,34 @@ static time_t round_down_ttl(time_t end_time, int ttl)
 
 static struct request_data *find_request(guint16 id)
 {
-	GSList *list;
+	return g_hash_table_lookup(request_table, GUINT_TO_POINTER(id));
+}
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+static void request_index_remove(struct request_data *req, guint16 id)
+{
+	if (g_hash_table_lookup(request_table, GUINT_TO_POINTER(id)) == req)
+		g_hash_table_remove(request_table, GUINT_TO_POINTER(id));
+}
 
-		if (req->dstid == id || req->altid == id)
-			return req;
-	}
+/*
+ * The pending requests are kept both in request_list, which is walked
+ * when a server becomes available, and in request_table, which maps
+ * both the dstid and the altid to the request for reply matching.
+ */
+static void add_request(struct request_data *req)
+{
+	request_list = g_slist_append(request_list, req);
 
-	return NULL;
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->dstid), req);
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->altid), req);
+}
+
+static void remove_request(struct request_data *req)
+{
+	request_list = g_slist_remove(request_list, req);
+
+	request_index_remove(req, req->dstid);
+	request_index_remove(req, req->altid);
 }
 
 static struct server_data *find_server(int index,
@@ -272,6 +475,72 @@ static struct server_data *find_server(int index,
 	return NULL;
 }
 
+static struct cache_data *cache_entry_find(struct cache_entry *entry,
+						uint16_t type, uint16_t class)
+{
+	GSList *list;
+
+	for (list = entry->data; list; list = list->next) {
+		struct cache_data *data = list->data;
+
+		if (data->type == type && data->class == class)
+			return data;
+	}
+
+	return NULL;
+}
+
+/*
+ * Time until the data may be used, expired positive answers are
+ * kept a while longer to be served stale.
+ */
+static time_t cache_data_stale_until(struct cache_data *data)
+{
+	if (data->answers == 0)
+		return data->cache_until;
+
+	return data->cache_until + CACHE_STALE_TIME;
+}
+
+static struct cache_data *cache_entry_find_fresh(struct cache_entry *entry,
+						uint16_t type, uint16_t class)
+{
+	struct cache_data *data;
+
+	data = cache_entry_find(entry, type, class);
+	if (data != NULL && data->cache_until < time(NULL))
+		return NULL;
+
+	return data;
+}
+
+static void cache_data_free(struct cache_data *data)
+{
+	g_free(data->data);
+	g_free(data);
+}
+
+/*
+ * Meta query types and pseudo records are not cached.
+ */
+static gboolean cache_type_is_cacheable(uint16_t type)
+{
+	switch (type) {
+	case 0:
+	case 41:	/* OPT */
+	case 249:	/* TKEY */
+	case 250:	/* TSIG */
+	case 251:	/* IXFR */
+	case 252:	/* AXFR */
+	case 253:	/* MAILB */
+	case 254:	/* MAILA */
+	case 255:	/* ANY */
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /* we can keep using the same resolve's */
 static GResolv *ipv4_resolve;
 static GResolv *ipv6_resolve;
@@ -299,14 +568,14 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 		g_resolv_add_nameserver(ipv6_resolve, "127.0.0.1", 53, 0);
 	}
 
-	if (entry->ipv4 == NULL) {
+	if (cache_entry_find_fresh(entry, 1, 1) == NULL) {
 		DBG("Refresing A record for %s", name);
 		g_resolv_lookup_hostname(ipv4_resolve, name,
 					dummy_resolve_func, NULL);
 		age = 4;
 	}
 
-	if (entry->ipv6 == NULL) {
+	if (cache_entry_find_fresh(entry, 28, 1) == NULL) {
 		DBG("Refresing AAAA record for %s", name);
 		g_resolv_lookup_hostname(ipv6_resolve, name,
 					dummy_resolve_func, NULL);
@@ -318,11 +587,21 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 		entry->hits = 0;
 }
 
+/*
+ * Length of a name in wire format, including the terminating zero
+ * label or the trailing compression pointer.
+ */
 static int dns_name_length(unsigned char *buf)
 {
-	if ((buf[0] & NS_CMPRSFLGS) == NS_CMPRSFLGS) /* compressed name */
-		return 2;
-	return strlen((char *)buf);
+	unsigned char *p = buf;
+
+	while (*p != 0) {
+		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) /* compressed name */
+			return p - buf + 2;
+		p += *p + 1;
+	}
+
+	return p - buf + 1;
 }
 
 static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
@@ -373,6 +652,313 @@ static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
 	}
 }
 
+static void server_rtt_sample(struct server_data *server, unsigned int rtt)
+{
+	unsigned int delta;
+
+	if (server->srtt == 0) {
+		server->srtt = rtt > 0 ? rtt : 1;
+		server->rttvar = rtt / 2;
+		return;
+	}
+
+	delta = server->srtt > rtt ? server->srtt - rtt : rtt - server->srtt;
+
+	/* RFC 6298 smoothing */
+	server->rttvar = (3 * server->rttvar + delta) / 4;
+	server->srtt = (7 * server->srtt + rtt) / 8;
+	if (server->srtt == 0)
+		server->srtt = 1;
+}
+
+static void server_failed(struct server_data *server)
+{
+	server->failures++;
+	server->failed++;
+	server->last_failure = time(NULL);
+}
+
+static void server_replied(struct server_data *server, gint64 sent,
+								int rcode)
+{
+	server->replies++;
+
+	/* NXDOMAIN is a valid answer too */
+	if (rcode != 0 && rcode != 3) {
+		server_failed(server);
+		return;
+	}
+
+	server_rtt_sample(server, (g_get_monotonic_time() - sent) / 1000);
+	server->failures = 0;
+}
+
+/*
+ * Milliseconds to wait for a reply before the next server is queried.
+ */
+static unsigned int server_timeout(struct server_data *server)
+{
+	unsigned int timeout;
+
+	if (server->srtt == 0)
+		return 2 * SERVER_DEFAULT_RTT;
+
+	timeout = server->srtt + 4 * server->rttvar;
+	if (timeout < SERVER_STAGGER_MIN)
+		timeout = SERVER_STAGGER_MIN;
+	if (timeout > SERVER_STAGGER_MAX)
+		timeout = SERVER_STAGGER_MAX;
+
+	return timeout;
+}
+
+static unsigned int server_score(struct server_data *server)
+{
+	unsigned int score = server->srtt > 0 ? server->srtt :
+							SERVER_DEFAULT_RTT;
+
+	if (server->failures > 0 &&
+			time(NULL) - server->last_failure < SERVER_FAILURE_TIME)
+		score <<= MIN(server->failures, 8);
+
+	return score;
+}
+
+static gint upstream_compare(gconstpointer a, gconstpointer b)
+{
+	const struct request_upstream *upstream_a = a, *upstream_b = b;
+	unsigned int score_a = server_score(upstream_a->server);
+	unsigned int score_b = server_score(upstream_b->server);
+
+	return score_a < score_b ? -1 : score_a > score_b;
+}
+
+static struct request_upstream *request_find_upstream(
+				struct request_data *req,
+				struct server_data *server)
+{
+	GSList *list;
+
+	for (list = req->upstreams; list; list = list->next) {
+		struct request_upstream *upstream = list->data;
+
+		if (upstream->server == server)
+			return upstream;
+	}
+
+	return NULL;
+}
+
+static gboolean request_untried(struct request_data *req)
+{
+	GSList *list;
+
+	for (list = req->upstreams; list; list = list->next) {
+		struct request_upstream *upstream = list->data;
+
+		if (upstream->sent == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Servers that did not reply within their expected round trip
+ * time count as failed.
+ */
+static void request_upstreams_free(struct request_data *req)
+{
+	gint64 current_time = g_get_monotonic_time();
+	GSList *list;
+
+	if (req->stagger > 0) {
+		g_source_remove(req->stagger);
+		req->stagger = 0;
+	}
+
+	for (list = req->upstreams; list; list = list->next) {
+		struct request_upstream *upstream = list->data;
+
+		if (upstream->sent > 0 && upstream->replied == FALSE &&
+				current_time - upstream->sent >=
+				server_timeout(upstream->server) * 1000)
+			server_failed(upstream->server);
+
+		g_free(upstream);
+	}
+
+	g_slist_free(req->upstreams);
+	req->upstreams = NULL;
+}
+
+/*
+ * The best enabled server with a socket.
+ */
+static struct server_data *best_server(void)
+{
+	struct server_data *best = NULL;
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *server = list->data;
+
+		if (server->protocol != IPPROTO_UDP ||
+				server->enabled == FALSE ||
+				server->channel == NULL)
+			continue;
+
+		if (best == NULL || server_score(server) < server_score(best))
+			best = server;
+	}
+
+	return best;
+}
+
+/*
+ * Receive up to UDP_BATCH_SIZE datagrams of at most size bytes into
+ * udp_rx, returns the number of datagrams.
+ */
+static int udp_batch_recv(int sk, unsigned int size)
+{
+	int i, n;
+
+	for (i = 0; i < UDP_BATCH_SIZE; i++) {
+		struct msghdr *msg = &udp_rx.msgs[i].msg_hdr;
+
+		udp_rx.iov[i].iov_base = udp_rx.buf[i];
+		udp_rx.iov[i].iov_len = size;
+
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_name = &udp_rx.addr[i];
+		msg->msg_namelen = sizeof(udp_rx.addr[i]);
+		msg->msg_iov = &udp_rx.iov[i];
+		msg->msg_iovlen = 1;
+	}
+
+	n = recvmmsg(sk, udp_rx.msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (n >= 0)
+		return n;
+
+	if (errno != ENOSYS)
+		return -errno;
+
+	/* Kernels without recvmmsg get one datagram at a time */
+	n = recvfrom(sk, udp_rx.buf[0], size, MSG_DONTWAIT,
+			udp_rx.msgs[0].msg_hdr.msg_name,
+			&udp_rx.msgs[0].msg_hdr.msg_namelen);
+	if (n < 0)
+		return -errno;
+
+	udp_rx.msgs[0].msg_len = n;
+
+	return 1;
+}
+
+static void udp_batch_begin(void)
+{
+	udp_tx.active = TRUE;
+}
+
+/*
+ * Send the queued datagrams with one sendmmsg() per socket, keeping
+ * the order of the datagrams of each socket.
+ */
+static void udp_batch_flush(void)
+{
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	gboolean sent[UDP_BATCH_SIZE];
+	unsigned int i, j, count;
+	int sk, n;
+
+	memset(sent, 0, sizeof(sent));
+
+	for (i = 0; i < udp_tx.count; i++) {
+		if (sent[i] == TRUE)
+			continue;
+
+		sk = udp_tx.sk[i];
+		count = 0;
+
+		for (j = i; j < udp_tx.count; j++) {
+			struct msghdr *msg = &msgs[count].msg_hdr;
+
+			if (sent[j] == TRUE || udp_tx.sk[j] != sk)
+				continue;
+
+			memset(msg, 0, sizeof(*msg));
+			if (udp_tx.namelen[j] > 0) {
+				msg->msg_name = &udp_tx.addr[j];
+				msg->msg_namelen = udp_tx.namelen[j];
+			}
+			msg->msg_iov = &udp_tx.iov[j];
+			msg->msg_iovlen = 1;
+
+			sent[j] = TRUE;
+			count++;
+		}
+
+		for (j = 0; j < count; j += n) {
+			n = sendmmsg(sk, &msgs[j], count - j, MSG_NOSIGNAL);
+			if (n < 0 && errno == ENOSYS)
+				n = sendmsg(sk, &msgs[j].msg_hdr,
+						MSG_NOSIGNAL) < 0 ? -1 : 1;
+
+			if (n <= 0) {
+				DBG("Cannot send datagram, sk %d errno %d/%s",
+						sk, errno, strerror(errno));
+				/* skip the failing datagram */
+				n = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < udp_tx.count; i++)
+		g_free(udp_tx.iov[i].iov_base);
+
+	udp_tx.count = 0;
+	udp_tx.active = FALSE;
+}
+
+/*
+ * sendto() for UDP sockets, the datagram is queued if a batch is being
+ * handled. The data is copied so the caller may reuse the buffer.
+ */
+static int udp_send(int sk, const void *buf, size_t len,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	unsigned int n = udp_tx.count;
+
+	if (udp_tx.active == FALSE || tolen > sizeof(udp_tx.addr[0]))
+		return sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+
+	if (n == UDP_BATCH_SIZE) {
+		udp_batch_flush();
+		udp_batch_begin();
+		n = 0;
+	}
+
+	udp_tx.iov[n].iov_base = g_try_malloc(len);
+	if (udp_tx.iov[n].iov_base == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memcpy(udp_tx.iov[n].iov_base, buf, len);
+	udp_tx.iov[n].iov_len = len;
+	udp_tx.sk[n] = sk;
+
+	udp_tx.namelen[n] = 0;
+	if (to != NULL) {
+		memcpy(&udp_tx.addr[n], to, tolen);
+		udp_tx.namelen[n] = tolen;
+	}
+
+	udp_tx.count++;
+
+	return len;
+}
+
 static void send_cached_response(int sk, unsigned char *buf, int len,
 				const struct sockaddr *to, socklen_t tolen,
 				int protocol, int id, uint16_t answers, int ttl)
@@ -405,23 +991,26 @@ static void send_cached_response(int sk, unsigned char *buf, int len,
 
 	hdr = (void *) (ptr + offset);
 
+	/*
+	 * The header counts and the rcode of the cached packet were
+	 * set up when the response was cached.
+	 */
 	hdr->id = id;
 	hdr->qr = 1;
-	hdr->rcode = 0;
-	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
-	hdr->arcount = 0;
 
 	/* if this is a negative reply, we are authorative */
 	if (answers == 0)
 		hdr->aa = 1;
-	else
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+
+	update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
 
 	DBG("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
 		sk, hdr->id, answers, ptr, len, dns_len);
 
-	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
+	if (protocol == IPPROTO_UDP)
+		err = udp_send(sk, ptr, len, to, tolen);
+	else
+		err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
 	if (err < 0) {
 		connman_error("Cannot send cached DNS response: %s",
 				strerror(errno));
@@ -460,7 +1049,10 @@ static void send_response(int sk, unsigned char *buf, int len,
 	hdr->nscount = 0;
 	hdr->arcount = 0;
 
-	err = sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+	if (protocol == IPPROTO_UDP)
+		err = udp_send(sk, buf, len, to, tolen);
+	else
+		err = sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
 	if (err < 0) {
 		connman_error("Failed to send DNS response to %d: %s",
 				sk, strerror(errno));
@@ -468,21 +1060,94 @@ static void send_response(int sk, unsigned char *buf, int len,
 	}
 }
 
-static gboolean request_timeout(gpointer user_data)
+/*
+ * Answer the client with the expired cached reply, if there is one.
+ */
+static gboolean send_stale_response(struct request_data *req)
 {
-	struct request_data *req = user_data;
-	struct listener_data *ifdata;
-
-	DBG("id 0x%04x", req->srcid);
+	int sk;
 
-	if (req == NULL)
+	if (req->stale == NULL || req->answered == TRUE)
 		return FALSE;
 
-	ifdata = req->ifdata;
+	DBG("id 0x%04x serving stale answer", req->srcid);
 
-	request_list = g_slist_remove(request_list, req);
+	cache_stats.stale++;
+	req->answered = TRUE;
+
+	if (req->protocol == IPPROTO_TCP) {
+		send_cached_response(req->client_sk, req->stale,
+				req->stale_len, NULL, 0, IPPROTO_TCP,
+				req->srcid, req->stale_answers,
+				CACHE_STALE_TTL);
+		close(req->client_sk);
+		return TRUE;
+	}
+
+	sk = g_io_channel_unix_get_fd(req->ifdata->udp_listener_channel);
+
+	send_cached_response(sk, req->stale, req->stale_len,
+				&req->sa, req->sa_len, IPPROTO_UDP,
+				req->srcid, req->stale_answers,
+				CACHE_STALE_TTL);
+
+	return TRUE;
+}
+
+static gboolean stale_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+
+	req->stale_timeout = 0;
+
+	/* The request is kept so that the reply still updates the cache */
+	send_stale_response(req);
+
+	return FALSE;
+}
+
+/*
+ * Keep a copy of the expired cached reply, it is sent if the servers
+ * do not reply in time.
+ */
+static void request_stale(struct request_data *req, struct cache_data *data)
+{
+	if (req->stale != NULL || req->answered == TRUE)
+		return;
+
+	req->stale = g_try_malloc(data->data_len);
+	if (req->stale == NULL)
+		return;
+
+	memcpy(req->stale, data->data, data->data_len);
+	req->stale_len = data->data_len;
+	req->stale_answers = data->answers;
+
+	req->stale_timeout = g_timeout_add(CACHE_STALE_DELAY,
+						stale_timeout, req);
+}
+
+static void destroy_request_data(struct request_data *req);
+static int resolv_next(struct request_data *req);
+
+static gboolean request_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+	struct listener_data *ifdata;
+
+	DBG("id 0x%04x", req->srcid);
+
+	if (req == NULL)
+		return FALSE;
+
+	ifdata = req->ifdata;
+
+	remove_request(req);
 	req->numserv--;
 
+	if (req->answered == TRUE || send_stale_response(req) == TRUE)
+		goto done;
+
 	if (req->resplen > 0 && req->resp != NULL) {
 		int sk, err;
 
@@ -491,7 +1156,8 @@ static gboolean request_timeout(gpointer user_data)
 		err = sendto(sk, req->resp, req->resplen, MSG_NOSIGNAL,
 						&req->sa, req->sa_len);
 		if (err < 0)
-			return FALSE;
+			DBG("Cannot send msg, sk %d errno %d/%s", sk,
+						errno, strerror(errno));
 	} else if (req->request && req->numserv == 0) {
 		struct domain_hdr *hdr;
 
@@ -513,8 +1179,9 @@ static gboolean request_timeout(gpointer user_data)
 		}
 	}
 
-	g_free(req->resp);
-	g_free(req);
+done:
+	req->timeout = 0;
+	destroy_request_data(req);
 
 	return FALSE;
 }
@@ -574,362 +1241,362 @@ static int append_query(unsigned char *buf, unsigned int size,
 	return ptr - buf;
 }
 
-static gboolean cache_check_is_valid(struct cache_data *data,
-				time_t current_time)
+static time_t cache_entry_expires(struct cache_entry *entry)
 {
-	if (data == NULL)
-		return FALSE;
+	time_t current_time = time(NULL);
+	time_t expires = 0;
+	GSList *list;
 
-	if (data->cache_until < current_time)
-		return FALSE;
+	for (list = entry->data; list; list = list->next) {
+		struct cache_data *data = list->data;
+		time_t until = data->cache_until;
 
-	return TRUE;
+		if (until < current_time)
+			until = cache_data_stale_until(data);
+
+		if (expires == 0 || until < expires)
+			expires = until;
+	}
+
+	return expires;
 }
 
-/*
- * remove stale cached entries so that they can be refreshed
- */
-static void cache_enforce_validity(struct cache_entry *entry)
+static gsize cache_entry_mem(struct cache_entry *entry)
 {
-	time_t current_time = time(NULL);
+	gsize mem = sizeof(*entry) + strlen(entry->key) + 1;
+	GSList *list;
 
-	if (cache_check_is_valid(entry->ipv4, current_time) == FALSE
-							&& entry->ipv4) {
-		DBG("cache timeout \"%s\" type A", entry->key);
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
+	for (list = entry->data; list; list = list->next) {
+		struct cache_data *data = list->data;
 
+		mem += sizeof(GSList) + sizeof(*data) + data->data_len;
 	}
 
-	if (cache_check_is_valid(entry->ipv6, current_time) == FALSE
-							&& entry->ipv6) {
-		DBG("cache timeout \"%s\" type AAAA", entry->key);
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
-	}
+	return mem;
+}
+
+/*
+ * The cache entries are kept in a binary min-heap ordered by the time
+ * the first of their records expires, or stops being served stale if
+ * it has expired already, so that expired entries can be found without
+ * walking the whole cache.
+ */
+#define cache_heap_entry(i) \
+	((struct cache_entry *) g_ptr_array_index(cache_heap, (i)))
+
+static void cache_heap_set(guint i, struct cache_entry *entry)
+{
+	g_ptr_array_index(cache_heap, i) = entry;
+	entry->heap_index = i;
 }
 
-static uint16_t cache_check_validity(char *question, uint16_t type,
-				struct cache_entry *entry)
+static void cache_heap_up(guint i)
 {
-	time_t current_time = time(NULL);
-	int want_refresh = 0;
+	struct cache_entry *entry = cache_heap_entry(i);
 
-	/*
-	 * if we have a popular entry, we want a refresh instead of
-	 * total destruction of the entry.
-	 */
-	if (entry->hits > 2)
-		want_refresh = 1;
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
 
-	cache_enforce_validity(entry);
+		if (cache_heap_entry(parent)->expires <= entry->expires)
+			break;
 
-	switch (type) {
-	case 1:		/* IPv4 */
-		if (cache_check_is_valid(entry->ipv4, current_time) == FALSE) {
-			DBG("cache %s \"%s\" type A", entry->ipv4 ?
-					"timeout" : "entry missing", question);
+		cache_heap_set(i, cache_heap_entry(parent));
+		i = parent;
+	}
 
-			if (want_refresh)
-				entry->want_refresh = 1;
+	cache_heap_set(i, entry);
+}
 
-			/*
-			 * We do not remove cache entry if there is still
-			 * valid IPv6 entry found in the cache.
-			 */
-			if (cache_check_is_valid(entry->ipv6, current_time)
-					== FALSE && want_refresh == FALSE) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
+static void cache_heap_down(guint i)
+{
+	struct cache_entry *entry = cache_heap_entry(i);
 
-	case 28:	/* IPv6 */
-		if (cache_check_is_valid(entry->ipv6, current_time) == FALSE) {
-			DBG("cache %s \"%s\" type AAAA", entry->ipv6 ?
-					"timeout" : "entry missing", question);
+	while (2 * i + 1 < cache_heap->len) {
+		guint child = 2 * i + 1;
 
-			if (want_refresh)
-				entry->want_refresh = 1;
+		if (child + 1 < cache_heap->len &&
+				cache_heap_entry(child + 1)->expires <
+					cache_heap_entry(child)->expires)
+			child++;
 
-			if (cache_check_is_valid(entry->ipv4, current_time)
-					== FALSE && want_refresh == FALSE) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
+		if (entry->expires <= cache_heap_entry(child)->expires)
+			break;
+
+		cache_heap_set(i, cache_heap_entry(child));
+		i = child;
 	}
 
-	return type;
+	cache_heap_set(i, entry);
 }
 
-static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
+static void cache_heap_remove(struct cache_entry *entry)
 {
-	char *question;
-	struct cache_entry *entry;
-	struct domain_question *q;
-	uint16_t type;
-	int offset, proto_offset;
+	guint i = entry->heap_index;
+	struct cache_entry *last;
 
-	if (request == NULL)
-		return NULL;
+	if (entry->heap_index < 0)
+		return;
 
-	proto_offset = protocol_offset(proto);
-	if (proto_offset < 0)
-		return NULL;
+	entry->heap_index = -1;
 
-	question = request + proto_offset + 12;
+	last = g_ptr_array_remove_index(cache_heap, cache_heap->len - 1);
+	if (last == entry)
+		return;
 
-	offset = strlen(question) + 1;
-	q = (void *) (question + offset);
-	type = ntohs(q->type);
+	cache_heap_set(i, last);
+	cache_heap_up(i);
+	cache_heap_down(last->heap_index);
+}
 
-	/* We only cache either A (1) or AAAA (28) requests */
-	if (type != 1 && type != 28)
-		return NULL;
+static void cache_heap_update(struct cache_entry *entry)
+{
+	if (entry->expires == 0) {
+		cache_heap_remove(entry);
+		return;
+	}
 
-	entry = g_hash_table_lookup(cache, question);
-	if (entry == NULL)
-		return NULL;
+	if (entry->heap_index < 0) {
+		g_ptr_array_add(cache_heap, entry);
+		entry->heap_index = cache_heap->len - 1;
+	}
 
-	type = cache_check_validity(question, type, entry);
-	if (type == 0)
-		return NULL;
+	cache_heap_up(entry->heap_index);
+	cache_heap_down(entry->heap_index);
+}
 
-	*qtype = type;
-	return entry;
+/*
+ * Must be called whenever cached data is added to or removed from
+ * an entry that is in the cache.
+ */
+static void cache_entry_changed(struct cache_entry *entry)
+{
+	cache_mem -= entry->mem;
+	entry->mem = cache_entry_mem(entry);
+	cache_mem += entry->mem;
+
+	entry->expires = cache_entry_expires(entry);
+	cache_heap_update(entry);
+}
+
+static void cache_hit(struct cache_entry *entry)
+{
+	entry->hits++;
+	cache_stats.hits++;
+
+	g_queue_unlink(&cache_lru, &entry->lru_link);
+	g_queue_push_head_link(&cache_lru, &entry->lru_link);
 }
 
 /*
- * Get a label/name from DNS resource record. The function decompresses the
- * label if necessary. The function does not convert the name to presentation
- * form. This means that the result string will contain label lengths instead
- * of dots between labels. We intentionally do not want to convert to dotted
- * format so that we can cache the wire format string directly.
+ * Drop the least recently used entries until there is room for
+ * new_entries more entries and needed more bytes. The keep entry
+ * is never evicted.
  */
-static int get_name(int counter,
-		unsigned char *pkt, unsigned char *start, unsigned char *max,
-		unsigned char *output, int output_max, int *output_len,
-		unsigned char **end, char *name, int *name_len)
+static void cache_evict(struct cache_entry *keep, int new_entries,
+							gsize needed)
 {
-	unsigned char *p;
+	while (cache_lru.tail != NULL && cache_lru.tail->data != keep) {
+		struct cache_entry *entry = cache_lru.tail->data;
 
-	/* Limit recursion to 10 (this means up to 10 labels in domain name) */
-	if (counter > 10)
-		return -EINVAL;
+		if (cache_size + new_entries <= (int) cache_max_size &&
+				cache_mem + needed <= cache_max_mem)
+			break;
 
-	p = start;
-	while (*p) {
-		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
-			uint16_t offset = (*p & 0x3F) * 256 + *(p + 1);
+		DBG("evicting \"%s\" hits %d", entry->key, entry->hits);
 
-			if (offset >= max - pkt)
-				return -ENOBUFS;
+		cache_stats.evictions++;
+		g_hash_table_remove(cache, entry->key);
+	}
+}
 
-			if (*end == NULL)
-				*end = p + 2;
+static gboolean cache_check_is_valid(struct cache_data *data,
+				time_t current_time)
+{
+	if (data == NULL)
+		return FALSE;
 
-			return get_name(counter + 1, pkt, pkt + offset, max,
-					output, output_max, output_len, end,
-					name, name_len);
-		} else {
-			unsigned label_len = *p;
+	if (cache_data_stale_until(data) < current_time)
+		return FALSE;
 
-			if (pkt + label_len > max)
-				return -ENOBUFS;
+	return TRUE;
+}
 
-			if (*output_len > output_max)
-				return -ENOBUFS;
+/*
+ * remove stale cached entries so that they can be refreshed
+ */
+static void cache_enforce_validity(struct cache_entry *entry)
+{
+	time_t current_time = time(NULL);
+	GSList *list = entry->data;
 
-			/*
-			 * We need the original name in order to check
-			 * if this answer is the correct one.
-			 */
-			name[(*name_len)++] = label_len;
-			memcpy(name + *name_len, p + 1,	label_len + 1);
-			*name_len += label_len;
+	while (list != NULL) {
+		struct cache_data *data = list->data;
 
-			/* We compress the result */
-			output[0] = NS_CMPRSFLGS;
-			output[1] = 0x0C;
-			*output_len = 2;
+		list = list->next;
 
-			p += label_len + 1;
+		if (cache_check_is_valid(data, current_time) == TRUE)
+			continue;
 
-			if (*end == NULL)
-				*end = p;
+		DBG("cache timeout \"%s\" type %d", entry->key, data->type);
 
-			if (p >= max)
-				return -ENOBUFS;
-		}
+		entry->data = g_slist_remove(entry->data, data);
+		cache_data_free(data);
 	}
 
-	return 0;
+	cache_entry_changed(entry);
 }
 
-static int parse_rr(unsigned char *buf, unsigned char *start,
-			unsigned char *max,
-			unsigned char *response, unsigned int *response_size,
-			uint16_t *type, uint16_t *class, int *ttl, int *rdlen,
-			unsigned char **end,
-			char *name)
+static struct cache_data *cache_check_validity(char *question, uint16_t type,
+				uint16_t class, struct cache_entry *entry,
+				gboolean *stale)
 {
-	struct domain_rr *rr;
-	int err, offset;
-	int name_len = 0, output_len = 0, max_rsp = *response_size;
-
-	err = get_name(0, buf, start, max, response, max_rsp,
-		&output_len, end, name, &name_len);
-	if (err < 0)
-		return err;
+	struct cache_data *data;
+	int want_refresh = 0;
 
-	offset = output_len;
+	/*
+	 * if we have a popular entry, we want a refresh instead of
+	 * total destruction of the entry.
+	 */
+	if (entry->hits > 2)
+		want_refresh = 1;
 
-	if ((unsigned int) offset > *response_size)
-		return -ENOBUFS;
+	cache_enforce_validity(entry);
 
-	rr = (void *) (*end);
+	data = cache_entry_find(entry, type, class);
+	if (data != NULL) {
+		*stale = data->cache_until < time(NULL);
+		return data;
+	}
 
-	if (rr == NULL)
-		return -EINVAL;
+	DBG("cache entry missing \"%s\" type %d", question, type);
 
-	*type = ntohs(rr->type);
-	*class = ntohs(rr->class);
-	*ttl = ntohl(rr->ttl);
-	*rdlen = ntohs(rr->rdlen);
+	if (want_refresh)
+		entry->want_refresh = 1;
 
-	if (*ttl < 0)
-		return -EINVAL;
+	/*
+	 * We do not remove cache entry if there is still
+	 * valid data of other type found in the cache.
+	 */
+	if (entry->data == NULL && want_refresh == FALSE)
+		g_hash_table_remove(cache, question);
 
-	memcpy(response + offset, *end, sizeof(struct domain_rr));
+	return NULL;
+}
 
-	offset += sizeof(struct domain_rr);
-	*end += sizeof(struct domain_rr);
+/*
+ * Look up the cached answer of the request. An expired answer that can
+ * still be served stale is returned with stale set, it must only be
+ * used if the servers do not reply.
+ */
+static struct cache_entry *cache_check(gpointer request,
+				struct cache_data **data, gboolean *stale,
+				int proto)
+{
+	char *question;
+	struct cache_entry *entry;
+	struct domain_question *q;
+	uint16_t type, class;
+	int offset, proto_offset;
 
-	if ((unsigned int) (offset + *rdlen) > *response_size)
-		return -ENOBUFS;
+	*stale = FALSE;
 
-	memcpy(response + offset, *end, *rdlen);
+	if (request == NULL)
+		return NULL;
 
-	*end += *rdlen;
+	proto_offset = protocol_offset(proto);
+	if (proto_offset < 0)
+		return NULL;
 
-	*response_size = offset + *rdlen;
+	question = request + proto_offset + 12;
 
-	return 0;
-}
+	offset = strlen(question) + 1;
+	q = (void *) (question + offset);
+	type = ntohs(q->type);
+	class = ntohs(q->class);
 
-static gboolean check_alias(GSList *aliases, char *name)
-{
-	GSList *list;
+	if (cache_type_is_cacheable(type) == FALSE)
+		return NULL;
 
-	if (aliases != NULL) {
-		for (list = aliases; list; list = list->next) {
-			int len = strlen((char *)list->data);
-			if (strncmp((char *)list->data, name, len) == 0)
-				return TRUE;
-		}
+	entry = g_hash_table_lookup(cache, question);
+	if (entry == NULL) {
+		cache_stats.misses++;
+		return NULL;
 	}
 
-	return FALSE;
-}
-
-static int parse_response(unsigned char *buf, int buflen,
-			char *question, int qlen,
-			uint16_t *type, uint16_t *class, int *ttl,
-			unsigned char *response, unsigned int *response_len,
-			uint16_t *answers)
-{
-	struct domain_hdr *hdr = (void *) buf;
-	struct domain_question *q;
-	unsigned char *ptr;
-	uint16_t qdcount = ntohs(hdr->qdcount);
-	uint16_t ancount = ntohs(hdr->ancount);
-	int err, i;
-	uint16_t qtype, qclass;
-	unsigned char *next = NULL;
-	unsigned int maxlen = *response_len;
-	GSList *aliases = NULL, *list;
-	char name[NS_MAXDNAME + 1];
-
-	if (buflen < 12)
-		return -EINVAL;
-
-	DBG("qr %d qdcount %d", hdr->qr, qdcount);
+	*data = cache_check_validity(question, type, class, entry, stale);
+	if (*data == NULL || *stale == TRUE)
+		cache_stats.misses++;
 
-	/* We currently only cache responses where question count is 1 */
-	if (hdr->qr != 1 || qdcount != 1)
-		return -EINVAL;
+	if (*data == NULL)
+		return NULL;
 
-	ptr = buf + sizeof(struct domain_hdr);
+	return entry;
+}
 
-	strncpy(question, (char *) ptr, qlen);
-	qlen = strlen(question);
-	ptr += qlen + 1; /* skip \0 */
+/*
+ * The records of a response that are cached, as offsets into the
+ * received packet. They are copied out only once, straight into the
+ * cached data.
+ */
+struct cache_response {
+	struct dns_packet pkt;
+	int ttl;
+	uint16_t answers;
+	uint16_t authorities;
+	unsigned int count;
+	unsigned int len;		/* length of the copied records */
+	struct dns_rr records[CACHE_MAX_RECORDS];
+};
 
-	q = (void *) ptr;
-	qtype = ntohs(q->type);
+static gboolean response_name_matches(struct cache_response *rsp,
+				unsigned int *aliases, int num_aliases,
+				unsigned int name)
+{
+	int i;
 
-	/* We cache only A and AAAA records */
-	if (qtype != 1 && qtype != 28)
-		return -ENOMSG;
+	if (__connman_dns_name_equal(&rsp->pkt, name, rsp->pkt.qname) == TRUE)
+		return TRUE;
 
-	qclass = ntohs(q->class);
+	for (i = 0; i < num_aliases; i++)
+		if (__connman_dns_name_equal(&rsp->pkt, name,
+						aliases[i]) == TRUE)
+			return TRUE;
 
-	ptr += 2 + 2; /* ptr points now to answers */
+	return FALSE;
+}
 
-	err = -ENOMSG;
-	*response_len = 0;
-	*answers = 0;
+static int parse_response(struct cache_response *rsp)
+{
+	struct dns_packet *pkt = &rsp->pkt;
+	unsigned int offset = pkt->records;
+	unsigned int aliases[CACHE_MAX_ALIASES];
+	int i, num_aliases = 0;
 
 	/*
 	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
-	 * A or AAAA question. We traverse the answers and parse the
-	 * resource records. Only A and AAAA records are cached, all
-	 * the other records in answers are skipped.
+	 * the question. We traverse the answers and parse the
+	 * resource records. Only the records of the question type are
+	 * cached, all the other records in answers are skipped. The
+	 * cached records get the smallest TTL of the records that
+	 * lead to them.
 	 */
-	for (i = 0; i < ancount; i++) {
-		/*
-		 * Get one address at a time to this buffer.
-		 * The max size of the answer is
-		 *   2 (pointer) + 2 (type) + 2 (class) +
-		 *   4 (ttl) + 2 (rdlen) + addr (16 or 4) = 28
-		 * for A or AAAA record.
-		 * For CNAME the size can be bigger.
-		 */
-		unsigned char rsp[NS_MAXCDNAME];
-		unsigned int rsp_len = sizeof(rsp) - 1;
-		int ret, rdlen;
+	for (i = 0; i < pkt->ancount; i++) {
+		struct dns_rr rr;
+		int err, len;
 
-		memset(rsp, 0, sizeof(rsp));
-
-		ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name);
-		if (ret != 0) {
-			err = ret;
-			goto out;
-		}
+		err = __connman_dns_parse_rr(pkt, &offset, &rr);
+		if (err < 0)
+			return err;
 
-		/*
-		 * Now rsp contains compressed or uncompressed resource
-		 * record. Next we check if this record answers the question.
-		 * The name var contains the uncompressed label.
-		 * One tricky bit is the CNAME records as they alias
-		 * the name we might be interested in.
-		 */
+		if (rr.ttl > G_MAXINT32)
+			return -EINVAL;
 
 		/*
 		 * Go to next answer if the class is not the one we are
 		 * looking for.
 		 */
-		if (*class != qclass) {
-			ptr = next;
-			next = NULL;
+		if (rr.class != pkt->qclass)
 			continue;
-		}
 
 		/*
 		 * Try to resolve aliases also, type is CNAME(5).
@@ -952,177 +1619,161 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * address of ipv6.l.google.com. For caching purposes this
 		 * should not cause any issues.
 		 */
-		if (*type == 5 && strncmp(question, name, qlen) == 0) {
-			/*
-			 * So now the alias answered the question. This is
-			 * not very useful from caching point of view as
-			 * the following A or AAAA records will not match the
-			 * question. We need to find the real A/AAAA record
-			 * of the alias and cache that.
-			 */
-			unsigned char *end = NULL;
-			int name_len = 0, output_len;
-
-			memset(rsp, 0, sizeof(rsp));
-			rsp_len = sizeof(rsp) - 1;
-
-			/*
-			 * Alias is in rdata part of the message,
-			 * and next-rdlen points to it. So we need to get
-			 * the real name of the alias.
-			 */
-			ret = get_name(0, buf, next - rdlen, buf + buflen,
-					rsp, rsp_len, &output_len, &end,
-					name, &name_len);
-			if (ret != 0) {
-				/* just ignore the error at this point */
-				ptr = next;
-				next = NULL;
+		if (rr.type == 5 && pkt->qtype != 5) {
+			if (response_name_matches(rsp, aliases, num_aliases,
+							rr.name) == FALSE)
 				continue;
-			}
 
 			/*
-			 * We should now have the alias of the entry we might
-			 * want to cache. Just remember it for a while.
-			 * We check the alias list when we have parsed the
-			 * A or AAAA record.
+			 * The alias is the name in the rdata, the records
+			 * of the alias are checked against it.
 			 */
-			aliases = g_slist_prepend(aliases, g_strdup(name));
+			if (num_aliases < CACHE_MAX_ALIASES)
+				aliases[num_aliases++] = rr.rdata;
 
-			ptr = next;
-			next = NULL;
-			continue;
-		}
+			if (rsp->ttl == 0 || (int) rr.ttl < rsp->ttl)
+				rsp->ttl = rr.ttl;
 
-		if (*type == qtype) {
-			/*
-			 * We found correct type (A or AAAA)
-			 */
-			if (check_alias(aliases, name) == TRUE ||
-				(aliases == NULL && strncmp(question, name,
-							qlen) == 0)) {
-				/*
-				 * We found an alias or the name of the rr
-				 * matches the question. If so, we append
-				 * the compressed label to the cache.
-				 * The end result is a response buffer that
-				 * will contain one or more cached and
-				 * compressed resource records.
-				 */
-				if (*response_len + rsp_len > maxlen) {
-					err = -ENOBUFS;
-					goto out;
-				}
-				memcpy(response + *response_len, rsp, rsp_len);
-				*response_len += rsp_len;
-				(*answers)++;
-				err = 0;
-			}
+			continue;
 		}
 
-		ptr = next;
-		next = NULL;
-	}
+		if (rr.type != pkt->qtype)
+			continue;
 
-out:
-	for (list = aliases; list; list = list->next)
-		g_free(list->data);
-	g_slist_free(aliases);
+		if (response_name_matches(rsp, aliases, num_aliases,
+							rr.name) == FALSE)
+			continue;
 
-	return err;
-}
+		/*
+		 * The owner of the cached record is a pointer to the
+		 * question, and the names in the rdata are decompressed.
+		 */
+		len = __connman_dns_rdata_length(pkt, &rr);
+		if (len < 0)
+			return len;
 
-struct cache_timeout {
-	time_t current_time;
-	int max_timeout;
-	int try_harder;
-};
+		if (rsp->count == CACHE_MAX_RECORDS ||
+				rsp->len + 2 + DNS_RR_SIZE + len >
+						MAX_CACHE_RESPONSE)
+			return -ENOBUFS;
 
-static gboolean cache_check_entry(gpointer key, gpointer value,
-					gpointer user_data)
+		rsp->records[rsp->count++] = rr;
+		rsp->len += 2 + DNS_RR_SIZE + len;
+		rsp->answers++;
+
+		if (rsp->ttl == 0 || (int) rr.ttl < rsp->ttl)
+			rsp->ttl = rr.ttl;
+	}
+
+	if (rsp->answers == 0)
+		return -ENOMSG;
+
+	return 0;
+}
+
+/*
+ * Parse a NXDOMAIN or NODATA response. As described in RFC 2308 the
+ * negative answer is cached for the lesser of the SOA record TTL and
+ * its MINIMUM field, so the SOA from the authority section is cached
+ * with its owner name uncompressed.
+ */
+static int parse_negative_response(struct cache_response *rsp)
 {
-	struct cache_timeout *data = user_data;
-	struct cache_entry *entry = value;
-	int max_timeout;
+	struct dns_packet *pkt = &rsp->pkt;
+	unsigned int offset = pkt->records;
+	int i;
 
-	/* Scale the number of hits by half as part of cache aging */
+	rsp->count = 0;
+	rsp->len = 0;
+	rsp->answers = 0;
+	rsp->ttl = 0;
 
-	entry->hits /= 2;
+	for (i = 0; i < pkt->ancount + pkt->nscount; i++) {
+		struct dns_rr rr;
+		uint32_t minimum;
+		int err, name_len, len;
 
-	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
-	 */
+		err = __connman_dns_parse_rr(pkt, &offset, &rr);
+		if (err < 0)
+			return err;
 
-	if (entry->ipv4 != NULL && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+		/* SOA (6) in the authority section */
+		if (i < pkt->ancount || rr.type != 6)
+			continue;
 
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
-	}
+		/* the rdata ends with SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM */
+		if (rr.rdlen < 2 + 20 || rr.ttl > G_MAXINT32)
+			return -EINVAL;
 
-	if (entry->ipv6 != NULL && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+		name_len = __connman_dns_name_length(pkt, rr.name);
+		if (name_len < 0)
+			return name_len;
 
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
-	}
+		len = __connman_dns_rdata_length(pkt, &rr);
+		if (len < 0)
+			return len;
 
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
+		if (name_len + DNS_RR_SIZE + len > MAX_CACHE_RESPONSE)
+			return -ENOBUFS;
 
-	return FALSE;
+		minimum = ntohl(*(uint32_t *) (pkt->buf + rr.rdata +
+							rr.rdlen - 4));
+
+		rsp->records[0] = rr;
+		rsp->count = 1;
+		rsp->len = name_len + DNS_RR_SIZE + len;
+		rsp->authorities = 1;
+		rsp->ttl = rr.ttl < minimum ? rr.ttl : minimum;
+
+		return 0;
+	}
+
+	return -ENOENT;
 }
 
-static void cache_cleanup(void)
+/*
+ * Copy the records of the response to out, which must have room for
+ * rsp->len bytes.
+ */
+static int cache_response_copy(struct cache_response *rsp,
+						unsigned char *out)
 {
-	static int max_timeout;
-	struct cache_timeout data;
-	int count = 0;
+	struct dns_packet *pkt = &rsp->pkt;
+	unsigned int i, len = 0;
 
-	data.current_time = time(NULL);
-	data.max_timeout = 0;
-	data.try_harder = 0;
+	for (i = 0; i < rsp->count; i++) {
+		struct dns_rr *rr = &rsp->records[i];
+		int n;
 
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-	}
-	DBG("removed %d in the first pass", count);
+		if (rsp->authorities > 0) {
+			n = __connman_dns_name_copy(pkt, rr->name, out + len,
+								rsp->len - len);
+			if (n < 0)
+				return n;
 
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = 1;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+			len += n;
+		} else {
+			out[len++] = NS_CMPRSFLGS;
+			out[len++] = 0x0C;
+		}
 
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+		/* type, class and TTL */
+		memcpy(out + len, pkt->buf + rr->rdata - DNS_RR_SIZE,
+							DNS_RR_SIZE - 2);
+		len += DNS_RR_SIZE;
+
+		/* the rdata length changes if names were decompressed */
+		n = __connman_dns_rdata_copy(pkt, rr, out + len,
+							rsp->len - len);
+		if (n < 0)
+			return n;
+
+		out[len - 2] = n >> 8;
+		out[len - 1] = n & 0xff;
+		len += n;
+	}
+
+	return len;
 }
 
 static gboolean cache_invalidate_entry(gpointer key, gpointer value,
@@ -1134,27 +1785,20 @@ static gboolean cache_invalidate_entry(gpointer key, gpointer value,
 	cache_enforce_validity(entry);
 
 	/* if anything is not expired, mark the entry for refresh */
-	if (entry->hits > 0 && (entry->ipv4 || entry->ipv6))
+	if (entry->hits > 0 && entry->data != NULL)
 		entry->want_refresh = 1;
 
 	/* delete the cached data */
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-	}
-
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
-	}
+	g_slist_free_full(entry->data, (GDestroyNotify) cache_data_free);
+	entry->data = NULL;
 
 	/* keep the entry if we want it refreshed, delete it otherwise */
-	if (entry->want_refresh)
+	if (entry->want_refresh) {
+		cache_entry_changed(entry);
 		return FALSE;
-	else
-		return TRUE;
+	}
+
+	return TRUE;
 }
 
 /*
@@ -1178,9 +1822,9 @@ static void cache_refresh_entry(struct cache_entry *entry)
 
 	cache_enforce_validity(entry);
 
-	if (entry->hits > 2 && entry->ipv4 == NULL)
+	if (entry->hits > 2 && cache_entry_find_fresh(entry, 1, 1) == NULL)
 		entry->want_refresh = 1;
-	if (entry->hits > 2 && entry->ipv6 == NULL)
+	if (entry->hits > 2 && cache_entry_find_fresh(entry, 28, 1) == NULL)
 		entry->want_refresh = 1;
 
 	if (entry->want_refresh) {
@@ -1219,27 +1863,104 @@ static void cache_refresh(void)
 	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
 }
 
-static int reply_query_type(unsigned char *msg, int len)
+/*
+ * Remove the cached records that have expired, oldest first. Popular
+ * entries are kept and refreshed in the background, the hit count of
+ * every expired entry is halved as part of cache aging.
+ */
+static void cache_expire(time_t current_time)
 {
-	unsigned char *c;
-	uint16_t *w;
-	int l;
-	int type;
+	while (cache_heap != NULL && cache_heap->len > 0) {
+		struct cache_entry *entry = cache_heap_entry(0);
 
-	/* skip the header */
-	c = msg + sizeof(struct domain_hdr);
-	len -= sizeof(struct domain_hdr);
+		if (entry->expires >= current_time)
+			break;
 
-	if (len < 0)
-		return 0;
+		cache_stats.expirations++;
 
-	/* now the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c) + 1;
-	c += l;
-	w = (uint16_t *) c;
-	type = ntohs(*w);
+		if (entry->hits > 2)
+			entry->want_refresh = 1;
+
+		entry->hits /= 2;
+
+		cache_enforce_validity(entry);
+
+		if (entry->want_refresh)
+			cache_refresh_entry(entry);
+		else if (entry->data == NULL)
+			g_hash_table_remove(cache, entry->key);
+	}
+}
+
+/*
+ * Newer data replaces the cached data of the same type and class,
+ * except that a negative answer does not replace a valid positive one.
+ */
+static gboolean cache_data_replaces(struct cache_data *old,
+						uint16_t answers)
+{
+	if (old->answers > 0 && answers == 0 &&
+			old->cache_until >= time(NULL))
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Add the data to the cache entry of the key, creating the entry if
+ * needed. Returns NULL if the data was not added, the data is freed
+ * then.
+ */
+static struct cache_entry *cache_insert(const char *key,
+				struct cache_data *data, gboolean *new_entry)
+{
+	struct cache_entry *entry;
+	struct cache_data *old;
+	gsize needed;
+
+	entry = g_hash_table_lookup(cache, key);
+
+	needed = sizeof(GSList) + sizeof(*data) + data->data_len;
+	if (entry == NULL)
+		needed += sizeof(*entry) + strlen(key) + 1;
+
+	cache_evict(entry, entry == NULL ? 1 : 0, needed);
 
-	return type;
+	if (entry == NULL) {
+		entry = g_try_new0(struct cache_entry, 1);
+		if (entry == NULL) {
+			cache_data_free(data);
+			return NULL;
+		}
+
+		entry->key = g_strdup(key);
+		entry->lru_link.data = entry;
+		entry->heap_index = -1;
+
+		g_hash_table_replace(cache, entry->key, entry);
+		g_queue_push_head_link(&cache_lru, &entry->lru_link);
+		cache_size++;
+
+		*new_entry = TRUE;
+	} else {
+		old = cache_entry_find(entry, data->type, data->class);
+		if (old != NULL) {
+			if (cache_data_replaces(old, data->answers) == FALSE) {
+				cache_data_free(data);
+				return NULL;
+			}
+
+			entry->data = g_slist_remove(entry->data, old);
+			cache_data_free(old);
+		}
+
+		*new_entry = FALSE;
+	}
+
+	entry->data = g_slist_prepend(entry->data, data);
+	cache_entry_changed(entry);
+
+	return entry;
 }
 
 static int cache_update(struct server_data *srv, unsigned char *msg,
@@ -1247,140 +1968,173 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 {
 	int offset = protocol_offset(srv->protocol);
 	int err, qlen, ttl = 0;
-	uint16_t answers = 0, type = 0, class = 0;
+	uint16_t type, class;
 	struct domain_hdr *hdr = (void *)(msg + offset);
-	struct domain_question *q;
+	struct cache_response rsp;
 	struct cache_entry *entry;
 	struct cache_data *data;
-	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
+	const char *question;
 	unsigned char *ptr;
-	unsigned int rsplen;
-	gboolean new_entry = TRUE;
+	gboolean new_entry;
 	time_t current_time;
 
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
-
 	current_time = time(NULL);
 
-	/* don't do a cache refresh more than twice a minute */
-	if (next_refresh < current_time) {
-		cache_refresh();
-		next_refresh = current_time + 30;
-	}
+	cache_expire(current_time);
 
 	if (offset < 0)
 		return 0;
 
 	DBG("offset %d hdr %p msg %p rcode %d", offset, hdr, msg, hdr->rcode);
 
-	/* Continue only if response code is 0 (=ok) */
-	if (hdr->rcode != 0)
+	/*
+	 * Continue only if response code is 0 (=ok) or 3 (=no such
+	 * domain) that is cached as a negative answer.
+	 */
+	if (hdr->rcode != 0 && hdr->rcode != 3)
+		return 0;
+
+	/* the records are only filled in as they are parsed */
+	memset(&rsp, 0, sizeof(rsp) - sizeof(rsp.records));
+
+	err = __connman_dns_parse(&rsp.pkt, msg + offset, msg_len - offset);
+	if (err < 0)
 		return 0;
 
-	rsplen = sizeof(response) - 1;
-	question[sizeof(question) - 1] = '\0';
+	/* We currently only cache responses where question count is 1 */
+	if (hdr->qr != 1 || rsp.pkt.qdcount != 1)
+		return 0;
+
+	type = rsp.pkt.qtype;
+	class = rsp.pkt.qclass;
+
+	if (cache_type_is_cacheable(type) == FALSE)
+		return 0;
 
-	err = parse_response(msg + offset, msg_len - offset,
-				question, sizeof(question) - 1,
-				&type, &class, &ttl,
-				response, &rsplen, &answers);
+	/* the question name is a string in wire format */
+	question = (const char *) rsp.pkt.buf + rsp.pkt.qname;
+	qlen = rsp.pkt.qname_len - 1;
+
+	if (hdr->rcode == 0)
+		err = parse_response(&rsp);
+	else
+		err = -ENOMSG;
 
 	/*
-	 * special case: if we do a ipv6 lookup and get no result
-	 * for a record that's already in our ipv4 cache.. we want
-	 * to cache the negative response.
+	 * No matching answers (NODATA) or no such domain (NXDOMAIN),
+	 * cache the negative response.
 	 */
-	if ((err == -ENOMSG || err == -ENOBUFS) &&
-			reply_query_type(msg + offset,
-					msg_len - offset) == 28) {
-		entry = g_hash_table_lookup(cache, question);
-		if (entry && entry->ipv4 && entry->ipv6 == NULL) {
-			int cache_offset = 0;
-
-			data = g_try_new(struct cache_data, 1);
-			if (data == NULL)
-				return -ENOMEM;
-			data->inserted = entry->ipv4->inserted;
-			data->type = type;
-			data->answers = ntohs(hdr->ancount);
-			data->timeout = entry->ipv4->timeout;
-			if (srv->protocol == IPPROTO_UDP)
-				cache_offset = 2;
-			data->data_len = msg_len + cache_offset;
-			data->data = ptr = g_malloc(data->data_len);
-			ptr[0] = (data->data_len - 2) / 256;
-			ptr[1] = (data->data_len - 2) - ptr[0] * 256;
-			if (srv->protocol == IPPROTO_UDP)
-				ptr += 2;
-			data->valid_until = entry->ipv4->valid_until;
-			data->cache_until = entry->ipv4->cache_until;
-			memcpy(ptr, msg, msg_len);
-			entry->ipv6 = data;
+	if (err == -ENOMSG) {
+		err = parse_negative_response(&rsp);
+		if (err == -ENOENT && type == 28) {
 			/*
-			 * we will get a "hit" when we serve the response
-			 * out of the cache
+			 * No SOA to get the TTL from. If we do a ipv6 lookup
+			 * and get no result for a record that's already in
+			 * our ipv4 cache, we want to cache the negative
+			 * response as long as the ipv4 one.
 			 */
-			entry->hits--;
-			if (entry->hits < 0)
-				entry->hits = 0;
-			return 0;
+			entry = g_hash_table_lookup(cache, question);
+			data = entry != NULL ?
+				cache_entry_find(entry, 1, class) : NULL;
+			if (data != NULL) {
+				rsp.ttl = data->valid_until - current_time;
+				err = 0;
+			}
 		}
 	}
 
-	if (err < 0 || ttl == 0)
-		return 0;
+	ttl = rsp.ttl;
 
-	qlen = strlen(question);
+	if (err < 0 || ttl <= 0)
+		return 0;
 
 	/*
 	 * If the cache contains already data, check if the
 	 * type of the cached data is the same and do not add
-	 * to cache if data is already there.
+	 * to cache if the data there is to be kept.
 	 * This is needed so that we can cache both A and AAAA
 	 * records for the same name.
 	 */
 	entry = g_hash_table_lookup(cache, question);
-	if (entry == NULL) {
-		entry = g_try_new(struct cache_entry, 1);
-		if (entry == NULL)
-			return -ENOMEM;
+	if (entry != NULL) {
+		data = cache_entry_find(entry, type, class);
+		if (data != NULL &&
+				cache_data_replaces(data, rsp.answers) == FALSE)
+			return 0;
+	}
 
-		data = g_try_new(struct cache_data, 1);
-		if (data == NULL) {
-			g_free(entry);
-			return -ENOMEM;
-		}
+	data = g_try_new(struct cache_data, 1);
+	if (data == NULL)
+		return -ENOMEM;
 
-		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
-		entry->want_refresh = 0;
-		entry->hits = 0;
+	if (ttl < MIN_CACHE_TTL)
+		ttl = MIN_CACHE_TTL;
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
-	} else {
-		if (type == 1 && entry->ipv4 != NULL)
-			return 0;
+	data->inserted = current_time;
+	data->type = type;
+	data->class = class;
+	data->answers = rsp.answers;
+	data->prefetch = FALSE;
+	data->timeout = ttl;
+	/*
+	 * The "2" in start of the length is the TCP offset. We allocate it
+	 * here even for UDP packet because it simplifies the sending
+	 * of cached packet.
+	 */
+	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsp.len;
+	data->data = ptr = g_try_malloc(data->data_len);
+	data->valid_until = current_time + ttl;
 
-		if (type == 28 && entry->ipv6 != NULL)
-			return 0;
+	/*
+	 * Restrict the cached DNS record TTL to some sane value
+	 * in order to prevent data staying in the cache too long.
+	 */
+	if (ttl > MAX_CACHE_TTL)
+		ttl = MAX_CACHE_TTL;
 
-		data = g_try_new(struct cache_data, 1);
-		if (data == NULL)
-			return -ENOMEM;
+	data->cache_until = round_down_ttl(current_time + ttl, ttl);
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
+	if (data->data == NULL) {
+		g_free(data);
+		return -ENOMEM;
+	}
+
+	/*
+	 * We cache the two extra bytes at the start of the message
+	 * in a TCP packet. When sending UDP packet, we skip the first
+	 * two bytes. This way we do not need to know the format
+	 * (UDP/TCP) of the cached message.
+	 */
+	ptr[0] = (data->data_len - 2) / 256;
+	ptr[1] = (data->data_len - 2) - ptr[0] * 256;
+	ptr += 2;
+
+	/* the header and the question, with its type and class */
+	memcpy(ptr, rsp.pkt.buf, 12);
+	memcpy(ptr + 12, question, qlen + 1 + 2 + 2);
+	ptr += 12 + qlen + 1 + 2 + 2;
 
+	if (cache_response_copy(&rsp, ptr) != (int) rsp.len) {
+		cache_data_free(data);
+		return -EINVAL;
+	}
+
+	/*
+	 * The cached packet contains only the question and the
+	 * answers, or the SOA record for a negative answer.
+	 */
+	hdr = (void *) (data->data + 2);
+	hdr->ancount = htons(rsp.answers);
+	hdr->nscount = htons(rsp.authorities);
+	hdr->arcount = 0;
+
+	entry = cache_insert(question, data, &new_entry);
+	if (entry == NULL)
+		return -ENOMEM;
+
+	cache_dirty = TRUE;
+
+	if (new_entry == FALSE) {
 		/*
 		 * compensate for the hit we'll get for serving
 		 * the response out of the cache
@@ -1388,112 +2142,434 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 		entry->hits--;
 		if (entry->hits < 0)
 			entry->hits = 0;
+	}
+
+	DBG("cache %d mem %zu hits %lu misses %lu evictions %lu "
+		"expirations %lu prefetches %lu stale %lu", cache_size,
+		cache_mem, cache_stats.hits, cache_stats.misses,
+		cache_stats.evictions, cache_stats.expirations,
+		cache_stats.prefetches, cache_stats.stale);
+
+	DBG("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
+								"dns len %u",
+		cache_size, new_entry ? "new " : "old ",
+		question, type, ttl,
+		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
+		data->data_len,
+		srv->protocol == IPPROTO_TCP ?
+			(unsigned int)(data->data[0] * 256 + data->data[1]) :
+			data->data_len);
+
+	return 0;
+}
+
+static void cache_file_append(GString *buf, const void *data, gsize len)
+{
+	static const char padding[CACHE_FILE_ALIGN];
+
+	g_string_append_len(buf, data, len);
+	g_string_append_len(buf, padding, CACHE_FILE_PAD(len));
+}
+
+static void cache_snapshot_save(void)
+{
+	struct cache_file_header hdr;
+	GString *buf;
+	GError *error = NULL;
+	GList *list;
+	time_t current_time;
+	unsigned int count = 0;
+	gsize ident_len;
+
+	if (cache_persistent == FALSE || cache_dirty == FALSE)
+		return;
+
+	if (cache == NULL || default_ident == NULL)
+		return;
+
+	current_time = time(NULL);
+	ident_len = strlen(default_ident) + 1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_FILE_MAGIC;
+	hdr.version = CACHE_FILE_VERSION;
+	hdr.saved = current_time;
+	hdr.ident_len = ident_len + CACHE_FILE_PAD(ident_len);
+
+	buf = g_string_sized_new(sizeof(hdr) + cache_mem);
+	g_string_append_len(buf, (const char *) &hdr, sizeof(hdr));
+	cache_file_append(buf, default_ident, ident_len);
+
+	/*
+	 * Oldest entries first so that reloading them restores
+	 * the LRU order.
+	 */
+	for (list = cache_lru.tail; list; list = list->prev) {
+		struct cache_entry *entry = list->data;
+		GSList *dl;
+
+		for (dl = entry->data; dl; dl = dl->next) {
+			struct cache_data *data = dl->data;
+			struct cache_file_record rec;
+
+			if (data->cache_until <= current_time)
+				continue;
+
+			memset(&rec, 0, sizeof(rec));
+			rec.valid = data->valid_until - current_time;
+			rec.cache = data->cache_until - current_time;
+			rec.data_len = data->data_len;
+			rec.type = data->type;
+			rec.class = data->class;
+			rec.answers = data->answers;
+			rec.key_len = strlen(entry->key) + 1;
+
+			cache_file_append(buf, &rec, sizeof(rec));
+			cache_file_append(buf, entry->key, rec.key_len);
+			cache_file_append(buf, data->data, data->data_len);
+			count++;
+		}
+	}
+
+	((struct cache_file_header *) buf->str)->count = count;
+
+	if (g_file_set_contents(CACHE_FILE, buf->str, buf->len,
+							&error) == FALSE) {
+		connman_error("Failed to save DNS cache: %s", error->message);
+		g_error_free(error);
+	} else {
+		DBG("saved %u records %zu bytes for %s", count, buf->len,
+							default_ident);
+		cache_dirty = FALSE;
+	}
+
+	g_string_free(buf, TRUE);
+}
+
+static gboolean cache_snapshot_timeout(gpointer user_data)
+{
+	cache_snapshot_save();
+
+	return TRUE;
+}
+
+static void cache_snapshot_release(void)
+{
+	if (cache_snapshot.addr == NULL)
+		return;
+
+	munmap(cache_snapshot.addr, cache_snapshot.len);
+	cache_snapshot.addr = NULL;
+	cache_snapshot.len = 0;
+}
+
+static void cache_snapshot_load(void)
+{
+	struct cache_file_header *hdr;
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = open(CACHE_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED) {
+		connman_error("mmap error %s for %s", strerror(errno),
+								CACHE_FILE);
+		return;
+	}
+
+	hdr = addr;
+
+	if (hdr->magic != CACHE_FILE_MAGIC ||
+			hdr->version != CACHE_FILE_VERSION ||
+			hdr->ident_len == 0 ||
+			hdr->ident_len % CACHE_FILE_ALIGN != 0 ||
+			hdr->ident_len > st.st_size - sizeof(*hdr) ||
+			memchr(hdr + 1, '\0', hdr->ident_len) == NULL) {
+		DBG("ignoring invalid %s", CACHE_FILE);
+		munmap(addr, st.st_size);
+		return;
+	}
+
+	cache_snapshot.addr = addr;
+	cache_snapshot.len = st.st_size;
+}
+
+/*
+ * A restored packet must be a complete reply to the question of its
+ * key: a single question equal to the key with the type and class of
+ * the record, followed by exactly the records it claims to hold.
+ */
+static gboolean cache_snapshot_check(const struct cache_file_record *rec,
+					const char *key,
+					const unsigned char *packet)
+{
+	struct dns_packet pkt;
+	struct dns_rr rr;
+	unsigned int offset;
+	int i;
+
+	if (strlen(key) + 1 != rec->key_len)
+		return FALSE;
+
+	if (packet[0] * 256 + packet[1] != (int) rec->data_len - 2)
+		return FALSE;
+
+	if (__connman_dns_parse(&pkt, packet + 2, rec->data_len - 2) < 0)
+		return FALSE;
+
+	if (pkt.qdcount != 1 || pkt.qname_len != rec->key_len ||
+			memcmp(pkt.buf + pkt.qname, key, rec->key_len) != 0)
+		return FALSE;
+
+	if (pkt.qtype != rec->type || pkt.qclass != rec->class ||
+			pkt.ancount != rec->answers || pkt.arcount != 0)
+		return FALSE;
+
+	offset = pkt.records;
+
+	for (i = 0; i < pkt.ancount + pkt.nscount; i++)
+		if (__connman_dns_parse_rr(&pkt, &offset, &rr) < 0)
+			return FALSE;
+
+	return offset == pkt.len;
+}
+
+/*
+ * The snapshot is only trusted when it was taken while the same
+ * service was the default one, the answers could be wrong otherwise.
+ * It is restored once both the cache and the default service exist
+ * and dropped after the first check.
+ */
+static void cache_snapshot_restore(void)
+{
+	struct cache_file_header *hdr = cache_snapshot.addr;
+	const char *ident, *ptr, *end;
+	time_t current_time, elapsed;
+	unsigned int i, restored = 0;
+
+	if (hdr == NULL || cache == NULL || default_ident == NULL)
+		return;
+
+	ident = (const char *) (hdr + 1);
+	if (g_strcmp0(ident, default_ident) != 0) {
+		DBG("snapshot of %s, default service %s", ident,
+							default_ident);
+		goto done;
+	}
+
+	current_time = time(NULL);
+	elapsed = current_time - hdr->saved;
+	if (elapsed < 0)
+		goto done;
+
+	ptr = ident + hdr->ident_len;
+	end = (const char *) cache_snapshot.addr + cache_snapshot.len;
+
+	for (i = 0; i < hdr->count; i++) {
+		const struct cache_file_record *rec = (const void *) ptr;
+		const char *key = ptr + sizeof(*rec);
+		const unsigned char *packet;
+		struct cache_data *data;
+		gboolean new_entry;
+		size_t len;
+
+		if ((size_t) (end - ptr) < sizeof(*rec))
+			break;
+
+		if (rec->key_len == 0 || rec->key_len > NS_MAXDNAME + 1 ||
+				rec->data_len < 2 + 12 ||
+				rec->data_len > 2 + 12 + NS_MAXDNAME + 1 + 4 +
+							MAX_CACHE_RESPONSE)
+			break;
+
+		len = sizeof(*rec) + rec->key_len +
+			CACHE_FILE_PAD(rec->key_len) + rec->data_len +
+			CACHE_FILE_PAD(rec->data_len);
+		if ((size_t) (end - ptr) < len)
+			break;
+
+		if (key[rec->key_len - 1] != '\0')
+			break;
+
+		packet = (const unsigned char *) key + rec->key_len +
+						CACHE_FILE_PAD(rec->key_len);
+		ptr += len;
+
+		if (rec->cache <= elapsed || rec->valid < rec->cache)
+			continue;
+
+		if (cache_type_is_cacheable(rec->type) == FALSE)
+			continue;
+
+		if (cache_snapshot_check(rec, key, packet) == FALSE) {
+			DBG("skipping inconsistent record %u", i);
+			continue;
+		}
+
+		data = g_try_new(struct cache_data, 1);
+		if (data == NULL)
+			break;
+
+		data->data = g_try_malloc(rec->data_len);
+		if (data->data == NULL) {
+			g_free(data);
+			break;
+		}
+
+		memcpy(data->data, packet, rec->data_len);
+		data->data_len = rec->data_len;
+		data->type = rec->type;
+		data->class = rec->class;
+		data->answers = rec->answers;
+		data->prefetch = FALSE;
+		data->inserted = current_time;
+		data->timeout = rec->valid - elapsed;
+		data->valid_until = current_time + rec->valid - elapsed;
+		data->cache_until = current_time + rec->cache - elapsed;
+
+		if (cache_insert(key, data, &new_entry) != NULL)
+			restored++;
+	}
+
+	DBG("restored %u of %u records for %s", restored, hdr->count,
+								ident);
+
+done:
+	cache_snapshot_release();
+}
+
+/*
+ * Query the best server again for a popular answer that is about to
+ * expire. Nobody waits for the reply, it only updates the cache.
+ */
+static void cache_prefetch(struct cache_entry *entry, struct cache_data *data)
+{
+	time_t current_time = time(NULL);
+	struct request_data *req;
+	struct domain_hdr *hdr;
+	unsigned char *query;
+	struct server_data *server;
+	struct request_upstream *upstream;
+	int len, sk;
+
+	if (data->prefetch == TRUE || data->answers == 0 ||
+					entry->hits < CACHE_PREFETCH_HITS)
+		return;
 
-		new_entry = FALSE;
-	}
+	if ((data->cache_until - current_time) * 100 >
+			(data->cache_until - data->inserted) *
+						CACHE_PREFETCH_PERCENT)
+		return;
 
-	if (ttl < MIN_CACHE_TTL)
-		ttl = MIN_CACHE_TTL;
+	/* the header and the question of the cached reply */
+	len = 12 + dns_name_length(data->data + 2 + 12) +
+					sizeof(struct domain_question);
+	if (len > (int) data->data_len - 2)
+		return;
 
-	data->inserted = current_time;
-	data->type = type;
-	data->answers = answers;
-	data->timeout = ttl;
-	/*
-	 * The "2" in start of the length is the TCP offset. We allocate it
-	 * here even for UDP packet because it simplifies the sending
-	 * of cached packet.
-	 */
-	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
-	data->data = ptr = g_malloc(data->data_len);
-	data->valid_until = current_time + ttl;
+	req = g_try_new0(struct request_data, 1);
+	if (req == NULL)
+		return;
 
-	/*
-	 * Restrict the cached DNS record TTL to some sane value
-	 * in order to prevent data staying in the cache too long.
-	 */
-	if (ttl > MAX_CACHE_TTL)
-		ttl = MAX_CACHE_TTL;
+	query = g_try_malloc(len);
+	if (query == NULL) {
+		g_free(req);
+		return;
+	}
 
-	data->cache_until = round_down_ttl(current_time + ttl, ttl);
+	memcpy(query, data->data + 2, len);
 
-	if (data->data == NULL) {
-		g_free(entry->key);
-		g_free(data);
-		g_free(entry);
-		return -ENOMEM;
+	req->protocol = IPPROTO_UDP;
+	req->client_sk = -1;
+	req->answered = TRUE;
+	req->dstid = get_unique_id(0);
+	req->altid = get_unique_id(req->dstid);
+	req->srcid = req->dstid;
+	req->request = query;
+	req->request_len = len;
+
+	hdr = (void *) query;
+	memset(hdr, 0, sizeof(*hdr));
+	query[0] = req->dstid & 0xff;
+	query[1] = req->dstid >> 8;
+	hdr->rd = 1;
+	hdr->qdcount = htons(1);
+
+	server = best_server();
+	if (server == NULL) {
+		destroy_request_data(req);
+		return;
 	}
 
-	/*
-	 * We cache the two extra bytes at the start of the message
-	 * in a TCP packet. When sending UDP packet, we skip the first
-	 * two bytes. This way we do not need to know the format
-	 * (UDP/TCP) of the cached message.
-	 */
-	ptr[0] = (data->data_len - 2) / 256;
-	ptr[1] = (data->data_len - 2) - ptr[0] * 256;
-	if (srv->protocol == IPPROTO_UDP)
-		ptr += 2;
+	sk = g_io_channel_unix_get_fd(server->channel);
 
-	memcpy(ptr, msg, offset + 12);
-	memcpy(ptr + offset + 12, question, qlen + 1); /* copy also the \0 */
+	if (udp_send(sk, query, len, server->server_addr,
+					server->server_addr_len) < 0) {
+		destroy_request_data(req);
+		return;
+	}
 
-	q = (void *) (ptr + offset + 12 + qlen + 1);
-	q->type = htons(type);
-	q->class = htons(class);
-	memcpy(ptr + offset + 12 + qlen + 1 + sizeof(struct domain_question),
-		response, rsplen);
+	req->numserv++;
+	server->queries++;
 
-	if (new_entry == TRUE) {
-		g_hash_table_replace(cache, entry->key, entry);
-		cache_size++;
+	upstream = g_try_new0(struct request_upstream, 1);
+	if (upstream != NULL) {
+		upstream->server = server;
+		upstream->sent = g_get_monotonic_time();
+		req->upstreams = g_slist_prepend(req->upstreams, upstream);
 	}
 
-	DBG("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
-								"dns len %u",
-		cache_size, new_entry ? "new " : "old ",
-		question, type, ttl,
-		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
-		data->data_len,
-		srv->protocol == IPPROTO_TCP ?
-			(unsigned int)(data->data[0] * 256 + data->data[1]) :
-			data->data_len);
+	DBG("prefetching \"%s\" type %d", entry->key, data->type);
 
-	return 0;
+	cache_stats.prefetches++;
+	data->prefetch = TRUE;
+
+	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
+	add_request(req);
 }
 
 static int ns_resolv(struct server_data *server, struct request_data *req,
 				gpointer request, gpointer name)
 {
 	GList *list;
-	int sk, err, type = 0;
+	int sk, err;
 	char *dot, *lookup = (char *) name;
 	struct cache_entry *entry;
+	struct cache_data *data = NULL;
+	gboolean stale;
 
-	entry = cache_check(request, &type, req->protocol);
-	if (entry != NULL) {
+	entry = cache_check(request, &data, &stale, req->protocol);
+	if (entry != NULL && stale == TRUE)
+		request_stale(req, data);
+
+	if (entry != NULL && stale == FALSE) {
 		int ttl_left = 0;
-		struct cache_data *data;
 
-		DBG("cache hit %s type %s", lookup, type == 1 ? "A" : "AAAA");
-		if (type == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		DBG("cache hit %s type %d", lookup, data->type);
 
-		if (data) {
-			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
-		}
+		ttl_left = data->valid_until - time(NULL);
+		cache_hit(entry);
+		cache_prefetch(entry, data);
 
-		if (data != NULL && req->protocol == IPPROTO_TCP) {
+		if (req->protocol == IPPROTO_TCP) {
 			send_cached_response(req->client_sk, data->data,
 					data->data_len, NULL, 0, IPPROTO_TCP,
 					req->srcid, data->answers, ttl_left);
 			return 1;
 		}
 
-		if (data != NULL && req->protocol == IPPROTO_UDP) {
+		if (req->protocol == IPPROTO_UDP) {
 			int udp_sk = g_io_channel_unix_get_fd(
 					req->ifdata->udp_listener_channel);
 
@@ -1507,7 +2583,11 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 
 	sk = g_io_channel_unix_get_fd(server->channel);
 
-	err = sendto(sk, request, req->request_len, MSG_NOSIGNAL,
+	if (server->protocol == IPPROTO_UDP)
+		err = udp_send(sk, request, req->request_len,
+			server->server_addr, server->server_addr_len);
+	else
+		err = sendto(sk, request, req->request_len, MSG_NOSIGNAL,
 			server->server_addr, server->server_addr_len);
 	if (err < 0) {
 		DBG("Cannot send message to server %s sock %d "
@@ -1573,7 +2653,12 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		DBG("req %p dstid 0x%04x altid 0x%04x", req, req->dstid,
 				req->altid);
 
-		err = send(sk, alt, req->request_len + domlen, MSG_NOSIGNAL);
+		if (server->protocol == IPPROTO_UDP)
+			err = udp_send(sk, alt, req->request_len + domlen,
+								NULL, 0);
+		else
+			err = send(sk, alt, req->request_len + domlen,
+								MSG_NOSIGNAL);
 		if (err < 0)
 			return -EIO;
 
@@ -1588,9 +2673,18 @@ static void destroy_request_data(struct request_data *req)
 	if (req->timeout > 0)
 		g_source_remove(req->timeout);
 
+	request_upstreams_free(req);
+
+	if (req->stale_timeout > 0)
+		g_source_remove(req->stale_timeout);
+
+	request_index_remove(req, req->dstid);
+	request_index_remove(req, req->altid);
+
 	g_free(req->resp);
 	g_free(req->request);
 	g_free(req->name);
+	g_free(req->stale);
 	g_free(req);
 }
 
@@ -1599,6 +2693,7 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 {
 	struct domain_hdr *hdr;
 	struct request_data *req;
+	struct request_upstream *upstream;
 	int dns_id, sk, err, offset = protocol_offset(protocol);
 	struct listener_data *ifdata;
 
@@ -1617,6 +2712,12 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	DBG("req %p dstid 0x%04x altid 0x%04x rcode %d",
 			req, req->dstid, req->altid, hdr->rcode);
 
+	upstream = request_find_upstream(req, data);
+	if (upstream != NULL && upstream->replied == FALSE) {
+		upstream->replied = TRUE;
+		server_replied(data, upstream->sent, hdr->rcode);
+	}
+
 	ifdata = req->ifdata;
 
 	reply[offset] = req->srcid & 0xff;
@@ -1685,18 +2786,48 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 		memcpy(req->resp, reply, reply_len);
 		req->resplen = reply_len;
 
-		cache_update(data, reply, reply_len);
+		/*
+		 * An error for a query with an appended domain does not
+		 * tell anything about the name the client asked for.
+		 */
+		if (hdr->rcode == 0 || req->append_domain == FALSE)
+			cache_update(data, reply, reply_len);
+	}
+
+	/* A failing server is not waited for, the next one is queried */
+	if (hdr->rcode > 0 && hdr->rcode != 3 &&
+				request_untried(req) == TRUE) {
+		if (req->stagger > 0) {
+			g_source_remove(req->stagger);
+			req->stagger = 0;
+		}
+
+		if (resolv_next(req) > 0) {
+			/* a cached result was sent */
+			remove_request(req);
+			destroy_request_data(req);
+			return 0;
+		}
 	}
 
 	if (hdr->rcode > 0 && req->numresp < req->numserv)
 		return -EINVAL;
 
-	request_list = g_slist_remove(request_list, req);
+	remove_request(req);
+
+	/* Rather a stale answer than a server failure */
+	if (hdr->rcode > 0 && hdr->rcode != 3)
+		send_stale_response(req);
+
+	if (req->answered == TRUE) {
+		destroy_request_data(req);
+		return 0;
+	}
 
 	if (protocol == IPPROTO_UDP) {
 		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
-		err = sendto(sk, req->resp, req->resplen, 0,
-			     &req->sa, req->sa_len);
+		err = udp_send(sk, req->resp, req->resplen,
+						&req->sa, req->sa_len);
 	} else {
 		sk = req->client_sk;
 		err = send(sk, req->resp, req->resplen, MSG_NOSIGNAL);
@@ -1721,15 +2852,11 @@ static void cache_element_destroy(gpointer value)
 	if (entry == NULL)
 		return;
 
-	if (entry->ipv4 != NULL) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-	}
+	g_queue_unlink(&cache_lru, &entry->lru_link);
+	cache_heap_remove(entry);
+	cache_mem -= entry->mem;
 
-	if (entry->ipv6 != NULL) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-	}
+	g_slist_free_full(entry->data, (GDestroyNotify) cache_data_free);
 
 	g_free(entry->key);
 	g_free(entry);
@@ -1745,6 +2872,9 @@ static gboolean try_remove_cache(gpointer user_data)
 
 		g_hash_table_destroy(cache);
 		cache = NULL;
+
+		g_ptr_array_free(cache_heap, TRUE);
+		cache_heap = NULL;
 	}
 
 	return FALSE;
@@ -1778,6 +2908,7 @@ static void server_destroy_socket(struct server_data *data)
 static void destroy_server(struct server_data *server)
 {
 	GList *list;
+	GSList *slist;
 
 	DBG("index %d server %s sock %d", server->index, server->server,
 			server->channel != NULL ?
@@ -1786,6 +2917,18 @@ static void destroy_server(struct server_data *server)
 	server_list = g_slist_remove(server_list, server);
 	server_destroy_socket(server);
 
+	for (slist = request_list; slist; slist = slist->next) {
+		struct request_data *req = slist->data;
+		struct request_upstream *upstream;
+
+		upstream = request_find_upstream(req, server);
+		if (upstream == NULL)
+			continue;
+
+		req->upstreams = g_slist_remove(req->upstreams, upstream);
+		g_free(upstream);
+	}
+
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		DBG("Removing DNS server %s", server->server);
 
@@ -1815,9 +2958,9 @@ static void destroy_server(struct server_data *server)
 static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[4096];
-	int sk, err, len;
+	int sk, i, n, round;
 	struct server_data *data = user_data;
+	gint64 start;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
 		connman_error("Error with UDP server %s", data->server);
@@ -1827,146 +2970,287 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 
 	sk = g_io_channel_unix_get_fd(channel);
 
-	len = recv(sk, buf, sizeof(buf), 0);
-	if (len < 12)
-		return TRUE;
+	udp_batch_begin();
 
-	err = forward_dns_reply(buf, len, IPPROTO_UDP, data);
-	if (err < 0)
-		return TRUE;
+	for (round = 0; round < UDP_BATCH_ROUNDS; round++) {
+		n = udp_batch_recv(sk, UDP_BUFFER_SIZE);
+		if (n <= 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			int len = udp_rx.msgs[i].msg_len;
+
+			if (len < 12)
+				continue;
+
+			start = __connman_metrics_start();
+
+			forward_dns_reply(udp_rx.buf[i], len, IPPROTO_UDP,
+									data);
+
+			__connman_metrics_stop(CONNMAN_METRIC_DNSPROXY_REPLY,
+									start);
+		}
+
+		if (n < UDP_BATCH_SIZE)
+			break;
+	}
+
+	udp_batch_flush();
 
 	return TRUE;
 }
 
 static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+							gpointer user_data);
+
+/*
+ * TCP requests are waiting for this server if it has not replied to
+ * them yet.
+ */
+static gboolean tcp_server_busy(struct server_data *server)
 {
-	int sk;
-	struct server_data *server = user_data;
+	GSList *list;
 
-	sk = g_io_channel_unix_get_fd(channel);
-	if (sk == 0)
-		return FALSE;
+	for (list = request_list; list; list = list->next) {
+		struct request_data *req = list->data;
+		struct request_upstream *upstream;
 
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		GSList *list;
-hangup:
-		DBG("TCP server channel closed, sk %d", sk);
+		if (req->protocol != IPPROTO_TCP)
+			continue;
 
-		/*
-		 * Discard any partial response which is buffered; better
-		 * to get a proper response from a working server.
-		 */
-		g_free(server->incoming_reply);
-		server->incoming_reply = NULL;
+		upstream = request_find_upstream(req, server);
+		if (upstream != NULL && upstream->replied == FALSE)
+			return TRUE;
+	}
 
-		for (list = request_list; list; list = list->next) {
-			struct request_data *req = list->data;
-			struct domain_hdr *hdr;
+	return FALSE;
+}
 
-			if (req->protocol == IPPROTO_UDP)
-				continue;
+/*
+ * The request can still be answered by another connection, either
+ * one it was sent over or one that is not established yet.
+ */
+static gboolean tcp_request_waiting(struct request_data *req,
+					struct server_data *server)
+{
+	GSList *list;
 
-			if (req->request == NULL)
-				continue;
+	for (list = req->upstreams; list; list = list->next) {
+		struct request_upstream *upstream = list->data;
 
-			/*
-			 * If we're not waiting for any further response
-			 * from another name server, then we send an error
-			 * response to the client.
-			 */
-			if (req->numserv && --(req->numserv))
-				continue;
+		if (upstream->server != server && upstream->replied == FALSE)
+			return TRUE;
+	}
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+
+		if (data != server && data->protocol == IPPROTO_TCP &&
+				data->connected == FALSE)
+			return TRUE;
+	}
 
+	return FALSE;
+}
+
+static void tcp_server_hangup(struct server_data *server)
+{
+	GSList *list;
+
+	/*
+	 * Discard any partial response which is buffered; better
+	 * to get a proper response from a working server.
+	 */
+	g_free(server->incoming_reply);
+	server->incoming_reply = NULL;
+
+	list = request_list;
+	while (list) {
+		struct request_data *req = list->data;
+		struct request_upstream *upstream;
+		struct domain_hdr *hdr;
+
+		list = list->next;
+
+		if (req->protocol == IPPROTO_UDP)
+			continue;
+
+		if (req->request == NULL)
+			continue;
+
+		upstream = request_find_upstream(req, server);
+		if (upstream != NULL) {
+			if (upstream->replied == FALSE) {
+				server_failed(server);
+				if (req->numserv > 0)
+					req->numserv--;
+			}
+
+			req->upstreams = g_slist_remove(req->upstreams,
+								upstream);
+			g_free(upstream);
+		} else if (server->connected == TRUE)
+			continue;
+
+		/*
+		 * If we're not waiting for any further response
+		 * from another name server, then we send an error
+		 * response to the client.
+		 */
+		if (tcp_request_waiting(req, server) == TRUE)
+			continue;
+
+		if (req->answered == FALSE &&
+				send_stale_response(req) == FALSE) {
 			hdr = (void *) (req->request + 2);
 			hdr->id = req->srcid;
 			send_response(req->client_sk, req->request,
 				req->request_len, NULL, 0, IPPROTO_TCP);
-
-			request_list = g_slist_remove(request_list, req);
+			close(req->client_sk);
 		}
 
-		destroy_server(server);
+		remove_request(req);
+		destroy_request_data(req);
+	}
+
+	destroy_server(server);
+}
+
+static gboolean tcp_idle_timeout(gpointer user_data)
+{
+	struct server_data *server = user_data;
+
+	DBG("");
 
+	if (server == NULL)
 		return FALSE;
+
+	/* Pipelined queries are still outstanding */
+	if (server->connected == TRUE && tcp_server_busy(server) == TRUE)
+		return TRUE;
+
+	server->timeout = 0;
+	tcp_server_hangup(server);
+
+	return FALSE;
+}
+
+static void tcp_server_touch(struct server_data *server)
+{
+	if (server->timeout > 0)
+		g_source_remove(server->timeout);
+
+	server->timeout = g_timeout_add_seconds(TCP_IDLE_TIMEOUT,
+						tcp_idle_timeout, server);
+}
+
+/*
+ * Send the request over the connection to the server, unless it was
+ * sent there already. Returns 1 if a cached result was sent instead.
+ */
+static int tcp_server_send(struct server_data *server,
+					struct request_data *req)
+{
+	struct request_upstream *upstream;
+	int status;
+
+	if (request_find_upstream(req, server) != NULL)
+		return 0;
+
+	upstream = g_try_new0(struct request_upstream, 1);
+	if (upstream == NULL)
+		return -ENOMEM;
+
+	DBG("Sending req %s over TCP", (char *)req->name);
+
+	status = ns_resolv(server, req, req->request, req->name);
+	if (status != 0) {
+		g_free(upstream);
+		return status;
 	}
 
-	if ((condition & G_IO_OUT) && !server->connected) {
-		GSList *list;
-		GList *domains;
-		int no_request_sent = TRUE;
-		struct server_data *udp_server;
-
-		udp_server = find_server(server->index, server->server,
-								IPPROTO_UDP);
-		if (udp_server != NULL) {
-			for (domains = udp_server->domains; domains;
-						domains = domains->next) {
-				char *dom = domains->data;
-
-				DBG("Adding domain %s to %s",
-						dom, server->server);
-
-				server->domains = g_list_append(server->domains,
-								g_strdup(dom));
-			}
-		}
+	upstream->server = server;
+	upstream->sent = g_get_monotonic_time();
+	req->upstreams = g_slist_prepend(req->upstreams, upstream);
 
-		server->connected = TRUE;
-		server_list = g_slist_append(server_list, server);
+	server->queries++;
+	tcp_server_touch(server);
 
-		if (server->timeout > 0) {
-			g_source_remove(server->timeout);
-			server->timeout = 0;
+	return 0;
+}
+
+static void tcp_server_connected(struct server_data *server)
+{
+	GSList *list;
+	GList *domains;
+	struct server_data *udp_server;
+
+	udp_server = find_server(server->index, server->server, IPPROTO_UDP);
+	if (udp_server != NULL) {
+		for (domains = udp_server->domains; domains;
+					domains = domains->next) {
+			char *dom = domains->data;
+
+			DBG("Adding domain %s to %s", dom, server->server);
+
+			server->domains = g_list_append(server->domains,
+							g_strdup(dom));
 		}
+	}
 
-		for (list = request_list; list; ) {
-			struct request_data *req = list->data;
-			int status;
+	server->connected = TRUE;
+	tcp_server_touch(server);
 
-			if (req->protocol == IPPROTO_UDP) {
-				list = list->next;
-				continue;
-			}
+	/* Send the requests that were queued while connecting */
+	list = request_list;
+	while (list) {
+		struct request_data *req = list->data;
+		int status;
 
-			DBG("Sending req %s over TCP", (char *)req->name);
+		list = list->next;
 
-			status = ns_resolv(server, req,
-						req->request, req->name);
-			if (status > 0) {
-				/*
-				 * A cached result was sent,
-				 * so the request can be released
-				 */
-				list = list->next;
-				request_list = g_slist_remove(request_list, req);
-				destroy_request_data(req);
-				continue;
-			}
+		if (req->protocol == IPPROTO_UDP || req->request == NULL)
+			continue;
 
-			if (status < 0) {
-				list = list->next;
-				continue;
-			}
+		status = tcp_server_send(server, req);
+		if (status > 0) {
+			/*
+			 * A cached result was sent,
+			 * so the request can be released
+			 */
+			remove_request(req);
+			destroy_request_data(req);
+			continue;
+		}
 
-			no_request_sent = FALSE;
+		if (status < 0)
+			continue;
 
-			if (req->timeout > 0)
-				g_source_remove(req->timeout);
+		if (req->timeout > 0)
+			g_source_remove(req->timeout);
 
-			req->timeout = g_timeout_add_seconds(30,
-						request_timeout, req);
-			list = list->next;
-		}
+		req->timeout = g_timeout_add_seconds(30,
+					request_timeout, req);
+	}
 
-		if (no_request_sent == TRUE) {
-			destroy_server(server);
-			return FALSE;
-		}
+	/* Writability is of no interest anymore, only replies are */
+	server->watch = g_io_add_watch(server->channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+				tcp_server_event, server);
+}
 
-	} else if (condition & G_IO_IN) {
+/*
+ * Read all complete replies that are available. Replies to pipelined
+ * queries may arrive in any order, they are matched by their id.
+ * Returns FALSE if the connection was closed.
+ */
+static gboolean tcp_server_read(struct server_data *server, int sk)
+{
+	for (;;) {
 		struct partial_reply *reply = server->incoming_reply;
 		int bytes_recv;
+		gint64 start;
 
 		if (!reply) {
 			unsigned char reply_len_buf[2];
@@ -1974,14 +3258,14 @@ hangup:
 
 			bytes_recv = recv(sk, reply_len_buf, 2, MSG_PEEK);
 			if (!bytes_recv) {
-				goto hangup;
+				return FALSE;
 			} else if (bytes_recv < 0) {
 				if (errno == EAGAIN || errno == EWOULDBLOCK)
 					return TRUE;
 
 				connman_error("DNS proxy error %s",
 						strerror(errno));
-				goto hangup;
+				return FALSE;
 			} else if (bytes_recv < 2)
 				return TRUE;
 
@@ -2005,42 +3289,64 @@ hangup:
 					reply->len - reply->received, 0);
 			if (!bytes_recv) {
 				connman_error("DNS proxy TCP disconnect");
-				break;
+				return FALSE;
 			} else if (bytes_recv < 0) {
 				if (errno == EAGAIN || errno == EWOULDBLOCK)
 					return TRUE;
 
 				connman_error("DNS proxy error %s",
 						strerror(errno));
-				break;
+				return FALSE;
 			}
 			reply->received += bytes_recv;
 		}
 
+		server->incoming_reply = NULL;
+
+		start = __connman_metrics_start();
+
 		forward_dns_reply(reply->buf, reply->received, IPPROTO_TCP,
 					server);
 
-		g_free(reply);
-		server->incoming_reply = NULL;
+		__connman_metrics_stop(CONNMAN_METRIC_DNSPROXY_REPLY, start);
 
-		destroy_server(server);
+		g_free(reply);
 
-		return FALSE;
+		tcp_server_touch(server);
 	}
-
-	return TRUE;
 }
 
-static gboolean tcp_idle_timeout(gpointer user_data)
+static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
 {
+	int sk;
 	struct server_data *server = user_data;
 
-	DBG("");
+	sk = g_io_channel_unix_get_fd(channel);
+	if (sk == 0)
+		return FALSE;
 
-	if (server == NULL)
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		DBG("TCP server channel closed, sk %d", sk);
+		goto hangup;
+	}
+
+	if ((condition & G_IO_OUT) && !server->connected) {
+		tcp_server_connected(server);
 		return FALSE;
+	}
 
-	destroy_server(server);
+	if ((condition & G_IO_IN) && tcp_server_read(server, sk) == FALSE) {
+		DBG("TCP server channel closed, sk %d", sk);
+		goto hangup;
+	}
+
+	return TRUE;
+
+hangup:
+	/* the watch is removed when returning */
+	server->watch = 0;
+	tcp_server_hangup(server);
 
 	return FALSE;
 }
@@ -2099,8 +3405,8 @@ static int server_create_socket(struct server_data *data)
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_OUT | G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
 						tcp_server_event, data);
-		data->timeout = g_timeout_add_seconds(30, tcp_idle_timeout,
-								data);
+		data->timeout = g_timeout_add_seconds(TCP_IDLE_TIMEOUT,
+						tcp_idle_timeout, data);
 	} else
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
@@ -2119,11 +3425,15 @@ static int server_create_socket(struct server_data *data)
 		}
 	}
 
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
 		cache = g_hash_table_new_full(g_str_hash,
 					g_str_equal,
 					NULL,
 					cache_element_destroy);
+		cache_heap = g_ptr_array_new();
+
+		cache_snapshot_restore();
+	}
 
 	return 0;
 }
@@ -2208,46 +3518,122 @@ static struct server_data *create_server(int index,
 		return NULL;
 	}
 
-	if (protocol == IPPROTO_UDP) {
-		/* Enable new servers by default */
-		data->enabled = TRUE;
+	/* Enable new servers by default */
+	data->enabled = TRUE;
+
+	if (protocol == IPPROTO_UDP)
 		DBG("Adding DNS server %s", data->server);
 
-		server_list = g_slist_append(server_list, data);
-	}
+	/* TCP connections are reused by all requests to the server */
+	server_list = g_slist_append(server_list, data);
 
 	return data;
 }
 
-static gboolean resolv(struct request_data *req,
-				gpointer request, gpointer name)
+static gboolean stagger_timeout(gpointer user_data);
+
+/*
+ * Query the next server of the request that has not been tried yet.
+ * Returns 1 if a cached reply was sent instead.
+ */
+static int resolv_next(struct request_data *req)
 {
 	GSList *list;
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+	for (list = req->upstreams; list; list = list->next) {
+		struct request_upstream *upstream = list->data;
+		struct server_data *data = upstream->server;
+		int status;
 
-		if (data->protocol == IPPROTO_TCP) {
-			DBG("server %s ignored proto TCP", data->server);
+		if (upstream->sent > 0)
 			continue;
-		}
+
+		upstream->sent = g_get_monotonic_time();
 
 		DBG("server %s enabled %d", data->server, data->enabled);
 
 		if (data->enabled == FALSE)
 			continue;
 
-		if (data->channel == NULL && data->protocol == IPPROTO_UDP) {
+		if (data->channel == NULL) {
 			if (server_create_socket(data) < 0) {
 				DBG("socket creation failed while resolving");
 				continue;
 			}
 		}
 
-		if (ns_resolv(data, req, request, name) > 0)
-			return TRUE;
+		status = ns_resolv(data, req, req->request, req->name);
+		if (status > 0)
+			return status;
+
+		if (status < 0) {
+			/* do not count the failure again */
+			upstream->replied = TRUE;
+			server_failed(data);
+			continue;
+		}
+
+		data->queries++;
+
+		if (list->next != NULL)
+			req->stagger = g_timeout_add(server_timeout(data),
+							stagger_timeout, req);
+
+		return 0;
+	}
+
+	return 0;
+}
+
+static gboolean stagger_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+
+	req->stagger = 0;
+
+	DBG("id 0x%04x no reply yet, trying next server", req->srcid);
+
+	if (resolv_next(req) > 0) {
+		/* A cached result was sent, so the request can be released */
+		remove_request(req);
+		destroy_request_data(req);
+	}
+
+	return FALSE;
+}
+
+static gboolean resolv(struct request_data *req)
+{
+	GSList *list;
+
+	request_upstreams_free(req);
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+		struct request_upstream *upstream;
+
+		if (data->protocol == IPPROTO_TCP) {
+			DBG("server %s ignored proto TCP", data->server);
+			continue;
+		}
+
+		if (data->enabled == FALSE)
+			continue;
+
+		upstream = g_try_new0(struct request_upstream, 1);
+		if (upstream == NULL)
+			continue;
+
+		upstream->server = data;
+		req->upstreams = g_slist_prepend(req->upstreams, upstream);
 	}
 
+	req->upstreams = g_slist_sort(g_slist_reverse(req->upstreams),
+							upstream_compare);
+
+	if (resolv_next(req) > 0)
+		return TRUE;
+
 	return FALSE;
 }
 
@@ -2360,13 +3746,20 @@ void __connman_dnsproxy_flush(void)
 
 		list = list->next;
 
-		if (resolv(req, req->request, req->name) == TRUE) {
+		/* prefetches and requests already served stale */
+		if (req->answered == TRUE)
+			continue;
+
+		/* TCP requests are sent once their connection is up */
+		if (req->protocol == IPPROTO_TCP)
+			continue;
+
+		if (resolv(req) == TRUE) {
 			/*
 			 * A cached result was sent,
 			 * so the request can be released
 			 */
-			request_list =
-				g_slist_remove(request_list, req);
+			remove_request(req);
 			destroy_request_data(req);
 			continue;
 		}
@@ -2377,6 +3770,43 @@ void __connman_dnsproxy_flush(void)
 	}
 }
 
+void __connman_dnsproxy_list_servers(DBusMessageIter *array)
+{
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+		DBusMessageIter dict;
+		const char *protocol;
+		dbus_bool_t enabled = data->enabled;
+
+		protocol = data->protocol == IPPROTO_TCP ? "tcp" : "udp";
+
+		connman_dbus_dict_open(array, &dict);
+
+		connman_dbus_dict_append_basic(&dict, "Nameserver",
+					DBUS_TYPE_STRING, &data->server);
+		connman_dbus_dict_append_basic(&dict, "Index",
+					DBUS_TYPE_INT32, &data->index);
+		connman_dbus_dict_append_basic(&dict, "Protocol",
+					DBUS_TYPE_STRING, &protocol);
+		connman_dbus_dict_append_basic(&dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &enabled);
+		connman_dbus_dict_append_basic(&dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &data->srtt);
+		connman_dbus_dict_append_basic(&dict, "RoundTripTimeVariation",
+					DBUS_TYPE_UINT32, &data->rttvar);
+		connman_dbus_dict_append_basic(&dict, "Queries",
+					DBUS_TYPE_UINT32, &data->queries);
+		connman_dbus_dict_append_basic(&dict, "Replies",
+					DBUS_TYPE_UINT32, &data->replies);
+		connman_dbus_dict_append_basic(&dict, "Failures",
+					DBUS_TYPE_UINT32, &data->failed);
+
+		connman_dbus_dict_close(array, &dict);
+	}
+}
+
 static void dnsproxy_offline_mode(connman_bool_t enabled)
 {
 	GSList *list;
@@ -2401,14 +3831,28 @@ static void dnsproxy_offline_mode(connman_bool_t enabled)
 
 static void dnsproxy_default_changed(struct connman_service *service)
 {
+	const char *ident = NULL;
 	GSList *list;
 	int index;
 
 	DBG("service %p", service);
 
+	if (service != NULL)
+		ident = __connman_service_get_ident(service);
+
+	/* Keep the answers of the previous default service on disk */
+	if (g_strcmp0(ident, default_ident) != 0) {
+		cache_snapshot_save();
+
+		g_free(default_ident);
+		default_ident = g_strdup(ident);
+	}
+
 	/* DNS has changed, invalidate the cache */
 	cache_invalidate();
 
+	cache_snapshot_restore();
+
 	if (service == NULL) {
 		/* When no services are active, then disable DNS proxying */
 		dnsproxy_offline_mode(TRUE);
@@ -2514,8 +3958,9 @@ static int parse_request(unsigned char *buf, int len,
 	return 0;
 }
 
-static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+static gboolean tcp_listener_request(GIOChannel *channel,
+					GIOCondition condition,
+					gpointer user_data)
 {
 	unsigned char buf[768];
 	char query[512];
@@ -2525,8 +3970,10 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	socklen_t client_addr_len = sizeof(client_addr);
 	GSList *list;
 	struct listener_data *ifdata = user_data;
-	int waiting_for_connect = FALSE, qtype = 0;
+	gboolean waiting = FALSE;
 	struct cache_entry *entry;
+	struct cache_data *cached = NULL;
+	gboolean stale;
 
 	DBG("condition 0x%x", condition);
 
@@ -2572,8 +4019,8 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	req->protocol = IPPROTO_TCP;
 
 	req->srcid = buf[2] | (buf[3] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
+	req->dstid = get_unique_id(0);
+	req->altid = get_unique_id(req->dstid);
 	req->request_len = len;
 
 	buf[2] = req->dstid & 0xff;
@@ -2587,57 +4034,24 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	 * Check if the answer is found in the cache before
 	 * creating sockets to the server.
 	 */
-	entry = cache_check(buf, &qtype, IPPROTO_TCP);
-	if (entry != NULL) {
-		int ttl_left = 0;
-		struct cache_data *data;
-
-		DBG("cache hit %s type %s", query, qtype == 1 ? "A" : "AAAA");
-		if (qtype == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+	entry = cache_check(buf, &cached, &stale, IPPROTO_TCP);
+	if (entry != NULL && stale == FALSE) {
+		int ttl_left;
 
-		if (data != NULL) {
-			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+		DBG("cache hit %s type %d", query, cached->type);
 
-			send_cached_response(client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
-
-			g_free(req);
-			return TRUE;
-		} else
-			DBG("data missing, ignoring cache for this query");
-	}
-
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+		ttl_left = cached->valid_until - time(NULL);
+		cache_hit(entry);
+		cache_prefetch(entry, cached);
 
-		if (data->protocol != IPPROTO_UDP || data->enabled == FALSE)
-			continue;
-
-		if(create_server(data->index, NULL,
-					data->server, IPPROTO_TCP) == NULL)
-			continue;
+		send_cached_response(client_sk, cached->data,
+				cached->data_len, NULL, 0, IPPROTO_TCP,
+				req->srcid, cached->answers, ttl_left);
 
-		waiting_for_connect = TRUE;
-	}
-
-	if (waiting_for_connect == FALSE) {
-		/* No server is waiting for connect */
-		send_response(client_sk, buf, len, NULL, 0, IPPROTO_TCP);
 		g_free(req);
 		return TRUE;
 	}
 
-	/*
-	 * The server is not connected yet.
-	 * Copy the relevant buffers.
-	 * The request will actually be sent once we're
-	 * properly connected over TCP to the nameserver.
-	 */
 	req->request = g_try_malloc0(req->request_len);
 	if (req->request == NULL) {
 		send_response(client_sk, buf, len, NULL, 0, IPPROTO_TCP);
@@ -2655,59 +4069,104 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	}
 	memcpy(req->name, query, sizeof(query));
 
-	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
+	add_request(req);
 
-	request_list = g_slist_append(request_list, req);
+	/*
+	 * The request is pipelined on the connection to each server
+	 * right away, or sent once the connection is established.
+	 */
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+		struct server_data *server;
+
+		if (data->protocol != IPPROTO_UDP || data->enabled == FALSE)
+			continue;
+
+		server = find_server(data->index, data->server, IPPROTO_TCP);
+		if (server == NULL)
+			server = create_server(data->index, NULL,
+						data->server, IPPROTO_TCP);
+		if (server == NULL)
+			continue;
+
+		if (server->connected == TRUE) {
+			int status = tcp_server_send(server, req);
+
+			if (status > 0) {
+				/* a cached result was sent */
+				remove_request(req);
+				destroy_request_data(req);
+				return TRUE;
+			}
+
+			if (status < 0)
+				continue;
+		}
+
+		waiting = TRUE;
+	}
+
+	if (waiting == FALSE) {
+		/* No server is waiting for the request */
+		send_response(client_sk, buf, len, NULL, 0, IPPROTO_TCP);
+		remove_request(req);
+		destroy_request_data(req);
+		return TRUE;
+	}
+
+	if (entry != NULL && stale == TRUE)
+		request_stale(req, cached);
+
+	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
 
 	return TRUE;
 }
 
-static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
+static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[768];
-	char query[512];
-	struct request_data *req;
-	struct sockaddr_in6 client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
-	int sk, err, len;
-	struct listener_data *ifdata = user_data;
+	gint64 start;
+	gboolean ret;
 
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		ifdata->udp_listener_watch = 0;
-		return FALSE;
-	}
+	start = __connman_metrics_start();
 
-	sk = g_io_channel_unix_get_fd(channel);
+	ret = tcp_listener_request(channel, condition, user_data);
 
-	memset(&client_addr, 0, client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, (void *)&client_addr,
-		       &client_addr_len);
-	if (len < 2)
-		return TRUE;
+	__connman_metrics_stop(CONNMAN_METRIC_DNSPROXY_QUERY, start);
+
+	return ret;
+}
+
+static void udp_listener_request(struct listener_data *ifdata, int sk,
+				unsigned char *buf, int len,
+				struct sockaddr_in6 *client_addr,
+				socklen_t client_addr_len)
+{
+	char query[512];
+	struct request_data *req;
+	int err;
 
 	DBG("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
 	err = parse_request(buf, len, query, sizeof(query));
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
-		send_response(sk, buf, len, (void *)&client_addr,
+		send_response(sk, buf, len, (void *)client_addr,
 				client_addr_len, IPPROTO_UDP);
-		return TRUE;
+		return;
 	}
 
 	req = g_try_new0(struct request_data, 1);
 	if (req == NULL)
-		return TRUE;
+		return;
 
-	memcpy(&req->sa, &client_addr, client_addr_len);
+	memcpy(&req->sa, client_addr, client_addr_len);
 	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 
 	req->srcid = buf[0] | (buf[1] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
+	req->dstid = get_unique_id(0);
+	req->altid = get_unique_id(req->dstid);
 	req->request_len = len;
 
 	buf[0] = req->dstid & 0xff;
@@ -2717,14 +4176,70 @@ static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	req->ifdata = (struct listener_data *) ifdata;
 	req->append_domain = FALSE;
 
-	if (resolv(req, buf, query) == TRUE) {
+	/* Kept for querying the other servers later */
+	req->request = g_try_malloc(len);
+	req->name = g_strdup(query);
+	if (req->request == NULL || req->name == NULL) {
+		send_response(sk, buf, len, (void *)client_addr,
+				client_addr_len, IPPROTO_UDP);
+		destroy_request_data(req);
+		return;
+	}
+	memcpy(req->request, buf, len);
+
+	if (resolv(req) == TRUE) {
 		/* a cached result was sent, so the request can be released */
-	        g_free(req);
-		return TRUE;
+		destroy_request_data(req);
+		return;
 	}
 
 	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
-	request_list = g_slist_append(request_list, req);
+	add_request(req);
+}
+
+static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	int sk, i, n, round;
+	struct listener_data *ifdata = user_data;
+	gint64 start;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		ifdata->udp_listener_watch = 0;
+		return FALSE;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	udp_batch_begin();
+
+	for (round = 0; round < UDP_BATCH_ROUNDS; round++) {
+		n = udp_batch_recv(sk, 768);
+		if (n <= 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			int len = udp_rx.msgs[i].msg_len;
+
+			if (len < 2)
+				continue;
+
+			start = __connman_metrics_start();
+
+			udp_listener_request(ifdata, sk, udp_rx.buf[i], len,
+					&udp_rx.addr[i],
+					udp_rx.msgs[i].msg_hdr.msg_namelen);
+
+			__connman_metrics_stop(CONNMAN_METRIC_DNSPROXY_QUERY,
+									start);
+		}
+
+		if (n < UDP_BATCH_SIZE)
+			break;
+	}
+
+	udp_batch_flush();
 
 	return TRUE;
 }
@@ -2902,6 +4417,8 @@ static void destroy_listener(struct listener_data *ifdata)
 	g_slist_free(request_list);
 	request_list = NULL;
 
+	g_hash_table_remove_all(request_table);
+
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
 }
@@ -2974,9 +4491,28 @@ int __connman_dnsproxy_init(void)
 
 	srandom(time(NULL));
 
+	cache_max_size = connman_setting_get_uint("DNSCacheSize");
+	if (cache_max_size == 0)
+		cache_max_size = MAX_CACHE_SIZE;
+
+	cache_max_mem = connman_setting_get_uint("DNSCacheMemory");
+	if (cache_max_mem == 0)
+		cache_max_mem = MAX_CACHE_MEMORY;
+
+	DBG("cache size %u entries %zu bytes", cache_max_size, cache_max_mem);
+
+	cache_persistent = connman_setting_get_bool("PersistentDNSCache");
+	if (cache_persistent == TRUE) {
+		cache_snapshot_load();
+		cache_save_timer = g_timeout_add_seconds(CACHE_SAVE_INTERVAL,
+						cache_snapshot_timeout, NULL);
+	}
+
 	listener_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, g_free);
 
+	request_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	index = connman_inet_ifindex("lo");
 	err = __connman_dnsproxy_add_listener(index);
 	if (err < 0)
@@ -2991,6 +4527,14 @@ int __connman_dnsproxy_init(void)
 destroy:
 	__connman_dnsproxy_remove_listener(index);
 	g_hash_table_destroy(listener_table);
+	g_hash_table_destroy(request_table);
+
+	if (cache_save_timer > 0) {
+		g_source_remove(cache_save_timer);
+		cache_save_timer = 0;
+	}
+
+	cache_snapshot_release();
 
 	return err;
 }
@@ -3001,7 +4545,22 @@ void __connman_dnsproxy_cleanup(void)
 
 	connman_notifier_unregister(&dnsproxy_notifier);
 
+	cache_snapshot_save();
+
+	if (cache_save_timer > 0) {
+		g_source_remove(cache_save_timer);
+		cache_save_timer = 0;
+	}
+
+	cache_snapshot_release();
+
+	g_free(default_ident);
+	default_ident = NULL;
+
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
 
 	g_hash_table_destroy(listener_table);
+
+	g_hash_table_destroy(request_table);
+	request_table = NULL;
 }
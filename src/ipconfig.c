@@ -66,14 +66,14 @@ struct connman_ipdevice {
 	unsigned int flags;
 	char *address;
 	uint16_t mtu;
-	uint32_t rx_packets;
-	uint32_t tx_packets;
-	uint32_t rx_bytes;
-	uint32_t tx_bytes;
-	uint32_t rx_errors;
-	uint32_t tx_errors;
-	uint32_t rx_dropped;
-	uint32_t tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 
 	GSList *address_list;
 	char *ipv4_gateway;
@@ -409,17 +409,22 @@ static void __connman_ipconfig_lower_down(struct connman_ipdevice *ipdevice)
 }
 
 static void update_stats(struct connman_ipdevice *ipdevice,
-						struct rtnl_link_stats *stats)
+					struct rtnl_link_stats64 *stats,
+					connman_bool_t stats64)
 {
 	struct connman_service *service;
 
 	if (stats->rx_packets == 0 && stats->tx_packets == 0)
 		return;
 
-	connman_info("%s {RX} %u packets %u bytes", ipdevice->ifname,
-					stats->rx_packets, stats->rx_bytes);
-	connman_info("%s {TX} %u packets %u bytes", ipdevice->ifname,
-					stats->tx_packets, stats->tx_bytes);
+	DBG("%s {RX} %" G_GUINT64_FORMAT " packets %"
+			G_GUINT64_FORMAT " bytes", ipdevice->ifname,
+			(guint64) stats->rx_packets,
+			(guint64) stats->rx_bytes);
+	DBG("%s {TX} %" G_GUINT64_FORMAT " packets %"
+			G_GUINT64_FORMAT " bytes", ipdevice->ifname,
+			(guint64) stats->tx_packets,
+			(guint64) stats->tx_bytes);
 
 	if (ipdevice->config_ipv4 == NULL && ipdevice->config_ipv6 == NULL)
 		return;
@@ -447,13 +452,15 @@ static void update_stats(struct connman_ipdevice *ipdevice,
 				ipdevice->rx_packets, ipdevice->tx_packets,
 				ipdevice->rx_bytes, ipdevice->tx_bytes,
 				ipdevice->rx_errors, ipdevice->tx_errors,
-				ipdevice->rx_dropped, ipdevice->tx_dropped);
+				ipdevice->rx_dropped, ipdevice->tx_dropped,
+				stats64);
 }
 
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats)
+						struct rtnl_link_stats64 *stats,
+						connman_bool_t stats64)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list;
@@ -502,7 +509,7 @@ void __connman_ipconfig_newlink(int index, unsigned short type,
 update:
 	ipdevice->mtu = mtu;
 
-	update_stats(ipdevice, stats);
+	update_stats(ipdevice, stats, stats64);
 
 	if (flags == ipdevice->flags)
 		return;
@@ -572,7 +579,8 @@ update:
 		__connman_ipconfig_lower_down(ipdevice);
 }
 
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats,
+						connman_bool_t stats64)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list;
@@ -583,7 +591,7 @@ void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
 	if (ipdevice == NULL)
 		return;
 
-	update_stats(ipdevice, stats);
+	update_stats(ipdevice, stats, stats64);
 
 	for (list = g_list_first(ipconfig_list); list;
 						list = g_list_next(list)) {
@@ -1935,6 +1935,7 @@ int __connman_iptables_commit(const char *table_name)
 {
 	struct connman_iptables *table;
 	struct ipt_replace *repl;
+	gint64 start;
 	int err;
 
 	DBG("%s", table_name);
@@ -1943,10 +1944,14 @@ int __connman_iptables_commit(const char *table_name)
 	if (table == NULL)
 		return -EINVAL;
 
+	start = __connman_metrics_start();
+
 	repl = iptables_blob(table);
 
 	err = iptables_replace(table, repl);
 
+	__connman_metrics_stop(CONNMAN_METRIC_IPTABLES_COMMIT, start);
+
 	g_free(repl->counters);
 	g_free(repl);
 
@@ -1958,6 +1963,88 @@ int __connman_iptables_commit(const char *table_name)
 	return 0;
 }
 
+/*
+ * Read the packet and byte counters of the rules of all user defined
+ * chains of a table with a single IPT_SO_GET_ENTRIES call. The callback
+ * is called with the chain name and the position of the rule in it.
+ */
+int __connman_iptables_get_counters(const char *table_name,
+					iptables_counters_cb_t cb,
+					void *user_data)
+{
+	struct ipt_getinfo info;
+	struct ipt_get_entries *entries = NULL;
+	struct ipt_entry *entry, *next;
+	struct xt_entry_target *target;
+	const char *chain_name = NULL;
+	unsigned int offset, index = 0;
+	socklen_t s;
+	int sk, err = 0;
+
+	DBG("%s", table_name);
+
+	sk = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+	if (sk < 0)
+		return -errno;
+
+	memset(&info, 0, sizeof(info));
+	g_strlcpy(info.name, table_name, sizeof(info.name));
+
+	s = sizeof(info);
+	if (getsockopt(sk, IPPROTO_IP, IPT_SO_GET_INFO, &info, &s) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	entries = g_try_malloc0(sizeof(struct ipt_get_entries) + info.size);
+	if (entries == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	g_strlcpy(entries->name, table_name, sizeof(entries->name));
+	entries->size = info.size;
+
+	s = sizeof(struct ipt_get_entries) + info.size;
+	if (getsockopt(sk, IPPROTO_IP, IPT_SO_GET_ENTRIES, entries, &s) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	for (offset = 0; offset < entries->size;
+					offset += entry->next_offset) {
+		entry = (struct ipt_entry *)
+				((char *)entries->entrytable + offset);
+		target = ipt_get_target(entry);
+
+		/* user defined chains start with an error target */
+		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET)) {
+			chain_name = (const char *)target->data;
+			index = 0;
+			continue;
+		}
+
+		if (chain_name == NULL)
+			continue;
+
+		/* the last entry of a user defined chain is its policy */
+		next = (struct ipt_entry *)
+				((char *)entry + entry->next_offset);
+		target = ipt_get_target(next);
+		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET))
+			continue;
+
+		cb(chain_name, index++, entry->counters.pcnt,
+					entry->counters.bcnt, user_data);
+	}
+
+out:
+	g_free(entries);
+	close(sk);
+
+	return err;
+}
+
 static void remove_table(gpointer user_data)
 {
 	struct connman_iptables *table = user_data;
@@ -35,9 +35,23 @@
 
 #include "connman.h"
 
+/* at most LOG_RATELIMIT_BURST debug messages per call site and interval */
+#define LOG_RATELIMIT_INTERVAL	5
+#define LOG_RATELIMIT_BURST	100
+
 static const char *program_exec;
 static const char *program_path;
 
+/*
+ * The rate limit intervals are counted by a timer, so a message does
+ * not need to read the clock. Call sites which dropped messages in the
+ * current interval are linked into suppressed_sites and reported when
+ * the interval ends.
+ */
+static unsigned int ratelimit_interval = 0;
+static guint ratelimit_timeout = 0;
+static struct connman_debug_ratelimit *suppressed_sites = NULL;
+
 /**
  * connman_info:
  * @format: format string
@@ -110,6 +124,67 @@ void connman_debug(const char *format, ...)
 	va_end(ap);
 }
 
+static void report_suppressed(void)
+{
+	struct connman_debug_ratelimit *ratelimit;
+
+	while (suppressed_sites != NULL) {
+		ratelimit = suppressed_sites;
+		suppressed_sites = ratelimit->next;
+
+		syslog(LOG_DEBUG, "%s: %u debug messages suppressed",
+				ratelimit->desc->file, ratelimit->suppressed);
+
+		ratelimit->next = NULL;
+		ratelimit->suppressed = 0;
+	}
+}
+
+static gboolean ratelimit_timeout_cb(gpointer user_data)
+{
+	ratelimit_interval++;
+
+	report_suppressed();
+
+	return TRUE;
+}
+
+/**
+ * connman_debug_print:
+ * @ratelimit: rate limiting state of the call site
+ * @format: format string
+ * @varargs: list of arguments
+ *
+ * Output debug message of the call site, messages of a call site
+ * exceeding the rate limit are dropped and only counted
+ */
+void connman_debug_print(struct connman_debug_ratelimit *ratelimit,
+					const char *format, ...)
+{
+	va_list ap;
+
+	if (ratelimit->interval != ratelimit_interval) {
+		ratelimit->interval = ratelimit_interval;
+		ratelimit->burst = 0;
+	}
+
+	if (ratelimit->burst >= LOG_RATELIMIT_BURST) {
+		if (ratelimit->suppressed++ == 0) {
+			ratelimit->next = suppressed_sites;
+			suppressed_sites = ratelimit;
+		}
+		return;
+	}
+
+	ratelimit->burst++;
+
+	va_start(ap, format);
+
+	vsyslog(LOG_DEBUG, format, ap);
+
+	va_end(ap);
+}
+
 static void print_backtrace(unsigned int offset)
 {
 	void *frames[99];
@@ -306,6 +381,11 @@ int __connman_log_init(const char *program, const char *debug,
 
 	__connman_log_enable(__start___debug, __stop___debug);
 
+	if (enabled != NULL)
+		ratelimit_timeout = g_timeout_add_seconds(
+					LOG_RATELIMIT_INTERVAL,
+					ratelimit_timeout_cb, NULL);
+
 	if (detach == FALSE)
 		option |= LOG_PERROR;
 
@@ -321,6 +401,13 @@ int __connman_log_init(const char *program, const char *debug,
 
 void __connman_log_cleanup(connman_bool_t backtrace)
 {
+	if (ratelimit_timeout > 0) {
+		g_source_remove(ratelimit_timeout);
+		ratelimit_timeout = 0;
+	}
+
+	report_suppressed();
+
 	syslog(LOG_INFO, "Exit");
 
 	closelog();
@@ -70,6 +70,10 @@ static struct {
 	char **blacklisted_interfaces;
 	connman_bool_t allow_hostname_updates;
 	connman_bool_t single_tech;
+	unsigned int dns_cache_size;
+	unsigned int dns_cache_memory;
+	connman_bool_t dns_cache_persistent;
+	unsigned int netlink_rcvbuf;
 } connman_settings  = {
 	.bg_scan = TRUE,
 	.pref_timeservers = NULL,
@@ -81,6 +85,10 @@ static struct {
 	.blacklisted_interfaces = NULL,
 	.allow_hostname_updates = TRUE,
 	.single_tech = FALSE,
+	.dns_cache_size = 0,
+	.dns_cache_memory = 0,
+	.dns_cache_persistent = FALSE,
+	.netlink_rcvbuf = 0,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -93,6 +101,10 @@ static struct {
 #define CONF_BLACKLISTED_INTERFACES     "NetworkInterfaceBlacklist"
 #define CONF_ALLOW_HOSTNAME_UPDATES     "AllowHostnameUpdates"
 #define CONF_SINGLE_TECH                "SingleConnectedTechnology"
+#define CONF_DNS_CACHE_SIZE             "DNSCacheSize"
+#define CONF_DNS_CACHE_MEMORY           "DNSCacheMemory"
+#define CONF_DNS_CACHE_PERSISTENT       "PersistentDNSCache"
+#define CONF_NETLINK_RCVBUF             "NetlinkReceiveBuffer"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -105,6 +117,10 @@ static const char *supported_options[] = {
 	CONF_BLACKLISTED_INTERFACES,
 	CONF_ALLOW_HOSTNAME_UPDATES,
 	CONF_SINGLE_TECH,
+	CONF_DNS_CACHE_SIZE,
+	CONF_DNS_CACHE_MEMORY,
+	CONF_DNS_CACHE_PERSISTENT,
+	CONF_NETLINK_RCVBUF,
 	NULL
 };
 
@@ -227,6 +243,7 @@ static void parse_config(GKeyFile *config)
 	char **str_list;
 	gsize len;
 	int timeout;
+	int value;
 
 	if (config == NULL) {
 		connman_settings.auto_connect =
@@ -327,6 +344,34 @@ static void parse_config(GKeyFile *config)
 		connman_settings.single_tech = boolean;
 
 	g_clear_error(&error);
+
+	value = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_SIZE, &error);
+	if (error == NULL && value >= 0)
+		connman_settings.dns_cache_size = value;
+
+	g_clear_error(&error);
+
+	value = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_MEMORY, &error);
+	if (error == NULL && value >= 0)
+		connman_settings.dns_cache_memory = value;
+
+	g_clear_error(&error);
+
+	boolean = g_key_file_get_boolean(config, "General",
+			CONF_DNS_CACHE_PERSISTENT, &error);
+	if (error == NULL)
+		connman_settings.dns_cache_persistent = boolean;
+
+	g_clear_error(&error);
+
+	value = g_key_file_get_integer(config, "General",
+			CONF_NETLINK_RCVBUF, &error);
+	if (error == NULL && value >= 0)
+		connman_settings.netlink_rcvbuf = value;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -372,6 +417,9 @@ static gboolean signal_handler(GIOChannel *channel, GIOCondition cond,
 
 		__terminated = 1;
 		break;
+	case SIGUSR2:
+		__connman_metrics_dump();
+		break;
 	}
 
 	return TRUE;
@@ -387,6 +435,7 @@ static guint setup_signalfd(void)
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR2);
 
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
 		perror("Failed to set signal mask");
@@ -498,6 +547,9 @@ connman_bool_t connman_setting_get_bool(const char *key)
 	if (g_str_equal(key, CONF_SINGLE_TECH) == TRUE)
 		return connman_settings.single_tech;
 
+	if (g_str_equal(key, CONF_DNS_CACHE_PERSISTENT) == TRUE)
+		return connman_settings.dns_cache_persistent;
+
 	return FALSE;
 }
 
@@ -515,6 +567,20 @@ char **connman_setting_get_string_list(const char *key)
 	return NULL;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, CONF_DNS_CACHE_SIZE) == TRUE)
+		return connman_settings.dns_cache_size;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_MEMORY) == TRUE)
+		return connman_settings.dns_cache_memory;
+
+	if (g_str_equal(key, CONF_NETLINK_RCVBUF) == TRUE)
+		return connman_settings.netlink_rcvbuf;
+
+	return 0;
+}
+
 unsigned int *connman_setting_get_uint_list(const char *key)
 {
 	if (g_str_equal(key, CONF_AUTO_CONNECT) == TRUE)
@@ -616,6 +682,7 @@ int main(int argc, char *argv[])
 			option_backtrace, "Connection Manager", VERSION);
 
 	__connman_dbus_init(conn);
+	__connman_metrics_init();
 
 	if (option_config == NULL)
 		config_init(CONFIGMAINFILE);
@@ -704,6 +771,7 @@ int main(int argc, char *argv[])
 	__connman_technology_cleanup();
 	__connman_inotify_cleanup();
 
+	__connman_metrics_cleanup();
 	__connman_dbus_cleanup();
 
 	__connman_log_cleanup(option_backtrace);
@@ -220,6 +220,85 @@ static DBusMessage *get_services(DBusConnection *conn,
 	return reply;
 }
 
+static void append_changed_services(DBusMessageIter *iter, void *user_data)
+{
+	dbus_uint64_t *since = user_data;
+
+	__connman_service_list_struct_since(iter, *since);
+}
+
+static DBusMessage *get_services_since(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+	dbus_uint64_t since, generation;
+	dbus_bool_t complete;
+
+	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &since,
+						DBUS_TYPE_INVALID) == FALSE)
+		return __connman_error_invalid_arguments(msg);
+
+	DBG("conn %p since %" G_GUINT64_FORMAT, conn, since);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL)
+		return NULL;
+
+	generation = __connman_service_get_generation();
+
+	if (__connman_service_generation_known(since) == TRUE) {
+		complete = FALSE;
+	} else {
+		/* the client has to replace all its services */
+		complete = TRUE;
+		since = 0;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT64, &generation);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_BOOLEAN, &complete);
+
+	__connman_dbus_append_objpath_dict_array(reply,
+			append_changed_services, &since);
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+				DBUS_TYPE_OBJECT_PATH_AS_STRING, &array);
+
+	if (complete == FALSE)
+		__connman_service_list_removed_since(&array, since);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
+static DBusMessage *get_nameservers(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	__connman_dnsproxy_list_servers(&array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
 static DBusMessage *connect_provider(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -281,31 +360,44 @@ static DBusMessage *unregister_agent(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
-static DBusMessage *register_counter(DBusConnection *conn,
-					DBusMessage *msg, void *data)
+static DBusMessage *counter_register(DBusMessage *msg, connman_bool_t batch)
 {
 	const char *sender, *path;
 	unsigned int accuracy, period;
 	int err;
 
-	DBG("conn %p", conn);
-
 	sender = dbus_message_get_sender(msg);
 
-	dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path,
+	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path,
 						DBUS_TYPE_UINT32, &accuracy,
 						DBUS_TYPE_UINT32, &period,
-							DBUS_TYPE_INVALID);
-
-	/* FIXME: add handling of accuracy parameter */
+						DBUS_TYPE_INVALID) == FALSE)
+		return __connman_error_invalid_arguments(msg);
 
-	err = __connman_counter_register(sender, path, period);
+	err = __connman_counter_register(sender, path, accuracy, period,
+									batch);
 	if (err < 0)
 		return __connman_error_failed(msg, -err);
 
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static DBusMessage *register_counter(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBG("conn %p", conn);
+
+	return counter_register(msg, FALSE);
+}
+
+static DBusMessage *register_batch_counter(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBG("conn %p", conn);
+
+	return counter_register(msg, TRUE);
+}
+
 static DBusMessage *unregister_counter(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -326,6 +418,40 @@ static DBusMessage *unregister_counter(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static DBusMessage *register_properties_changed(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *sender;
+	int err;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	err = __connman_dbus_register_properties_changed(sender);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *unregister_properties_changed(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *sender;
+	int err;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	err = __connman_dbus_unregister_properties_changed(sender);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
 static DBusMessage *create_session(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -409,6 +535,15 @@ static const GDBusMethodTable manager_methods[] = {
 	{ GDBUS_METHOD("GetServices",
 			NULL, GDBUS_ARGS({ "services", "a(oa{sv})" }),
 			get_services) },
+	{ GDBUS_METHOD("GetServicesSince",
+			GDBUS_ARGS({ "generation", "t" }),
+			GDBUS_ARGS({ "generation", "t" }, { "complete", "b" },
+					{ "services", "a(oa{sv})" },
+					{ "removed", "ao" }),
+			get_services_since) },
+	{ GDBUS_METHOD("GetNameservers",
+			NULL, GDBUS_ARGS({ "nameservers", "aa{sv}" }),
+			get_nameservers) },
 	{ GDBUS_DEPRECATED_ASYNC_METHOD("ConnectProvider",
 			      GDBUS_ARGS({ "provider", "a{sv}" }),
 			      GDBUS_ARGS({ "path", "o" }),
@@ -423,9 +558,17 @@ static const GDBusMethodTable manager_methods[] = {
 			GDBUS_ARGS({ "path", "o" }, { "accuracy", "u" },
 					{ "period", "u" }),
 			NULL, register_counter) },
+	{ GDBUS_METHOD("RegisterBatchCounter",
+			GDBUS_ARGS({ "path", "o" }, { "accuracy", "u" },
+					{ "period", "u" }),
+			NULL, register_batch_counter) },
 	{ GDBUS_METHOD("UnregisterCounter",
 			GDBUS_ARGS({ "path", "o" }), NULL,
 			unregister_counter) },
+	{ GDBUS_METHOD("RegisterPropertiesChanged", NULL, NULL,
+			register_properties_changed) },
+	{ GDBUS_METHOD("UnregisterPropertiesChanged", NULL, NULL,
+			unregister_properties_changed) },
 	{ GDBUS_ASYNC_METHOD("CreateSession",
 			GDBUS_ARGS({ "settings", "a{sv}" },
 						{ "notifier", "o" }),
@@ -448,6 +591,8 @@ static const GDBusMethodTable manager_methods[] = {
 static const GDBusSignalTable manager_signals[] = {
 	{ GDBUS_SIGNAL("PropertyChanged",
 			GDBUS_ARGS({ "name", "s" }, { "value", "v" })) },
+	{ GDBUS_SIGNAL("PropertiesChanged",
+			GDBUS_ARGS({ "properties", "a{sv}" })) },
 	{ GDBUS_SIGNAL("TechnologyAdded",
 			GDBUS_ARGS({ "path", "o" },
 				   { "properties", "a{sv}" })) },
@@ -0,0 +1,306 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gdbus.h>
+
+#include "connman.h"
+
+/*
+ * Bucket i counts the samples below 2^(i + 1) microseconds, the last
+ * one all the longer ones as well.
+ */
+#define METRICS_BUCKETS	24
+
+struct metric {
+	const char *name;
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t histogram[METRICS_BUCKETS];
+};
+
+static struct metric metrics[CONNMAN_METRIC_MAX] = {
+	[CONNMAN_METRIC_DNSPROXY_QUERY]		= { "dnsproxy.query" },
+	[CONNMAN_METRIC_DNSPROXY_REPLY]		= { "dnsproxy.reply" },
+	[CONNMAN_METRIC_RTNL_MESSAGE]		= { "rtnl.message" },
+	[CONNMAN_METRIC_DBUS_METHOD]		= { "dbus.method" },
+	[CONNMAN_METRIC_DHCP_LEASE]		= { "dhcp.lease" },
+	[CONNMAN_METRIC_DHCP_LEASE_LOST]	= { "dhcp.lease-lost" },
+	[CONNMAN_METRIC_DHCP_NO_LEASE]		= { "dhcp.no-lease" },
+	[CONNMAN_METRIC_IPTABLES_COMMIT]	= { "iptables.commit" },
+};
+
+static DBusConnection *connection = NULL;
+static connman_bool_t enabled = FALSE;
+
+static void metric_add(struct metric *metric, uint64_t usec)
+{
+	unsigned int bucket;
+
+	metric->total += usec;
+	if (usec > metric->max)
+		metric->max = usec;
+
+	bucket = g_bit_storage(usec) - 1;
+	if (bucket >= METRICS_BUCKETS)
+		bucket = METRICS_BUCKETS - 1;
+
+	metric->histogram[bucket]++;
+}
+
+/*
+ * Returns the start time of a measurement, or 0 when the metrics are
+ * disabled which makes the matching __connman_metrics_stop() a no-op.
+ */
+gint64 __connman_metrics_start(void)
+{
+	if (enabled == FALSE)
+		return 0;
+
+	return g_get_monotonic_time();
+}
+
+void __connman_metrics_stop(enum connman_metric metric, gint64 start)
+{
+	if (start == 0 || enabled == FALSE)
+		return;
+
+	metrics[metric].count++;
+	metric_add(&metrics[metric], g_get_monotonic_time() - start);
+}
+
+void __connman_metrics_count(enum connman_metric metric)
+{
+	if (enabled == FALSE)
+		return;
+
+	metrics[metric].count++;
+}
+
+static void method_time(DBusMessage *message, gint64 usec)
+{
+	metrics[CONNMAN_METRIC_DBUS_METHOD].count++;
+	metric_add(&metrics[CONNMAN_METRIC_DBUS_METHOD], usec);
+}
+
+static void metrics_enable(connman_bool_t enable)
+{
+	DBG("enable %d", enable);
+
+	enabled = enable;
+
+	g_dbus_set_method_time_function(enable == TRUE ? method_time : NULL);
+}
+
+static void metrics_reset(void)
+{
+	int i;
+
+	for (i = 0; i < CONNMAN_METRIC_MAX; i++) {
+		metrics[i].count = 0;
+		metrics[i].total = 0;
+		metrics[i].max = 0;
+		memset(metrics[i].histogram, 0, sizeof(metrics[i].histogram));
+	}
+}
+
+void __connman_metrics_dump(void)
+{
+	GString *str;
+	int i, j;
+
+	connman_info("Metrics %s", enabled == TRUE ? "enabled" : "disabled");
+
+	str = g_string_sized_new(256);
+
+	for (i = 0; i < CONNMAN_METRIC_MAX; i++) {
+		struct metric *metric = &metrics[i];
+
+		g_string_printf(str, "%s count %" G_GUINT64_FORMAT
+				" total %" G_GUINT64_FORMAT " us max %"
+				G_GUINT64_FORMAT " us", metric->name,
+				metric->count, metric->total, metric->max);
+
+		for (j = 0; j < METRICS_BUCKETS; j++) {
+			if (metric->histogram[j] == 0)
+				continue;
+
+			g_string_append_printf(str, " <%luus:%" G_GUINT64_FORMAT,
+						1UL << (j + 1),
+						metric->histogram[j]);
+		}
+
+		connman_info("%s", str->str);
+	}
+
+	g_string_free(str, TRUE);
+}
+
+static void append_histogram(DBusMessageIter *iter, void *user_data)
+{
+	struct metric *metric = user_data;
+	int i;
+
+	for (i = 0; i < METRICS_BUCKETS; i++)
+		dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64,
+						&metric->histogram[i]);
+}
+
+static void append_metric(DBusMessageIter *dict, void *user_data)
+{
+	struct metric *metric = user_data;
+
+	connman_dbus_dict_append_basic(dict, "Count",
+					DBUS_TYPE_UINT64, &metric->count);
+	connman_dbus_dict_append_basic(dict, "Total",
+					DBUS_TYPE_UINT64, &metric->total);
+	connman_dbus_dict_append_basic(dict, "Max",
+					DBUS_TYPE_UINT64, &metric->max);
+	connman_dbus_dict_append_array(dict, "Histogram",
+					DBUS_TYPE_UINT64, append_histogram,
+					metric);
+}
+
+static DBusMessage *get_metrics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+	dbus_bool_t value = enabled;
+	int i;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &array);
+
+	dbus_message_iter_append_basic(&array, DBUS_TYPE_BOOLEAN, &value);
+
+	dbus_message_iter_open_container(&array, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	for (i = 0; i < CONNMAN_METRIC_MAX; i++) {
+		DBusMessageIter entry, metric;
+
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+								NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&metrics[i].name);
+
+		connman_dbus_dict_open(&entry, &metric);
+		append_metric(&metric, &metrics[i]);
+		connman_dbus_dict_close(&entry, &metric);
+
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	dbus_message_iter_close_container(&array, &dict);
+
+	return reply;
+}
+
+static DBusMessage *enable_metrics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	dbus_bool_t enable;
+
+	DBG("conn %p", conn);
+
+	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_BOOLEAN, &enable,
+					DBUS_TYPE_INVALID) == FALSE)
+		return __connman_error_invalid_arguments(msg);
+
+	metrics_enable(enable);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *reset_metrics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBG("conn %p", conn);
+
+	metrics_reset();
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
+static const GDBusMethodTable debug_methods[] = {
+	{ GDBUS_METHOD("GetMetrics",
+			NULL, GDBUS_ARGS({ "enabled", "b" },
+					{ "metrics", "a{sa{sv}}" }),
+			get_metrics) },
+	{ GDBUS_METHOD("EnableMetrics",
+			GDBUS_ARGS({ "enable", "b" }), NULL,
+			enable_metrics) },
+	{ GDBUS_METHOD("ResetMetrics", NULL, NULL, reset_metrics) },
+	{ },
+};
+
+int __connman_metrics_init(void)
+{
+	DBG("");
+
+	connection = connman_dbus_get_connection();
+	if (connection == NULL)
+		return -1;
+
+	if (getenv("CONNMAN_METRICS") != NULL)
+		metrics_enable(TRUE);
+
+	g_dbus_register_interface(connection, CONNMAN_MANAGER_PATH,
+						CONNMAN_DEBUG_INTERFACE,
+						debug_methods, NULL,
+						NULL, NULL, NULL);
+
+	return 0;
+}
+
+void __connman_metrics_cleanup(void)
+{
+	DBG("");
+
+	if (connection == NULL)
+		return;
+
+	metrics_enable(FALSE);
+
+	g_dbus_unregister_interface(connection, CONNMAN_MANAGER_PATH,
+						CONNMAN_DEBUG_INTERFACE);
+
+	dbus_connection_unref(connection);
+}
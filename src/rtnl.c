@@ -59,7 +59,8 @@ struct watch_data {
 static GSList *watch_list = NULL;
 static unsigned int watch_id = 0;
 
-static GSList *update_list = NULL;
+/* update interval in seconds -> number of counters using it */
+static GHashTable *update_table = NULL;
 static guint update_interval = G_MAXUINT;
 static guint update_timeout = 0;
 
@@ -353,10 +354,36 @@ static const char *operstate2str(unsigned char operstate)
 	return "";
 }
 
+/*
+ * Widen the 32 bit counters of IFLA_STATS, the wrap arounds are taken
+ * care of when the counters are accounted, as long as the counters are
+ * not reported as coming from IFLA_STATS64.
+ */
+static void copy_stats(struct rtnl_link_stats64 *stats, const void *data,
+							unsigned int len)
+{
+	struct rtnl_link_stats stats32;
+
+	memset(&stats32, 0, sizeof(stats32));
+	memcpy(&stats32, data, MIN(len, sizeof(stats32)));
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->rx_packets = stats32.rx_packets;
+	stats->tx_packets = stats32.tx_packets;
+	stats->rx_bytes = stats32.rx_bytes;
+	stats->tx_bytes = stats32.tx_bytes;
+	stats->rx_errors = stats32.rx_errors;
+	stats->tx_errors = stats32.tx_errors;
+	stats->rx_dropped = stats32.rx_dropped;
+	stats->tx_dropped = stats32.tx_dropped;
+}
+
 static connman_bool_t extract_link(struct ifinfomsg *msg, int bytes,
 				struct ether_addr *address, const char **ifname,
 				unsigned int *mtu, unsigned char *operstate,
-				struct rtnl_link_stats *stats)
+				struct rtnl_link_stats64 *stats,
+				connman_bool_t *stats64)
 {
 	struct rtattr *attr;
 
@@ -376,9 +403,18 @@ static connman_bool_t extract_link(struct ifinfomsg *msg, int bytes,
 				*mtu = *((unsigned int *) RTA_DATA(attr));
 			break;
 		case IFLA_STATS:
-			if (stats != NULL)
+			/* only used by kernels without 64 bit counters */
+			if (stats != NULL && *stats64 == FALSE)
+				copy_stats(stats, RTA_DATA(attr),
+							RTA_PAYLOAD(attr));
+			break;
+		case IFLA_STATS64:
+			if (stats != NULL) {
+				memset(stats, 0, sizeof(*stats));
 				memcpy(stats, RTA_DATA(attr),
-					sizeof(struct rtnl_link_stats));
+					MIN(RTA_PAYLOAD(attr), sizeof(*stats)));
+				*stats64 = TRUE;
+			}
 			break;
 		case IFLA_OPERSTATE:
 			if (operstate != NULL)
@@ -399,7 +435,8 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 {
 	struct ether_addr address = {{ 0, 0, 0, 0, 0, 0 }};
 	struct ether_addr compare = {{ 0, 0, 0, 0, 0, 0 }};
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
+	connman_bool_t stats64 = FALSE;
 	unsigned char operstate = 0xff;
 	struct interface_data *interface;
 	const char *ifname = NULL;
@@ -409,7 +446,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 
 	memset(&stats, 0, sizeof(stats));
 	if (extract_link(msg, bytes, &address, &ifname, &mtu, &operstate,
-					&stats) == FALSE)
+					&stats, &stats64) == FALSE)
 		return;
 
 	snprintf(ident, 13, "%02x%02x%02x%02x%02x%02x",
@@ -435,7 +472,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	case ARPHRD_PPP:
 	case ARPHRD_NONE:
 		__connman_ipconfig_newlink(index, type, flags,
-							str, mtu, &stats);
+						str, mtu, &stats, stats64);
 		break;
 	}
 
@@ -486,14 +523,15 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 static void process_dellink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
+	connman_bool_t stats64 = FALSE;
 	unsigned char operstate = 0xff;
 	const char *ifname = NULL;
 	GSList *list;
 
 	memset(&stats, 0, sizeof(stats));
 	if (extract_link(msg, bytes, NULL, &ifname, NULL, &operstate,
-					&stats) == FALSE)
+					&stats, &stats64) == FALSE)
 		return;
 
 	if (operstate != 0xff)
@@ -512,7 +550,7 @@ static void process_dellink(unsigned short type, int index, unsigned flags,
 	case ARPHRD_ETHER:
 	case ARPHRD_LOOPBACK:
 	case ARPHRD_NONE:
-		__connman_ipconfig_dellink(index, &stats);
+		__connman_ipconfig_dellink(index, &stats, stats64);
 		break;
 	}
 
@@ -571,62 +609,157 @@ static void extract_ipv6_addr(struct ifaddrmsg *msg, int bytes,
 	}
 }
 
-static void process_newaddr(unsigned char family, unsigned char prefixlen,
-				int index, struct ifaddrmsg *msg, int bytes)
+/*
+ * Address and route changes are collected while a batch of netlink
+ * messages is read and only the latest state of each address and
+ * route is handed on once the batch is done.
+ */
+struct rtnl_change {
+	char *key;
+	uint16_t type;
+	unsigned char family;
+	unsigned char prefixlen;
+	unsigned char scope;
+	int index;
+	char *label;
+	char address[INET6_ADDRSTRLEN];
+	char gateway[INET6_ADDRSTRLEN];
+	connman_bool_t default_route;
+};
+
+/* change_table maps the key of a change to its link in change_queue */
+static GQueue change_queue = G_QUEUE_INIT;
+static GHashTable *change_table = NULL;
+
+static void free_change(struct rtnl_change *change)
 {
-	const char *label = NULL;
-	void *src;
-	char ip_string[INET6_ADDRSTRLEN];
+	g_free(change->key);
+	g_free(change->label);
+	g_free(change);
+}
 
-	if (family == AF_INET) {
-		struct in_addr ipv4_addr = { INADDR_ANY };
+static void queue_change(struct rtnl_change *change)
+{
+	GList *link;
+
+	change->key = g_strdup_printf("%d %d %d %u %u %s %s",
+				change->type == RTM_NEWADDR ||
+				change->type == RTM_DELADDR,
+				change->family, change->index,
+				change->prefixlen, change->scope,
+				change->address, change->gateway);
+
+	/*
+	 * The latest change replaces the earlier one and goes to the
+	 * tail, so it is not dispatched ahead of the changes which
+	 * happened in between.
+	 */
+	link = g_hash_table_lookup(change_table, change->key);
+	if (link != NULL) {
+		struct rtnl_change *old = link->data;
+
+		DBG("coalescing %s", change->key);
+
+		g_hash_table_remove(change_table, old->key);
+		g_queue_unlink(&change_queue, link);
+		free_change(old);
+	} else
+		link = g_list_alloc();
 
-		extract_ipv4_addr(msg, bytes, &label, &ipv4_addr, NULL, NULL);
-		src = &ipv4_addr;
-	} else if (family == AF_INET6) {
-		struct in6_addr ipv6_address, ipv6_local;
+	link->data = change;
 
-		extract_ipv6_addr(msg, bytes, &ipv6_address, &ipv6_local);
-		if (IN6_IS_ADDR_LINKLOCAL(&ipv6_address))
-			return;
+	g_hash_table_insert(change_table, change->key, link);
+	g_queue_push_tail_link(&change_queue, link);
+}
 
-		src = &ipv6_address;
-	} else {
-		return;
+static void dispatch_change(struct rtnl_change *change)
+{
+	GSList *list;
+
+	switch (change->type) {
+	case RTM_NEWADDR:
+		__connman_ipconfig_newaddr(change->index, change->family,
+					change->label, change->prefixlen,
+					change->address);
+
+		if (change->family == AF_INET6) {
+			/*
+			 * Re-create RDNSS configured servers if there are any
+			 * for this interface. This is done because we might
+			 * have now properly configured interface with proper
+			 * autoconfigured address.
+			 */
+			__connman_resolver_redo_servers(change->index);
+		}
+		break;
+	case RTM_DELADDR:
+		__connman_ipconfig_deladdr(change->index, change->family,
+					change->label, change->prefixlen,
+					change->address);
+		break;
+	case RTM_NEWROUTE:
+		__connman_ipconfig_newroute(change->index, change->family,
+					change->scope, change->address,
+					change->gateway);
+
+		if (change->default_route == FALSE)
+			break;
+
+		for (list = rtnl_list; list; list = list->next) {
+			struct connman_rtnl *rtnl = list->data;
+
+			if (rtnl->newgateway)
+				rtnl->newgateway(change->index,
+							change->gateway);
+		}
+		break;
+	case RTM_DELROUTE:
+		__connman_ipconfig_delroute(change->index, change->family,
+					change->scope, change->address,
+					change->gateway);
+
+		if (change->default_route == FALSE)
+			break;
+
+		for (list = rtnl_list; list; list = list->next) {
+			struct connman_rtnl *rtnl = list->data;
+
+			if (rtnl->delgateway)
+				rtnl->delgateway(change->index,
+							change->gateway);
+		}
+		break;
 	}
+}
 
-	if (inet_ntop(family, src, ip_string, INET6_ADDRSTRLEN) == NULL)
-		return;
+static void flush_changes(void)
+{
+	struct rtnl_change *change;
+
+	while ((change = g_queue_pop_head(&change_queue)) != NULL) {
+		g_hash_table_remove(change_table, change->key);
+
+		dispatch_change(change);
 
-	__connman_ipconfig_newaddr(index, family, label,
-					prefixlen, ip_string);
-
-	if (family == AF_INET6) {
-		/*
-		 * Re-create RDNSS configured servers if there are any
-		 * for this interface. This is done because we might
-		 * have now properly configured interface with proper
-		 * autoconfigured address.
-		 */
-		__connman_resolver_redo_servers(index);
+		free_change(change);
 	}
 }
 
-static void process_deladdr(unsigned char family, unsigned char prefixlen,
-				int index, struct ifaddrmsg *msg, int bytes)
+static void process_addr(uint16_t type, unsigned char family,
+				unsigned char prefixlen, int index,
+				struct ifaddrmsg *msg, int bytes)
 {
+	struct rtnl_change *change;
+	struct in_addr ipv4_addr = { INADDR_ANY };
+	struct in6_addr ipv6_address, ipv6_local;
 	const char *label = NULL;
 	void *src;
 	char ip_string[INET6_ADDRSTRLEN];
 
 	if (family == AF_INET) {
-		struct in_addr ipv4_addr = { INADDR_ANY };
-
 		extract_ipv4_addr(msg, bytes, &label, &ipv4_addr, NULL, NULL);
 		src = &ipv4_addr;
 	} else if (family == AF_INET6) {
-		struct in6_addr ipv6_address, ipv6_local;
-
 		extract_ipv6_addr(msg, bytes, &ipv6_address, &ipv6_local);
 		if (IN6_IS_ADDR_LINKLOCAL(&ipv6_address))
 			return;
@@ -639,8 +772,18 @@ static void process_deladdr(unsigned char family, unsigned char prefixlen,
 	if (inet_ntop(family, src, ip_string, INET6_ADDRSTRLEN) == NULL)
 		return;
 
-	__connman_ipconfig_deladdr(index, family, label,
-					prefixlen, ip_string);
+	change = g_try_new0(struct rtnl_change, 1);
+	if (change == NULL)
+		return;
+
+	change->type = type;
+	change->family = family;
+	change->prefixlen = prefixlen;
+	change->index = index;
+	change->label = g_strdup(label);
+	strcpy(change->address, ip_string);
+
+	queue_change(change);
 }
 
 static void extract_ipv4_route(struct rtmsg *msg, int bytes, int *index,
@@ -694,118 +837,56 @@ static void extract_ipv6_route(struct rtmsg *msg, int bytes, int *index,
 	}
 }
 
-static void process_newroute(unsigned char family, unsigned char scope,
-						struct rtmsg *msg, int bytes)
+static void process_route(uint16_t type, unsigned char family,
+				unsigned char scope, struct rtmsg *msg, int bytes)
 {
-	GSList *list;
-	char dststr[INET6_ADDRSTRLEN], gatewaystr[INET6_ADDRSTRLEN];
+	struct rtnl_change *change;
+	connman_bool_t any_dst;
 	int index = -1;
 
+	change = g_try_new0(struct rtnl_change, 1);
+	if (change == NULL)
+		return;
+
 	if (family == AF_INET) {
 		struct in_addr dst = { INADDR_ANY }, gateway = { INADDR_ANY };
 
 		extract_ipv4_route(msg, bytes, &index, &dst, &gateway);
 
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
-
-		__connman_ipconfig_newroute(index, family, scope, dststr,
-								gatewaystr);
-
-		/* skip host specific routes */
-		if (scope != RT_SCOPE_UNIVERSE &&
-			!(scope == RT_SCOPE_LINK && dst.s_addr == INADDR_ANY))
-			return;
-
-		if (dst.s_addr != INADDR_ANY)
-			return;
+		inet_ntop(family, &dst, change->address,
+						sizeof(change->address));
+		inet_ntop(family, &gateway, change->gateway,
+						sizeof(change->gateway));
 
+		any_dst = dst.s_addr == INADDR_ANY;
 	} else if (family == AF_INET6) {
 		struct in6_addr dst = IN6ADDR_ANY_INIT,
 				gateway = IN6ADDR_ANY_INIT;
 
 		extract_ipv6_route(msg, bytes, &index, &dst, &gateway);
 
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
-
-		__connman_ipconfig_newroute(index, family, scope, dststr,
-								gatewaystr);
-
-		/* skip host specific routes */
-		if (scope != RT_SCOPE_UNIVERSE &&
-			!(scope == RT_SCOPE_LINK &&
-				IN6_IS_ADDR_UNSPECIFIED(&dst)))
-			return;
+		inet_ntop(family, &dst, change->address,
+						sizeof(change->address));
+		inet_ntop(family, &gateway, change->gateway,
+						sizeof(change->gateway));
 
-		if (!IN6_IS_ADDR_UNSPECIFIED(&dst))
-			return;
-	} else
+		any_dst = IN6_IS_ADDR_UNSPECIFIED(&dst);
+	} else {
+		g_free(change);
 		return;
-
-	for (list = rtnl_list; list; list = list->next) {
-		struct connman_rtnl *rtnl = list->data;
-
-		if (rtnl->newgateway)
-			rtnl->newgateway(index, gatewaystr);
 	}
-}
-
-static void process_delroute(unsigned char family, unsigned char scope,
-						struct rtmsg *msg, int bytes)
-{
-	GSList *list;
-	char dststr[INET6_ADDRSTRLEN], gatewaystr[INET6_ADDRSTRLEN];
-	int index = -1;
-
-	if (family == AF_INET) {
-		struct in_addr dst = { INADDR_ANY }, gateway = { INADDR_ANY };
-
-		extract_ipv4_route(msg, bytes, &index, &dst, &gateway);
-
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
-
-		__connman_ipconfig_delroute(index, family, scope, dststr,
-								gatewaystr);
-
-		/* skip host specific routes */
-		if (scope != RT_SCOPE_UNIVERSE &&
-			!(scope == RT_SCOPE_LINK && dst.s_addr == INADDR_ANY))
-			return;
-
-		if (dst.s_addr != INADDR_ANY)
-			return;
-
-	}  else if (family == AF_INET6) {
-		struct in6_addr dst = IN6ADDR_ANY_INIT,
-				gateway = IN6ADDR_ANY_INIT;
-
-		extract_ipv6_route(msg, bytes, &index, &dst, &gateway);
-
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
 
-		__connman_ipconfig_delroute(index, family, scope, dststr,
-						gatewaystr);
+	change->type = type;
+	change->family = family;
+	change->scope = scope;
+	change->index = index;
 
-		/* skip host specific routes */
-		if (scope != RT_SCOPE_UNIVERSE &&
-			!(scope == RT_SCOPE_LINK &&
-				IN6_IS_ADDR_UNSPECIFIED(&dst)))
-			return;
-
-		if (!IN6_IS_ADDR_UNSPECIFIED(&dst))
-			return;
-	} else
-		return;
-
-	for (list = rtnl_list; list; list = list->next) {
-		struct connman_rtnl *rtnl = list->data;
+	/* skip host specific routes */
+	if (any_dst == TRUE && (scope == RT_SCOPE_UNIVERSE ||
+					scope == RT_SCOPE_LINK))
+		change->default_route = TRUE;
 
-		if (rtnl->delgateway)
-			rtnl->delgateway(index, gatewaystr);
-	}
+	queue_change(change);
 }
 
 static inline void print_ether(struct rtattr *attr, const char *name)
@@ -896,6 +977,9 @@ static void rtnl_link(struct nlmsghdr *hdr)
 		case IFLA_STATS:
 			print_attr(attr, "stats");
 			break;
+		case IFLA_STATS64:
+			print_attr(attr, "stats64");
+			break;
 		case IFLA_COST:
 			print_attr(attr, "cost");
 			break;
@@ -1001,8 +1085,8 @@ static void rtnl_newaddr(struct nlmsghdr *hdr)
 
 	rtnl_addr(hdr);
 
-	process_newaddr(msg->ifa_family, msg->ifa_prefixlen, msg->ifa_index,
-						msg, IFA_PAYLOAD(hdr));
+	process_addr(RTM_NEWADDR, msg->ifa_family, msg->ifa_prefixlen,
+				msg->ifa_index, msg, IFA_PAYLOAD(hdr));
 }
 
 static void rtnl_deladdr(struct nlmsghdr *hdr)
@@ -1011,8 +1095,8 @@ static void rtnl_deladdr(struct nlmsghdr *hdr)
 
 	rtnl_addr(hdr);
 
-	process_deladdr(msg->ifa_family, msg->ifa_prefixlen, msg->ifa_index,
-						msg, IFA_PAYLOAD(hdr));
+	process_addr(RTM_DELADDR, msg->ifa_family, msg->ifa_prefixlen,
+				msg->ifa_index, msg, IFA_PAYLOAD(hdr));
 }
 
 static void rtnl_route(struct nlmsghdr *hdr)
@@ -1089,7 +1173,7 @@ static void rtnl_newroute(struct nlmsghdr *hdr)
 	rtnl_route(hdr);
 
 	if (is_route_rtmsg(msg))
-		process_newroute(msg->rtm_family, msg->rtm_scope,
+		process_route(RTM_NEWROUTE, msg->rtm_family, msg->rtm_scope,
 						msg, RTM_PAYLOAD(hdr));
 }
 
@@ -1100,7 +1184,7 @@ static void rtnl_delroute(struct nlmsghdr *hdr)
 	rtnl_route(hdr);
 
 	if (is_route_rtmsg(msg))
-		process_delroute(msg->rtm_family, msg->rtm_scope,
+		process_route(RTM_DELROUTE, msg->rtm_family, msg->rtm_scope,
 						msg, RTM_PAYLOAD(hdr));
 }
 
@@ -1277,12 +1361,23 @@ static const char *type2string(uint16_t type)
 
 static GIOChannel *channel = NULL;
 
+/* messages read from the socket before the changes are handed on */
+#define RTNL_BATCH_SIZE		64
+#define RTNL_BUFFER_SIZE	8192
+#define RTNL_RCVBUF_DEFAULT	(1024 * 1024)
+
+static unsigned char *rtnl_buf = NULL;
+static size_t rtnl_buf_size = 0;
+
 struct rtnl_request {
 	struct nlmsghdr hdr;
 	struct rtgenmsg msg;
 };
 #define RTNL_REQUEST_SIZE  (sizeof(struct nlmsghdr) + sizeof(struct rtgenmsg))
 
+/* a request for a single link carries an ifinfomsg instead */
+#define RTNL_LINK_REQUEST_SIZE  NLMSG_LENGTH(sizeof(struct ifinfomsg))
+
 static GSList *request_list = NULL;
 static guint32 request_seq = 0;
 
@@ -1348,6 +1443,26 @@ static int process_response(guint32 seq)
 	return send_request(req);
 }
 
+/*
+ * The reply to a request for a single link is not terminated by
+ * NLMSG_DONE, it is the only message with the sequence number of
+ * the request.
+ */
+static gboolean is_link_response(struct nlmsghdr *hdr)
+{
+	struct rtnl_request *req;
+
+	if (hdr->nlmsg_flags & NLM_F_MULTI)
+		return FALSE;
+
+	req = find_request(hdr->nlmsg_seq);
+	if (req == NULL || req->hdr.nlmsg_type != RTM_GETLINK ||
+				(req->hdr.nlmsg_flags & NLM_F_DUMP))
+		return FALSE;
+
+	return TRUE;
+}
+
 static void rtnl_message(void *buf, size_t len)
 {
 	DBG("buf %p len %zd", buf, len);
@@ -1365,6 +1480,18 @@ static void rtnl_message(void *buf, size_t len)
 					hdr->nlmsg_flags, hdr->nlmsg_seq,
 					hdr->nlmsg_pid);
 
+		/* keep the order of the changes relative to other messages */
+		switch (hdr->nlmsg_type) {
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+		case RTM_NEWROUTE:
+		case RTM_DELROUTE:
+			break;
+		default:
+			flush_changes();
+			break;
+		}
+
 		switch (hdr->nlmsg_type) {
 		case NLMSG_NOOP:
 		case NLMSG_OVERRUN:
@@ -1376,9 +1503,13 @@ static void rtnl_message(void *buf, size_t len)
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			if (is_link_response(hdr) == TRUE)
+				process_response(hdr->nlmsg_seq);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
+			if (is_link_response(hdr) == TRUE)
+				process_response(hdr->nlmsg_seq);
 			break;
 		case RTM_DELLINK:
 			rtnl_dellink(hdr);
@@ -1405,43 +1536,108 @@ static void rtnl_message(void *buf, size_t len)
 	}
 }
 
+static int send_getlink(void);
+static int send_getaddr(void);
+static int send_getroute(void);
+
+/*
+ * Notifications were dropped because the receive buffer overflowed,
+ * so the complete state is requested again.
+ */
+static void resync(void)
+{
+	GSList *list;
+
+	for (list = request_list; list; list = list->next) {
+		struct rtnl_request *req = list->data;
+
+		/* a full dump is already pending */
+		if (req->hdr.nlmsg_type == RTM_GETROUTE &&
+				(req->hdr.nlmsg_flags & NLM_F_DUMP))
+			return;
+	}
+
+	connman_warn("Netlink receive buffer overrun, resynchronizing");
+
+	send_getlink();
+	send_getaddr();
+	send_getroute();
+}
+
+static ssize_t netlink_recv(int fd, struct sockaddr_nl *nladdr)
+{
+	socklen_t addr_len = sizeof(*nladdr);
+	unsigned char *buf;
+	ssize_t len;
+
+	/* find out the size of the next message first */
+	len = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+	if (len < 0)
+		return -errno;
+
+	if ((size_t) len > rtnl_buf_size) {
+		buf = g_try_realloc(rtnl_buf, len);
+		if (buf == NULL)
+			return -ENOMEM;
+
+		rtnl_buf = buf;
+		rtnl_buf_size = len;
+	}
+
+	memset(nladdr, 0, sizeof(*nladdr));
+
+	len = recvfrom(fd, rtnl_buf, rtnl_buf_size, MSG_DONTWAIT,
+				(struct sockaddr *) nladdr, &addr_len);
+	if (len < 0)
+		return -errno;
+
+	return len;
+}
+
 static gboolean netlink_event(GIOChannel *chan,
 				GIOCondition cond, gpointer data)
 {
-	unsigned char buf[4096];
 	struct sockaddr_nl nladdr;
-	socklen_t addr_len = sizeof(nladdr);
 	ssize_t status;
-	int fd;
+	gint64 start;
+	gboolean ret = TRUE;
+	int fd, i;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
 		return FALSE;
 
-	memset(buf, 0, sizeof(buf));
-	memset(&nladdr, 0, sizeof(nladdr));
-
 	fd = g_io_channel_unix_get_fd(chan);
 
-	status = recvfrom(fd, buf, sizeof(buf), 0,
-                       (struct sockaddr *) &nladdr, &addr_len);
-	if (status < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			return TRUE;
+	start = __connman_metrics_start();
 
-		return FALSE;
-	}
+	for (i = 0; i < RTNL_BATCH_SIZE; i++) {
+		status = netlink_recv(fd, &nladdr);
+		if (status == -ENOBUFS) {
+			resync();
+			continue;
+		}
 
-	if (status == 0)
-		return FALSE;
+		if (status == -EINTR || status == -EAGAIN)
+			break;
 
-	if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
-		DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
-		return TRUE;
+		if (status <= 0) {
+			ret = FALSE;
+			break;
+		}
+
+		if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
+			DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
+			continue;
+		}
+
+		rtnl_message(rtnl_buf, status);
 	}
 
-	rtnl_message(buf, status);
+	flush_changes();
 
-	return TRUE;
+	__connman_metrics_stop(CONNMAN_METRIC_RTNL_MESSAGE, start);
+
+	return ret;
 }
 
 static int send_getlink(void)
@@ -1464,6 +1660,46 @@ static int send_getlink(void)
 	return queue_request(req);
 }
 
+static int send_getlink_index(int index)
+{
+	struct rtnl_request *req;
+	struct ifinfomsg *msg;
+	GSList *list;
+
+	DBG("index %d", index);
+
+	/* the link is already going to be reported */
+	for (list = request_list; list; list = list->next) {
+		req = list->data;
+
+		if (req->hdr.nlmsg_type != RTM_GETLINK)
+			continue;
+
+		if (req->hdr.nlmsg_flags & NLM_F_DUMP)
+			return 0;
+
+		msg = NLMSG_DATA(&req->hdr);
+		if (msg->ifi_index == index)
+			return 0;
+	}
+
+	req = g_try_malloc0(RTNL_LINK_REQUEST_SIZE);
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->hdr.nlmsg_len = RTNL_LINK_REQUEST_SIZE;
+	req->hdr.nlmsg_type = RTM_GETLINK;
+	req->hdr.nlmsg_flags = NLM_F_REQUEST;
+	req->hdr.nlmsg_pid = 0;
+	req->hdr.nlmsg_seq = request_seq++;
+
+	msg = NLMSG_DATA(&req->hdr);
+	msg->ifi_family = AF_UNSPEC;
+	msg->ifi_index = index;
+
+	return queue_request(req);
+}
+
 static int send_getaddr(void)
 {
 	struct rtnl_request *req;
@@ -1526,27 +1762,34 @@ static void update_interval_callback(guint min)
 	}
 }
 
-static gint compare_interval(gconstpointer a, gconstpointer b)
+static guint update_interval_min(void)
 {
-	guint val_a = GPOINTER_TO_UINT(a);
-	guint val_b = GPOINTER_TO_UINT(b);
+	GHashTableIter iter;
+	gpointer key, value;
+	guint min = G_MAXUINT;
+
+	g_hash_table_iter_init(&iter, update_table);
 
-	return val_a - val_b;
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE)
+		min = MIN(min, GPOINTER_TO_UINT(key));
+
+	return min;
 }
 
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval)
 {
-	guint min;
+	guint count;
 
 	if (interval == 0)
 		return 0;
 
-	update_list = g_slist_insert_sorted(update_list,
-			GUINT_TO_POINTER(interval), compare_interval);
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(update_table,
+					GUINT_TO_POINTER(interval)));
+	g_hash_table_replace(update_table, GUINT_TO_POINTER(interval),
+					GUINT_TO_POINTER(count + 1));
 
-	min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
-	if (min < update_interval) {
-		update_interval_callback(min);
+	if (interval < update_interval) {
+		update_interval_callback(interval);
 		__connman_rtnl_request_update();
 	}
 
@@ -1555,25 +1798,60 @@ unsigned int __connman_rtnl_update_interval_add(unsigned int interval)
 
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval)
 {
-	guint min = G_MAXUINT;
+	guint count, min;
 
 	if (interval == 0)
 		return 0;
 
-	update_list = g_slist_remove(update_list, GINT_TO_POINTER(interval));
-
-	if (update_list != NULL)
-		min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(update_table,
+					GUINT_TO_POINTER(interval)));
+	if (count > 1)
+		g_hash_table_replace(update_table, GUINT_TO_POINTER(interval),
+					GUINT_TO_POINTER(count - 1));
+	else
+		g_hash_table_remove(update_table, GUINT_TO_POINTER(interval));
 
+	/* only the distinct intervals are looked at */
+	min = update_interval_min();
 	if (min > update_interval)
 		update_interval_callback(min);
 
 	return min;
 }
 
+/*
+ * Only the links of the services with registered counters are asked
+ * for their statistics instead of dumping all links.
+ */
 int __connman_rtnl_request_update(void)
 {
-	return send_getlink();
+	return __connman_service_request_stats();
+}
+
+int __connman_rtnl_request_link_update(int index)
+{
+	if (index < 0)
+		return -EINVAL;
+
+	return send_getlink_index(index);
+}
+
+static void set_rcvbuf(int sk)
+{
+	int size;
+
+	size = connman_setting_get_uint("NetlinkReceiveBuffer");
+	if (size <= 0)
+		size = RTNL_RCVBUF_DEFAULT;
+
+	/* SO_RCVBUFFORCE is not limited by rmem_max */
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUFFORCE,
+					&size, sizeof(size)) == 0)
+		return;
+
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		connman_warn("Failed to set netlink receive buffer: %s",
+							strerror(errno));
 }
 
 int __connman_rtnl_init(void)
@@ -1586,10 +1864,22 @@ int __connman_rtnl_init(void)
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
 
+	update_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	change_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+	rtnl_buf = g_try_malloc(RTNL_BUFFER_SIZE);
+	if (rtnl_buf == NULL)
+		return -ENOMEM;
+
+	rtnl_buf_size = RTNL_BUFFER_SIZE;
+
 	sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
 	if (sk < 0)
 		return -1;
 
+	set_rcvbuf(sk);
+
 	memset(&addr, 0, sizeof(addr));
 	addr.nl_family = AF_NETLINK;
 	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE |
@@ -1624,6 +1914,7 @@ void __connman_rtnl_start(void)
 
 void __connman_rtnl_cleanup(void)
 {
+	struct rtnl_change *change;
 	GSList *list;
 
 	DBG("");
@@ -1640,8 +1931,13 @@ void __connman_rtnl_cleanup(void)
 	g_slist_free(watch_list);
 	watch_list = NULL;
 
-	g_slist_free(update_list);
-	update_list = NULL;
+	if (update_timeout > 0) {
+		g_source_remove(update_timeout);
+		update_timeout = 0;
+	}
+
+	g_hash_table_destroy(update_table);
+	update_table = NULL;
 
 	for (list = request_list; list; list = list->next) {
 		struct rtnl_request *req = list->data;
@@ -1658,6 +1954,16 @@ void __connman_rtnl_cleanup(void)
 	g_slist_free(request_list);
 	request_list = NULL;
 
+	while ((change = g_queue_pop_head(&change_queue)) != NULL)
+		free_change(change);
+
+	g_hash_table_destroy(change_table);
+	change_table = NULL;
+
+	g_free(rtnl_buf);
+	rtnl_buf = NULL;
+	rtnl_buf_size = 0;
+
 	g_io_channel_shutdown(channel, TRUE, NULL);
 	g_io_channel_unref(channel);
 
@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <gdbus.h>
@@ -38,14 +39,43 @@
 
 #define CONNECT_TIMEOUT		120
 
+/* seconds a changed service is collected before it is written */
+#define SAVE_DELAY		1
+
+/* strength has to change this much before a service is moved */
+#define SORT_STRENGTH_HYSTERESIS	5
+
+/* number of removed services remembered for GetServicesSince */
+#define REMOVED_HISTORY		256
+
+/* maximal number of intervals returned by one GetStatistics call */
+#define STATISTICS_CHUNK	256
+
 static DBusConnection *connection = NULL;
 
 static GSequence *service_list = NULL;
-static GHashTable *service_hash = NULL;
 static GSList *counter_list = NULL;
 static unsigned int autoconnect_timeout = 0;
 static struct connman_service *current_default = NULL;
 static connman_bool_t services_dirty = FALSE;
+static GSList *save_queue = NULL;
+static guint save_timeout = 0;
+
+/*
+ * Every added, changed, moved or removed service gets the next
+ * generation. The upper 32 bits hold a random id of this run, so a
+ * generation of an earlier run is not mistaken for one of this run.
+ * Changes before removed_floor are no longer known completely,
+ * because the older removals dropped out of removed_services.
+ */
+static guint64 services_generation = 0;
+static guint64 removed_floor = 0;
+static GQueue removed_services = G_QUEUE_INIT;
+
+struct removed_service {
+	char *path;
+	guint64 generation;
+};
 
 struct connman_stats {
 	connman_bool_t valid;
@@ -123,9 +153,14 @@ struct connman_service {
 	connman_bool_t hidden_service;
 	char *config_file;
 	char *config_entry;
+	connman_bool_t save_pending;
+	guint64 sort_key;
+	connman_uint8_t sort_strength;
+	guint64 generation;
 };
 
 static connman_bool_t allow_property_changed(struct connman_service *service);
+static void service_sort(struct connman_service *service);
 
 static struct connman_ipconfig *create_ip4config(struct connman_service *service,
 		int index, enum connman_ipconfig_method method);
@@ -133,32 +168,17 @@ static struct connman_ipconfig *create_ip6config(struct connman_service *service
 		int index);
 
 
-struct find_data {
-	const char *path;
-	struct connman_service *service;
-};
-
-static void compare_path(gpointer value, gpointer user_data)
-{
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
-
-	if (data->service != NULL)
-		return;
-
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
-}
-
 static struct connman_service *find_service(const char *path)
 {
-	struct find_data data = { .path = path, .service = NULL };
+	GSequenceIter *iter;
 
 	DBG("path %s", path);
 
-	g_sequence_foreach(service_list, compare_path, &data);
+	iter = __connman_serviceindex_lookup_path(path);
+	if (iter == NULL)
+		return NULL;
 
-	return data.service;
+	return g_sequence_get(iter);
 }
 
 const char *__connman_service_type2string(enum connman_service_type type)
@@ -504,7 +524,7 @@ done:
 	return err;
 }
 
-static int service_save(struct connman_service *service)
+static int service_write(struct connman_service *service)
 {
 	GKeyFile *keyfile;
 	gchar *str;
@@ -700,6 +720,87 @@ done:
 	return err;
 }
 
+static gboolean save_next_service(gpointer user_data)
+{
+	struct connman_service *service;
+
+	if (save_queue == NULL) {
+		save_timeout = 0;
+		return FALSE;
+	}
+
+	/* one service per main loop iteration */
+	service = save_queue->data;
+	save_queue = g_slist_delete_link(save_queue, save_queue);
+
+	service->save_pending = FALSE;
+	service_write(service);
+
+	if (save_queue == NULL) {
+		save_timeout = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean save_services(gpointer user_data)
+{
+	save_timeout = g_idle_add(save_next_service, NULL);
+
+	return FALSE;
+}
+
+/*
+ * Only marks the service as changed. All changes within SAVE_DELAY
+ * seconds end up in a single write of its settings file.
+ */
+static int service_save(struct connman_service *service)
+{
+	if (service->new_service == TRUE)
+		return -ESRCH;
+
+	if (service->save_pending == TRUE)
+		return 0;
+
+	DBG("service %p", service);
+
+	service->save_pending = TRUE;
+	save_queue = g_slist_append(save_queue, service);
+
+	if (save_timeout == 0)
+		save_timeout = g_timeout_add_seconds(SAVE_DELAY,
+							save_services, NULL);
+
+	return 0;
+}
+
+/*
+ * Writes a pending change right away, before the settings file is
+ * read again or the service goes away.
+ */
+static void service_save_flush(struct connman_service *service)
+{
+	if (service->save_pending == FALSE)
+		return;
+
+	save_queue = g_slist_remove(save_queue, service);
+	service->save_pending = FALSE;
+
+	service_write(service);
+}
+
+static void service_save_flush_all(void)
+{
+	if (save_timeout != 0) {
+		g_source_remove(save_timeout);
+		save_timeout = 0;
+	}
+
+	while (save_queue != NULL)
+		save_next_service(NULL);
+}
+
 void __connman_service_save(struct connman_service *service)
 {
 	service_save(service);
@@ -1891,49 +1992,49 @@ static void stats_append_counters(DBusMessageIter *dict,
 	if (counters->rx_packets != stats->rx_packets || append_all) {
 		counters->rx_packets = stats->rx_packets;
 		connman_dbus_dict_append_basic(dict, "RX.Packets",
-					DBUS_TYPE_UINT32, &stats->rx_packets);
+					DBUS_TYPE_UINT64, &stats->rx_packets);
 	}
 
 	if (counters->tx_packets != stats->tx_packets || append_all) {
 		counters->tx_packets = stats->tx_packets;
 		connman_dbus_dict_append_basic(dict, "TX.Packets",
-					DBUS_TYPE_UINT32, &stats->tx_packets);
+					DBUS_TYPE_UINT64, &stats->tx_packets);
 	}
 
 	if (counters->rx_bytes != stats->rx_bytes || append_all) {
 		counters->rx_bytes = stats->rx_bytes;
 		connman_dbus_dict_append_basic(dict, "RX.Bytes",
-					DBUS_TYPE_UINT32, &stats->rx_bytes);
+					DBUS_TYPE_UINT64, &stats->rx_bytes);
 	}
 
 	if (counters->tx_bytes != stats->tx_bytes || append_all) {
 		counters->tx_bytes = stats->tx_bytes;
 		connman_dbus_dict_append_basic(dict, "TX.Bytes",
-					DBUS_TYPE_UINT32, &stats->tx_bytes);
+					DBUS_TYPE_UINT64, &stats->tx_bytes);
 	}
 
 	if (counters->rx_errors != stats->rx_errors || append_all) {
 		counters->rx_errors = stats->rx_errors;
 		connman_dbus_dict_append_basic(dict, "RX.Errors",
-					DBUS_TYPE_UINT32, &stats->rx_errors);
+					DBUS_TYPE_UINT64, &stats->rx_errors);
 	}
 
 	if (counters->tx_errors != stats->tx_errors || append_all) {
 		counters->tx_errors = stats->tx_errors;
 		connman_dbus_dict_append_basic(dict, "TX.Errors",
-					DBUS_TYPE_UINT32, &stats->tx_errors);
+					DBUS_TYPE_UINT64, &stats->tx_errors);
 	}
 
 	if (counters->rx_dropped != stats->rx_dropped || append_all) {
 		counters->rx_dropped = stats->rx_dropped;
 		connman_dbus_dict_append_basic(dict, "RX.Dropped",
-					DBUS_TYPE_UINT32, &stats->rx_dropped);
+					DBUS_TYPE_UINT64, &stats->rx_dropped);
 	}
 
 	if (counters->tx_dropped != stats->tx_dropped || append_all) {
 		counters->tx_dropped = stats->tx_dropped;
 		connman_dbus_dict_append_basic(dict, "TX.Dropped",
-					DBUS_TYPE_UINT32, &stats->tx_dropped);
+					DBUS_TYPE_UINT64, &stats->tx_dropped);
 	}
 
 	if (counters->time != stats->time || append_all) {
@@ -1943,49 +2044,109 @@ static void stats_append_counters(DBusMessageIter *dict,
 	}
 }
 
+struct stats_append_data {
+	struct connman_service *service;
+	struct connman_stats_counter *counters;
+	connman_bool_t append_all;
+};
+
+static void stats_append_usage(DBusMessageIter *iter, void *user_data)
+{
+	struct stats_append_data *data = user_data;
+	struct connman_service *service = data->service;
+	struct connman_stats_counter *counters = data->counters;
+	DBusMessageIter dict;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH,
+							&service->path);
+
+	/* home counter */
+	connman_dbus_dict_open(iter, &dict);
+
+	stats_append_counters(&dict, &service->stats.data,
+				&counters->stats.data, data->append_all);
+
+	connman_dbus_dict_close(iter, &dict);
+
+	/* roaming counter */
+	connman_dbus_dict_open(iter, &dict);
+
+	stats_append_counters(&dict, &service->stats_roaming.data,
+				&counters->stats_roaming.data, data->append_all);
+
+	connman_dbus_dict_close(iter, &dict);
+}
+
 static void stats_append(struct connman_service *service,
 				const char *counter,
 				struct connman_stats_counter *counters,
 				connman_bool_t append_all)
 {
-	DBusMessageIter array, dict;
-	DBusMessage *msg;
+	struct stats_append_data data;
 
 	DBG("service %p counter %s", service, counter);
 
-	msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_CALL);
-	if (msg == NULL)
-		return;
+	data.service = service;
+	data.counters = counters;
+	data.append_all = append_all;
 
-	dbus_message_append_args(msg, DBUS_TYPE_OBJECT_PATH,
-				&service->path, DBUS_TYPE_INVALID);
+	__connman_counter_send_usage(counter, stats_append_usage, &data);
+}
 
-	dbus_message_iter_init_append(msg, &array);
+/*
+ * Whether the traffic since the last notification of the counter
+ * reached its threshold.
+ */
+static connman_bool_t stats_threshold_reached(struct connman_service *service,
+					const char *counter,
+					struct connman_stats_counter *counters)
+{
+	struct connman_stats_data *data, *last;
+	uint64_t threshold;
 
-	/* home counter */
-	connman_dbus_dict_open(&array, &dict);
+	threshold = __connman_counter_get_threshold(counter);
+	if (threshold == 0)
+		return TRUE;
 
-	stats_append_counters(&dict, &service->stats.data,
-				&counters->stats.data, append_all);
+	if (service->roaming == TRUE) {
+		data = &service->stats_roaming.data;
+		last = &counters->stats_roaming.data;
+	} else {
+		data = &service->stats.data;
+		last = &counters->stats.data;
+	}
 
-	connman_dbus_dict_close(&array, &dict);
+	if (data->rx_bytes < last->rx_bytes ||
+			data->tx_bytes < last->tx_bytes)
+		return TRUE;
 
-	/* roaming counter */
-	connman_dbus_dict_open(&array, &dict);
+	return data->rx_bytes - last->rx_bytes +
+			data->tx_bytes - last->tx_bytes >= threshold;
+}
 
-	stats_append_counters(&dict, &service->stats_roaming.data,
-				&counters->stats_roaming.data, append_all);
+/*
+ * Traffic since the last update. The counters go backwards when the
+ * interface was recreated or its counters were reset, which restarts
+ * them from zero. Only the 32 bit counters of IFLA_STATS also wrap.
+ */
+static uint64_t stats_delta(uint64_t current, uint64_t last,
+						connman_bool_t stats64)
+{
+	if (current >= last)
+		return current - last;
 
-	connman_dbus_dict_close(&array, &dict);
+	if (stats64 == FALSE && last <= G_MAXUINT32)
+		return current + ((uint64_t) G_MAXUINT32 + 1) - last;
 
-	__connman_counter_send_usage(counter, msg);
+	return current;
 }
 
 static void stats_update(struct connman_service *service,
-				unsigned int rx_packets, unsigned int tx_packets,
-				unsigned int rx_bytes, unsigned int tx_bytes,
-				unsigned int rx_errors, unsigned int tx_errors,
-				unsigned int rx_dropped, unsigned int tx_dropped)
+				uint64_t rx_packets, uint64_t tx_packets,
+				uint64_t rx_bytes, uint64_t tx_bytes,
+				uint64_t rx_errors, uint64_t tx_errors,
+				uint64_t rx_dropped, uint64_t tx_dropped,
+				connman_bool_t stats64)
 {
 	struct connman_stats *stats = stats_get(service);
 	struct connman_stats_data *data_last = &stats->data_last;
@@ -1996,21 +2157,29 @@ static void stats_update(struct connman_service *service,
 
 	if (stats->valid == TRUE) {
 		data->rx_packets +=
-			rx_packets - data_last->rx_packets;
+			stats_delta(rx_packets, data_last->rx_packets,
+								stats64);
 		data->tx_packets +=
-			tx_packets - data_last->tx_packets;
+			stats_delta(tx_packets, data_last->tx_packets,
+								stats64);
 		data->rx_bytes +=
-			rx_bytes - data_last->rx_bytes;
+			stats_delta(rx_bytes, data_last->rx_bytes,
+								stats64);
 		data->tx_bytes +=
-			tx_bytes - data_last->tx_bytes;
+			stats_delta(tx_bytes, data_last->tx_bytes,
+								stats64);
 		data->rx_errors +=
-			rx_errors - data_last->rx_errors;
+			stats_delta(rx_errors, data_last->rx_errors,
+								stats64);
 		data->tx_errors +=
-			tx_errors - data_last->tx_errors;
+			stats_delta(tx_errors, data_last->tx_errors,
+								stats64);
 		data->rx_dropped +=
-			rx_dropped - data_last->rx_dropped;
+			stats_delta(rx_dropped, data_last->rx_dropped,
+								stats64);
 		data->tx_dropped +=
-			tx_dropped - data_last->tx_dropped;
+			stats_delta(tx_dropped, data_last->tx_dropped,
+								stats64);
 	} else {
 		stats->valid = TRUE;
 	}
@@ -2029,10 +2198,11 @@ static void stats_update(struct connman_service *service,
 }
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_errors, unsigned int tx_errors,
-			unsigned int rx_dropped, unsigned int tx_dropped)
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_errors, uint64_t tx_errors,
+			uint64_t rx_dropped, uint64_t tx_dropped,
+			connman_bool_t stats64)
 {
 	GHashTableIter iter;
 	gpointer key, value;
@@ -2051,7 +2221,7 @@ void __connman_service_notify(struct connman_service *service,
 		rx_packets, tx_packets,
 		rx_bytes, tx_bytes,
 		rx_errors, tx_errors,
-		rx_dropped, tx_dropped);
+		rx_dropped, tx_dropped, stats64);
 
 	data = &stats_get(service)->data;
 	err = __connman_stats_update(service, service->roaming, data);
@@ -2064,6 +2234,11 @@ void __connman_service_notify(struct connman_service *service,
 		counter = key;
 		counters = value;
 
+		if (counters->append_all == FALSE &&
+				stats_threshold_reached(service, counter,
+							counters) == FALSE)
+			continue;
+
 		stats_append(service, counter, counters, counters->append_all);
 		counters->append_all = FALSE;
 	}
@@ -2119,6 +2294,37 @@ void __connman_service_counter_unregister(const char *counter)
 	counter_list = g_slist_remove(counter_list, counter);
 }
 
+int __connman_service_request_stats(void)
+{
+	struct connman_service *service;
+	GSequenceIter *iter;
+	int index;
+
+	if (counter_list == NULL)
+		return 0;
+
+	iter = g_sequence_get_begin_iter(service_list);
+
+	while (g_sequence_iter_is_end(iter) == FALSE) {
+		service = g_sequence_get(iter);
+		iter = g_sequence_iter_next(iter);
+
+		if (g_hash_table_size(service->counter_table) == 0)
+			continue;
+
+		if (is_connected(service) == FALSE)
+			continue;
+
+		index = __connman_service_get_index(service);
+		if (index < 0)
+			continue;
+
+		__connman_rtnl_request_link_update(index);
+	}
+
+	return 0;
+}
+
 GSequence *__connman_service_get_list(struct connman_session *session,
 				service_match_cb service_match,
 				create_service_entry_cb create_service_entry,
@@ -2326,6 +2532,97 @@ void __connman_service_list_struct(DBusMessageIter *iter)
 	g_sequence_foreach(service_list, append_struct, iter);
 }
 
+guint64 __connman_service_get_generation(void)
+{
+	return services_generation;
+}
+
+/*
+ * A generation handed out by an earlier run of the daemon, or one
+ * older than the remembered removals, cannot be used for a delta.
+ */
+connman_bool_t __connman_service_generation_known(guint64 generation)
+{
+	if (generation >> 32 != services_generation >> 32)
+		return FALSE;
+
+	if (generation < removed_floor || generation > services_generation)
+		return FALSE;
+
+	return TRUE;
+}
+
+void __connman_service_list_struct_since(DBusMessageIter *iter,
+							guint64 generation)
+{
+	GSequenceIter *seq;
+	struct connman_service *service;
+
+	seq = g_sequence_get_begin_iter(service_list);
+
+	while (g_sequence_iter_is_end(seq) == FALSE) {
+		service = g_sequence_get(seq);
+
+		if (service->path != NULL && service->generation > generation)
+			append_struct_service(iter, append_dict_properties,
+								service);
+
+		seq = g_sequence_iter_next(seq);
+	}
+}
+
+void __connman_service_list_removed_since(DBusMessageIter *iter,
+							guint64 generation)
+{
+	GList *list;
+
+	for (list = g_queue_peek_tail_link(&removed_services); list != NULL;
+							list = list->prev) {
+		struct removed_service *removed = list->data;
+
+		if (removed->generation <= generation)
+			break;
+
+		/* removed and created again */
+		if (__connman_serviceindex_lookup_path(removed->path) != NULL)
+			continue;
+
+		dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH,
+							&removed->path);
+	}
+}
+
+static void free_removed_service(gpointer data)
+{
+	struct removed_service *removed = data;
+
+	g_free(removed->path);
+	g_free(removed);
+}
+
+static void remember_removed(struct connman_service *service)
+{
+	struct removed_service *removed;
+
+	removed = g_try_new0(struct removed_service, 1);
+	if (removed == NULL) {
+		/* the removal cannot be reported in a delta anymore */
+		removed_floor = ++services_generation;
+		return;
+	}
+
+	removed->path = g_strdup(service->path);
+	removed->generation = ++services_generation;
+
+	g_queue_push_tail(&removed_services, removed);
+
+	if (g_queue_get_length(&removed_services) > REMOVED_HISTORY) {
+		removed = g_queue_pop_head(&removed_services);
+		removed_floor = removed->generation;
+		free_removed_service(removed);
+	}
+}
+
 connman_bool_t __connman_service_is_hidden(struct connman_service *service)
 {
 	return service->hidden;
@@ -3300,6 +3597,7 @@ static void set_idle(struct connman_service *service)
 {
 	service->state = service->state_ipv4 = service->state_ipv6 =
 						CONNMAN_SERVICE_STATE_IDLE;
+	service_sort(service);
 	set_error(service, CONNMAN_SERVICE_ERROR_UNKNOWN);
 	state_changed(service);
 }
@@ -3828,7 +4126,9 @@ gboolean __connman_service_remove(struct connman_service *service)
 
 	__connman_service_set_favorite(service, FALSE);
 
+	/* do not leave the passphrase on disk until the next flush */
 	service_save(service);
+	service_save_flush(service);
 
 	return TRUE;
 }
@@ -3892,6 +4192,7 @@ static void apply_relevant_default_downgrade(struct connman_service *service)
 	if (def_service == service &&
 			def_service->state == CONNMAN_SERVICE_STATE_ONLINE) {
 		def_service->state = CONNMAN_SERVICE_STATE_READY;
+		service_sort(def_service);
 		__connman_notifier_leave_online(def_service->type);
 	}
 }
@@ -3902,8 +4203,8 @@ static void switch_default_service(struct connman_service *default_service,
 	GSequenceIter *src, *dst;
 
 	apply_relevant_default_downgrade(default_service);
-	src = g_hash_table_lookup(service_hash, downgrade_service->identifier);
-	dst = g_hash_table_lookup(service_hash, default_service->identifier);
+	src = __connman_serviceindex_lookup(downgrade_service->identifier);
+	dst = __connman_serviceindex_lookup(default_service->identifier);
 	g_sequence_move(src, dst);
 	downgrade_state(downgrade_service);
 }
@@ -4040,6 +4341,114 @@ static DBusMessage *reset_counters(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static void append_statistics_data(DBusMessageIter *dict, void *user_data)
+{
+	struct connman_stats_data *data = user_data;
+	struct connman_stats_data counters;
+
+	memset(&counters, 0, sizeof(counters));
+
+	stats_append_counters(dict, data, &counters, TRUE);
+}
+
+static DBusMessage *get_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct connman_service *service = user_data;
+	struct connman_stats_data *home, *roaming;
+	DBusMessageIter iter, array, dict;
+	dbus_uint64_t start, end, next, intervals, interval_start;
+	dbus_uint32_t interval;
+	DBusMessage *reply;
+	unsigned int count, i;
+	int err;
+
+	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &start,
+					DBUS_TYPE_UINT64, &end,
+					DBUS_TYPE_UINT32, &interval,
+					DBUS_TYPE_INVALID) == FALSE)
+		return __connman_error_invalid_arguments(msg);
+
+	if (interval == 0 || end < start)
+		return __connman_error_invalid_arguments(msg);
+
+	DBG("service %p start %" G_GUINT64_FORMAT " end %" G_GUINT64_FORMAT
+			" interval %u", service, start, end, interval);
+
+	/*
+	 * Long ranges are returned in chunks, next is where to continue.
+	 * The intervals are counted before adding the one end falls in,
+	 * so a range of the whole uint64 space does not overflow.
+	 */
+	intervals = (end - start) / interval;
+	if (intervals >= STATISTICS_CHUNK) {
+		count = STATISTICS_CHUNK;
+		next = start + (dbus_uint64_t) count * interval;
+	} else {
+		count = intervals + 1;
+		next = 0;
+	}
+
+	home = g_try_new0(struct connman_stats_data, count);
+	roaming = g_try_new0(struct connman_stats_data, count);
+	if (home == NULL || roaming == NULL) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	err = __connman_stats_get_range(service, start, interval, count,
+							home, roaming);
+	if (err < 0)
+		goto err;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	for (i = 0; i < count; i++) {
+		interval_start = start + (dbus_uint64_t) i * interval;
+
+		connman_dbus_dict_open(&array, &dict);
+
+		connman_dbus_dict_append_basic(&dict, "Start",
+					DBUS_TYPE_UINT64, &interval_start);
+		connman_dbus_dict_append_dict(&dict, "Home",
+					append_statistics_data, &home[i]);
+		connman_dbus_dict_append_dict(&dict, "Roaming",
+					append_statistics_data, &roaming[i]);
+
+		connman_dbus_dict_close(&array, &dict);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT64, &next);
+
+	g_free(home);
+	g_free(roaming);
+
+	return reply;
+
+err:
+	g_free(home);
+	g_free(roaming);
+
+	if (err == -EEXIST)
+		return __connman_error_not_supported(msg);
+
+	return __connman_error_failed(msg, -err);
+}
+
 static struct _services_notify {
 	int id;
 	GHashTable *add;
@@ -4109,6 +4518,8 @@ static gboolean service_send_changed(gpointer data)
 
 	dbus_message_iter_close_container(&iter, &array);
 
+	__connman_dbus_flush_property_changes();
+
 	dbus_connection_send(connection, signal, NULL);
 	dbus_message_unref(signal);
 
@@ -4130,6 +4541,8 @@ static void service_schedule_added(struct connman_service *service)
 {
 	DBG("service %p", service);
 
+	service->generation = ++services_generation;
+
 	g_hash_table_remove(services_notify->remove, service->path);
 	g_hash_table_replace(services_notify->add, service->path, service);
 
@@ -4149,11 +4562,16 @@ static void service_schedule_removed(struct connman_service *service)
 	g_hash_table_replace(services_notify->remove, g_strdup(service->path),
 			NULL);
 
+	remember_removed(service);
+
 	service_schedule_changed();
 }
 
 static connman_bool_t allow_property_changed(struct connman_service *service)
 {
+	/* every property change passes here */
+	service->generation = ++services_generation;
+
 	if (g_hash_table_lookup_extended(services_notify->add, service->path,
 					NULL, NULL) == TRUE) {
 		DBG("no property updates for service %p", service);
@@ -4185,12 +4603,20 @@ static const GDBusMethodTable service_methods[] = {
 			GDBUS_ARGS({ "service", "o" }), NULL,
 			move_after) },
 	{ GDBUS_METHOD("ResetCounters", NULL, NULL, reset_counters) },
+	{ GDBUS_METHOD("GetStatistics",
+			GDBUS_ARGS({ "start", "t" }, { "end", "t" },
+					{ "interval", "u" }),
+			GDBUS_ARGS({ "statistics", "aa{sv}" },
+					{ "next", "t" }),
+			get_statistics) },
 	{ },
 };
 
 static const GDBusSignalTable service_signals[] = {
 	{ GDBUS_SIGNAL("PropertyChanged",
 			GDBUS_ARGS({ "name", "s" }, { "value", "v" })) },
+	{ GDBUS_SIGNAL("PropertiesChanged",
+			GDBUS_ARGS({ "properties", "a{sv}" })) },
 	{ },
 };
 
@@ -4203,7 +4629,9 @@ static void service_free(gpointer user_data)
 
 	reply_pending(service, ENOENT);
 
-	g_hash_table_remove(service_hash, service->identifier);
+	service_save_flush(service);
+
+	__connman_serviceindex_remove(service->identifier);
 
 	__connman_notifier_service_remove(service);
 	service_schedule_removed(service);
@@ -4407,7 +4835,7 @@ void connman_service_unref_debug(struct connman_service *service,
 	if (__sync_fetch_and_sub(&service->refcount, 1) != 1)
 		return;
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
+	iter = __connman_serviceindex_lookup(service->identifier);
 	if (iter != NULL) {
 		reply_pending(service, ECONNABORTED);
 
@@ -4419,70 +4847,130 @@ void connman_service_unref_debug(struct connman_service *service,
 	}
 }
 
+static unsigned int state_rank(struct connman_service *service)
+{
+	/* We prefer online over ready state */
+	if (service->state == CONNMAN_SERVICE_STATE_ONLINE)
+		return 3;
+
+	if (is_connected(service) == TRUE)
+		return 2;
+
+	if (is_connecting(service) == TRUE)
+		return 1;
+
+	return 0;
+}
+
+static unsigned int type_rank(enum connman_service_type type)
+{
+	switch (type) {
+	case CONNMAN_SERVICE_TYPE_UNKNOWN:
+	case CONNMAN_SERVICE_TYPE_SYSTEM:
+	case CONNMAN_SERVICE_TYPE_ETHERNET:
+	case CONNMAN_SERVICE_TYPE_GPS:
+	case CONNMAN_SERVICE_TYPE_VPN:
+	case CONNMAN_SERVICE_TYPE_GADGET:
+		break;
+	case CONNMAN_SERVICE_TYPE_WIFI:
+		return 0;
+	case CONNMAN_SERVICE_TYPE_BLUETOOTH:
+	case CONNMAN_SERVICE_TYPE_CELLULAR:
+		return 2;
+	}
+
+	return 1;
+}
+
+/*
+ * The sort key packs everything the list is ordered by, from the most
+ * to the least significant: state, order, favorite, type and strength.
+ * Services with a higher key come first. The strength only counts once
+ * it moved by SORT_STRENGTH_HYSTERESIS, so a fluctuating signal does
+ * not reorder the list on every scan.
+ */
+static guint64 service_sort_key(struct connman_service *service)
+{
+	if (abs((int) service->strength - (int) service->sort_strength) >=
+						SORT_STRENGTH_HYSTERESIS)
+		service->sort_strength = service->strength;
+
+	return (guint64) state_rank(service) << 56 |
+		(guint64) (service->order & 0xffffffff) << 24 |
+		(guint64) (service->favorite == TRUE) << 16 |
+		(guint64) type_rank(service->type) << 8 |
+		service->sort_strength;
+}
+
 static gint service_compare(gconstpointer a, gconstpointer b,
 							gpointer user_data)
 {
 	struct connman_service *service_a = (void *) a;
 	struct connman_service *service_b = (void *) b;
-	enum connman_service_state state_a, state_b;
 
-	state_a = service_a->state;
-	state_b = service_b->state;
+	if (service_a->sort_key > service_b->sort_key)
+		return -1;
 
-	if (state_a != state_b) {
-		gboolean a_connected = is_connected(service_a);
-		gboolean b_connected = is_connected(service_b);
+	if (service_a->sort_key < service_b->sort_key)
+		return 1;
 
-		if (a_connected == TRUE && b_connected == TRUE) {
-			/* We prefer online over ready state */
-			if (state_a == CONNMAN_SERVICE_STATE_ONLINE)
-				return -1;
+	return 0;
+}
 
-			if (state_b == CONNMAN_SERVICE_STATE_ONLINE)
-				return 1;
-		}
+/*
+ * Moves the service to its place in the list. Nothing is done unless
+ * its sort key changed, so updates which do not affect the ordering
+ * neither reorder the list nor send ServicesChanged. Call it whenever
+ * the state, order, favorite or type of a listed service changes, or
+ * the cached key gets out of date and breaks the sorted inserts.
+ */
+static void service_sort(struct connman_service *service)
+{
+	GSequenceIter *iter;
+	guint64 key;
+	gint position;
 
-		if (a_connected == TRUE)
-			return -1;
-		if (b_connected == TRUE)
-			return 1;
+	key = service_sort_key(service);
+	if (key == service->sort_key)
+		return;
 
-		if (is_connecting(service_a) == TRUE)
-			return -1;
-		if (is_connecting(service_b) == TRUE)
-			return 1;
+	service->sort_key = key;
+
+	iter = __connman_serviceindex_lookup(service->identifier);
+	if (iter != NULL && g_sequence_get_length(service_list) > 1) {
+		position = g_sequence_iter_get_position(iter);
+
+		g_sequence_sort_changed(iter, service_compare, NULL);
+
+		/* a moved service shows up in GetServicesSince */
+		if (g_sequence_iter_get_position(iter) != position)
+			service->generation = ++services_generation;
+
+		service_schedule_changed();
 	}
+}
 
-	if (service_a->order > service_b->order)
-		return -1;
+static void update_sort_key(gpointer data, gpointer user_data)
+{
+	struct connman_service *service = data;
+	guint64 key;
 
-	if (service_a->order < service_b->order)
-		return 1;
+	key = service_sort_key(service);
+	if (key == service->sort_key)
+		return;
 
-	if (service_a->favorite == TRUE && service_b->favorite == FALSE)
-		return -1;
+	service->sort_key = key;
+	service->generation = ++services_generation;
+}
 
-	if (service_a->favorite == FALSE && service_b->favorite == TRUE)
-		return 1;
+static void service_sort_all(void)
+{
+	g_sequence_foreach(service_list, update_sort_key, NULL);
 
-	if (service_a->type != service_b->type) {
-		switch (service_a->type) {
-		case CONNMAN_SERVICE_TYPE_UNKNOWN:
-		case CONNMAN_SERVICE_TYPE_SYSTEM:
-		case CONNMAN_SERVICE_TYPE_ETHERNET:
-		case CONNMAN_SERVICE_TYPE_GPS:
-		case CONNMAN_SERVICE_TYPE_VPN:
-		case CONNMAN_SERVICE_TYPE_GADGET:
-			break;
-		case CONNMAN_SERVICE_TYPE_WIFI:
-			return 1;
-		case CONNMAN_SERVICE_TYPE_BLUETOOTH:
-		case CONNMAN_SERVICE_TYPE_CELLULAR:
-			return -1;
-		}
+	if (g_sequence_get_length(service_list) > 1) {
+		g_sequence_sort(service_list, service_compare, NULL);
+		service_schedule_changed();
 	}
-
-	return (gint) service_b->strength - (gint) service_a->strength;
 }
 
 /**
@@ -4640,7 +5128,7 @@ int __connman_service_set_favorite_delayed(struct connman_service *service,
 
 	if (service->hidden == TRUE)
 		return -EOPNOTSUPP;
-	iter = g_hash_table_lookup(service_hash, service->identifier);
+	iter = __connman_serviceindex_lookup(service->identifier);
 	if (iter == NULL)
 		return -ENOENT;
 
@@ -4650,16 +5138,12 @@ int __connman_service_set_favorite_delayed(struct connman_service *service,
 	service->favorite = favorite;
 
 	if (delay_ordering == FALSE)
-		service->order = __connman_service_get_order(service);
+		__connman_service_update_order(service);
 
 	favorite_changed(service);
 
 	if (delay_ordering == FALSE) {
-
-		if (g_sequence_get_length(service_list) > 1) {
-			g_sequence_sort_changed(iter, service_compare, NULL);
-			service_schedule_changed();
-		}
+		service_sort(service);
 
 		__connman_connection_update_gateway();
 	}
@@ -4759,6 +5243,7 @@ static void report_error_cb(void *user_context, gboolean retry,
 		/* It is not relevant to stay on Failure state
 		 * when failing is due to wrong user input */
 		service->state = CONNMAN_SERVICE_STATE_IDLE;
+		service_sort(service);
 
 		service_complete(service);
 		__connman_connection_update_gateway();
@@ -4901,6 +5386,7 @@ static void request_input_cb (struct connman_service *service,
 		/* It is not relevant to stay on Failure state
 		 * when failing is due to wrong user input */
 		service->state = CONNMAN_SERVICE_STATE_IDLE;
+		service_sort(service);
 
 		if (service->hidden == FALSE) {
 			/*
@@ -5005,7 +5491,6 @@ static int service_indicate_state(struct connman_service *service)
 	enum connman_service_state old_state, new_state;
 	struct connman_service *def_service;
 	int result;
-	GSequenceIter *iter;
 
 	if (service == NULL)
 		return -EINVAL;
@@ -5166,11 +5651,7 @@ static int service_indicate_state(struct connman_service *service)
 	} else
 		set_error(service, CONNMAN_SERVICE_ERROR_UNKNOWN);
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
-	if (iter != NULL && g_sequence_get_length(service_list) > 1) {
-		g_sequence_sort_changed(iter, service_compare, NULL);
-		service_schedule_changed();
-	}
+	service_sort(service);
 
 	__connman_connection_update_gateway();
 
@@ -5817,7 +6298,7 @@ static struct connman_service *lookup_by_identifier(const char *identifier)
 {
 	GSequenceIter *iter;
 
-	iter = g_hash_table_lookup(service_hash, identifier);
+	iter = __connman_serviceindex_lookup(identifier);
 	if (iter != NULL)
 		return g_sequence_get(iter);
 
@@ -5858,10 +6339,7 @@ int __connman_service_provision_changed(const char *ident)
 	if (services_dirty == TRUE) {
 		services_dirty = FALSE;
 
-		if (g_sequence_get_length(service_list) > 1) {
-			g_sequence_sort(service_list, service_compare, NULL);
-			service_schedule_changed();
-		}
+		service_sort_all();
 
 		__connman_connection_update_gateway();
 	}
@@ -5893,7 +6371,7 @@ static struct connman_service *service_get(const char *identifier)
 	struct connman_service *service;
 	GSequenceIter *iter;
 
-	iter = g_hash_table_lookup(service_hash, identifier);
+	iter = __connman_serviceindex_lookup(identifier);
 	if (iter != NULL) {
 		service = g_sequence_get(iter);
 		if (service != NULL)
@@ -5908,19 +6386,18 @@ static struct connman_service *service_get(const char *identifier)
 	DBG("service %p", service);
 
 	service->identifier = g_strdup(identifier);
+	service->sort_key = service_sort_key(service);
 
 	iter = g_sequence_insert_sorted(service_list, service,
 						service_compare, NULL);
 
-	g_hash_table_insert(service_hash, service->identifier, iter);
+	__connman_serviceindex_add(service->identifier, iter);
 
 	return service;
 }
 
 static int service_register(struct connman_service *service)
 {
-	GSequenceIter *iter;
-
 	DBG("service %p", service);
 
 	if (service->path != NULL)
@@ -5928,6 +6405,7 @@ static int service_register(struct connman_service *service)
 
 	service->path = g_strdup_printf("%s/service/%s", CONNMAN_PATH,
 						service->identifier);
+	__connman_serviceindex_set_path(service->identifier, service->path);
 
 	DBG("path %s", service->path);
 
@@ -5940,11 +6418,7 @@ static int service_register(struct connman_service *service)
 					service_methods, service_signals,
 							NULL, service, NULL);
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
-	if (iter != NULL && g_sequence_get_length(service_list) > 1) {
-		g_sequence_sort_changed(iter, service_compare, NULL);
-		service_schedule_changed();
-	}
+	service_sort(service);
 
 	__connman_connection_update_gateway();
 
@@ -6108,6 +6582,8 @@ void __connman_service_read_ip4config(struct connman_service *service)
 	if (service->ipconfig_ipv4 == NULL)
 		return;
 
+	service_save_flush(service);
+
 	keyfile = connman_storage_load_service(service->identifier);
 	if (keyfile == NULL)
 		return;
@@ -6138,6 +6614,8 @@ void __connman_service_read_ip6config(struct connman_service *service)
 	if (service->ipconfig_ipv6 == NULL)
 		return;
 
+	service_save_flush(service);
+
 	keyfile = connman_storage_load_service(service->identifier);
 	if (keyfile == NULL)
 		return;
@@ -6170,6 +6648,7 @@ void connman_service_create_ip6config(struct connman_service *service,
 struct connman_service *connman_service_lookup_from_network(struct connman_network *network)
 {
 	struct connman_service *service;
+	GSequenceIter *iter;
 	const char *ident, *group;
 	char *name;
 
@@ -6178,6 +6657,12 @@ struct connman_service *connman_service_lookup_from_network(struct connman_netwo
 	if (network == NULL)
 		return NULL;
 
+	iter = __connman_serviceindex_lookup_network(network);
+	if (iter != NULL)
+		return g_sequence_get(iter);
+
+	/* the network did not create a service (yet) */
+
 	ident = __connman_network_get_ident(network);
 	if (ident == NULL)
 		return NULL;
@@ -6236,40 +6721,55 @@ const char *__connman_service_get_path(struct connman_service *service)
 unsigned int __connman_service_get_order(struct connman_service *service)
 {
 	GSequenceIter *iter;
+	unsigned int order;
 
 	if (service == NULL)
 		return 0;
 
-	if (service->favorite == FALSE) {
-		service->order = 0;
-		goto done;
-	}
+	if (service->favorite == FALSE)
+		return 0;
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
-	if (iter != NULL) {
-		if (g_sequence_iter_get_position(iter) == 0)
-			service->order = 1;
-		else if (service->type == CONNMAN_SERVICE_TYPE_VPN &&
-				service->do_split_routing == FALSE)
-			service->order = 10;
-		else
-			service->order = 0;
-	}
+	iter = __connman_serviceindex_lookup(service->identifier);
+	if (iter == NULL)
+		return service->order;
+
+	if (g_sequence_iter_get_position(iter) == 0)
+		order = 1;
+	else if (service->type == CONNMAN_SERVICE_TYPE_VPN &&
+			service->do_split_routing == FALSE)
+		order = 10;
+	else
+		order = 0;
 
 	DBG("service %p name %s order %d split %d", service, service->name,
-		service->order, service->do_split_routing);
+		order, service->do_split_routing);
 
-done:
-	return service->order;
+	return order;
 }
 
-void __connman_service_update_ordering(void)
+/*
+ * Stores the current order of the service and moves it in the list
+ * if that changed its place.
+ */
+unsigned int __connman_service_update_order(struct connman_service *service)
 {
-	GSequenceIter *iter;
+	unsigned int order;
 
-	iter = g_sequence_get_begin_iter(service_list);
-	if (iter != NULL && g_sequence_get_length(service_list) > 1)
-		g_sequence_sort_changed(iter, service_compare, NULL);
+	if (service == NULL)
+		return 0;
+
+	order = __connman_service_get_order(service);
+	if (order != service->order) {
+		service->order = order;
+		service_sort(service);
+	}
+
+	return order;
+}
+
+void __connman_service_update_ordering(void)
+{
+	service_sort_all();
 }
 
 static enum connman_service_type convert_network_type(struct connman_network *network)
@@ -6318,7 +6818,6 @@ static void update_from_network(struct connman_service *service,
 					struct connman_network *network)
 {
 	connman_uint8_t strength = service->strength;
-	GSequenceIter *iter;
 	const char *str;
 
 	DBG("service %p network %p", service, network);
@@ -6367,11 +6866,7 @@ static void update_from_network(struct connman_service *service,
 	if (service->network == NULL)
 		service->network = connman_network_ref(network);
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
-	if (iter != NULL && g_sequence_get_length(service_list) > 1) {
-		g_sequence_sort_changed(iter, service_compare, NULL);
-		service_schedule_changed();
-	}
+	service_sort(service);
 }
 
 /**
@@ -6410,6 +6905,8 @@ struct connman_service * __connman_service_create_from_network(struct connman_ne
 	if (service == NULL)
 		return NULL;
 
+	__connman_serviceindex_add_network(service->identifier, network);
+
 	if (__connman_network_get_weakness(network) == TRUE)
 		return service;
 
@@ -6480,7 +6977,6 @@ void __connman_service_update_from_network(struct connman_network *network)
 	struct connman_service *service;
 	connman_uint8_t strength;
 	connman_bool_t roaming;
-	GSequenceIter *iter;
 	const char *name;
 	connman_bool_t stats_enable;
 
@@ -6534,13 +7030,8 @@ roaming:
 	roaming_changed(service);
 
 sorting:
-	if (need_sort == TRUE) {
-		iter = g_hash_table_lookup(service_hash, service->identifier);
-		if (iter != NULL && g_sequence_get_length(service_list) > 1) {
-			g_sequence_sort_changed(iter, service_compare, NULL);
-			service_schedule_changed();
-		}
-	}
+	if (need_sort == TRUE)
+		service_sort(service);
 }
 
 void __connman_service_remove_from_network(struct connman_network *network)
@@ -6553,6 +7044,8 @@ void __connman_service_remove_from_network(struct connman_network *network)
 	if (service == NULL)
 		return;
 
+	__connman_serviceindex_remove_network(network);
+
 	service->ignore = TRUE;
 
 	__connman_connection_gateway_remove(service,
@@ -6733,8 +7226,7 @@ int __connman_service_init(void)
 
 	connection = connman_dbus_get_connection();
 
-	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
-								NULL, NULL);
+	__connman_serviceindex_init();
 
 	service_list = g_sequence_new(service_free);
 
@@ -6743,6 +7235,10 @@ int __connman_service_init(void)
 			g_str_equal, g_free, NULL);
 	services_notify->add = g_hash_table_new(g_str_hash, g_str_equal);
 
+	/* a new run id, the clock may go backwards between runs */
+	services_generation = (guint64) (g_random_int() | 1) << 32;
+	removed_floor = services_generation;
+
 	remove_unprovisioned_services();
 
 	return 0;
@@ -6759,12 +7255,16 @@ void __connman_service_cleanup(void)
 		autoconnect_timeout = 0;
 	}
 
+	service_save_flush_all();
+
 	list = service_list;
 	service_list = NULL;
 	g_sequence_free(list);
 
-	g_hash_table_destroy(service_hash);
-	service_hash = NULL;
+	while (g_queue_is_empty(&removed_services) == FALSE)
+		free_removed_service(g_queue_pop_head(&removed_services));
+
+	__connman_serviceindex_cleanup();
 
 	g_slist_free(counter_list);
 	counter_list = NULL;
@@ -0,0 +1,297 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+
+#include <glib.h>
+
+#include "connman.h"
+
+/*
+ * Maps the identifier, the object path and the networks of a service
+ * to the data the service list keeps for it. All three tables share
+ * the same entries, which are owned by the identifier table.
+ */
+struct index_entry {
+	char *identifier;
+	char *path;
+	gpointer data;
+	GSList *networks;
+};
+
+static GHashTable *identifier_table = NULL;
+static GHashTable *path_table = NULL;
+static GHashTable *network_table = NULL;
+
+static void free_entry(gpointer user_data)
+{
+	struct index_entry *entry = user_data;
+	GSList *list;
+
+	if (entry->path != NULL)
+		g_hash_table_remove(path_table, entry->path);
+
+	for (list = entry->networks; list != NULL; list = list->next)
+		g_hash_table_remove(network_table, list->data);
+
+	g_slist_free(entry->networks);
+	g_free(entry->identifier);
+	g_free(entry->path);
+	g_free(entry);
+}
+
+int __connman_serviceindex_add(const char *identifier, gpointer data)
+{
+	struct index_entry *entry;
+
+	if (identifier == NULL || data == NULL)
+		return -EINVAL;
+
+	if (g_hash_table_lookup(identifier_table, identifier) != NULL)
+		return -EEXIST;
+
+	entry = g_try_new0(struct index_entry, 1);
+	if (entry == NULL)
+		return -ENOMEM;
+
+	entry->identifier = g_strdup(identifier);
+	entry->data = data;
+
+	g_hash_table_replace(identifier_table, entry->identifier, entry);
+
+	return 0;
+}
+
+void __connman_serviceindex_remove(const char *identifier)
+{
+	if (identifier == NULL)
+		return;
+
+	g_hash_table_remove(identifier_table, identifier);
+}
+
+gpointer __connman_serviceindex_lookup(const char *identifier)
+{
+	struct index_entry *entry;
+
+	if (identifier == NULL)
+		return NULL;
+
+	entry = g_hash_table_lookup(identifier_table, identifier);
+	if (entry == NULL)
+		return NULL;
+
+	return entry->data;
+}
+
+int __connman_serviceindex_set_path(const char *identifier, const char *path)
+{
+	struct index_entry *entry;
+
+	entry = g_hash_table_lookup(identifier_table, identifier);
+	if (entry == NULL)
+		return -ENOENT;
+
+	if (path != NULL && g_hash_table_lookup(path_table, path) != NULL)
+		return -EEXIST;
+
+	if (entry->path != NULL) {
+		g_hash_table_remove(path_table, entry->path);
+		g_free(entry->path);
+		entry->path = NULL;
+	}
+
+	if (path == NULL)
+		return 0;
+
+	entry->path = g_strdup(path);
+	g_hash_table_replace(path_table, entry->path, entry);
+
+	return 0;
+}
+
+gpointer __connman_serviceindex_lookup_path(const char *path)
+{
+	struct index_entry *entry;
+
+	if (path == NULL)
+		return NULL;
+
+	entry = g_hash_table_lookup(path_table, path);
+	if (entry == NULL)
+		return NULL;
+
+	return entry->data;
+}
+
+int __connman_serviceindex_add_network(const char *identifier,
+							gpointer network)
+{
+	struct index_entry *entry;
+
+	if (network == NULL)
+		return -EINVAL;
+
+	entry = g_hash_table_lookup(identifier_table, identifier);
+	if (entry == NULL)
+		return -ENOENT;
+
+	if (g_hash_table_lookup(network_table, network) != NULL)
+		return -EEXIST;
+
+	entry->networks = g_slist_prepend(entry->networks, network);
+	g_hash_table_replace(network_table, network, entry);
+
+	return 0;
+}
+
+void __connman_serviceindex_remove_network(gpointer network)
+{
+	struct index_entry *entry;
+
+	entry = g_hash_table_lookup(network_table, network);
+	if (entry == NULL)
+		return;
+
+	entry->networks = g_slist_remove(entry->networks, network);
+	g_hash_table_remove(network_table, network);
+}
+
+gpointer __connman_serviceindex_lookup_network(gpointer network)
+{
+	struct index_entry *entry;
+
+	if (network == NULL)
+		return NULL;
+
+	entry = g_hash_table_lookup(network_table, network);
+	if (entry == NULL)
+		return NULL;
+
+	return entry->data;
+}
+
+unsigned int __connman_serviceindex_size(void)
+{
+	return g_hash_table_size(identifier_table);
+}
+
+static gboolean check_path(gpointer key, gpointer value, gpointer user_data)
+{
+	struct index_entry *entry = value;
+
+	if (g_hash_table_lookup(identifier_table, entry->identifier) != entry)
+		return TRUE;
+
+	return g_strcmp0(entry->path, key) != 0;
+}
+
+static gboolean check_network(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct index_entry *entry = value;
+
+	if (g_hash_table_lookup(identifier_table, entry->identifier) != entry)
+		return TRUE;
+
+	return g_slist_find(entry->networks, key) == NULL;
+}
+
+static gboolean check_entry(gpointer key, gpointer value, gpointer user_data)
+{
+	struct index_entry *entry = value;
+	unsigned int *count = user_data;
+	GSList *list;
+
+	if (g_strcmp0(entry->identifier, key) != 0 || entry->data == NULL)
+		return TRUE;
+
+	if (entry->path != NULL) {
+		if (g_hash_table_lookup(path_table, entry->path) != entry)
+			return TRUE;
+
+		count[0]++;
+	}
+
+	for (list = entry->networks; list != NULL; list = list->next) {
+		if (g_hash_table_lookup(network_table, list->data) != entry)
+			return TRUE;
+
+		count[1]++;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Verifies that every path and network maps to exactly the entry of
+ * its service and that no table holds an entry the others do not
+ * know about.
+ */
+connman_bool_t __connman_serviceindex_check(void)
+{
+	unsigned int count[2] = { 0, 0 };
+
+	if (g_hash_table_find(identifier_table, check_entry, count) != NULL)
+		return FALSE;
+
+	if (g_hash_table_find(path_table, check_path, NULL) != NULL)
+		return FALSE;
+
+	if (g_hash_table_find(network_table, check_network, NULL) != NULL)
+		return FALSE;
+
+	if (count[0] != g_hash_table_size(path_table) ||
+			count[1] != g_hash_table_size(network_table))
+		return FALSE;
+
+	return TRUE;
+}
+
+int __connman_serviceindex_init(void)
+{
+	DBG("");
+
+	path_table = g_hash_table_new(g_str_hash, g_str_equal);
+	network_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	identifier_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, free_entry);
+
+	return 0;
+}
+
+void __connman_serviceindex_cleanup(void)
+{
+	DBG("");
+
+	g_hash_table_destroy(identifier_table);
+	identifier_table = NULL;
+
+	g_hash_table_destroy(path_table);
+	path_table = NULL;
+
+	g_hash_table_destroy(network_table);
+	network_table = NULL;
+}
@@ -32,11 +32,21 @@
 
 #include "connman.h"
 
+#define SESSION_MARK_CHAIN	"connman-SESSION-MARK"
+#define SESSION_ACCT_IN_CHAIN	"connman-ACCT-IN"
+#define SESSION_ACCT_OUT_CHAIN	"connman-ACCT-OUT"
+/* fwmark bits reserved for the accounting, other users keep the rest */
+#define SESSION_MARK_MASK	0x00ff0000
+#define SESSION_MARK_SHIFT	16
+#define SESSION_ACCT_INTERVAL	10
+
 static DBusConnection *connection;
 static GHashTable *session_hash;
 static connman_bool_t sessionmode;
 static struct connman_session *ecall_session;
 static GSList *policy_list;
+static GSList *acct_list;
+static guint acct_timer;
 
 enum connman_session_trigger {
 	CONNMAN_SESSION_TRIGGER_UNKNOWN		= 0,
@@ -77,6 +87,30 @@ struct session_info {
 	enum connman_session_reason reason;
 };
 
+struct session_counters {
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+};
+
+/*
+ * Per user traffic accounting. The packets of the session owners are
+ * marked in the mangle table, the connection mark carries the mark
+ * over to the incoming packets. Only the SESSION_MARK_MASK bits of the
+ * marks are touched. One RETURN rule per user and direction
+ * counts the marked packets. The rules of the accounting chains are in
+ * the order of acct_list.
+ */
+struct session_acct {
+	unsigned int uid;
+	unsigned int mark;
+	int refcount;
+	/* values before the table was last replaced */
+	struct session_counters base;
+	struct session_counters counters;
+};
+
 struct connman_session {
 	char *owner;
 	char *session_path;
@@ -95,6 +129,9 @@ struct connman_session {
 
 	GSequence *service_list;
 	GHashTable *service_hash;
+
+	struct session_acct *acct;
+	struct session_counters counters_last;
 };
 
 static const char *trigger2string(enum connman_session_trigger trigger)
@@ -242,6 +279,8 @@ static void destroy_policy_config(struct connman_session *session)
 	(*session->policy->destroy)(session);
 }
 
+static void acct_put(struct session_acct *acct);
+
 static void free_session(struct connman_session *session)
 {
 	if (session == NULL)
@@ -250,6 +289,8 @@ static void free_session(struct connman_session *session)
 	if (session->notify_watch > 0)
 		g_dbus_remove_watch(connection, session->notify_watch);
 
+	acct_put(session->acct);
+
 	destroy_policy_config(session);
 	g_slist_free(session->info->config.allowed_bearers);
 	g_free(session->owner);
@@ -624,6 +665,20 @@ static void append_ipconfig_ipv6(DBusMessageIter *iter, void *user_data)
 	__connman_ipconfig_append_ipv6(ipconfig_ipv6, iter, ipconfig_ipv4);
 }
 
+static void append_counters(DBusMessageIter *dict, void *user_data)
+{
+	struct session_counters *counters = user_data;
+
+	connman_dbus_dict_append_basic(dict, "RX.Packets",
+				DBUS_TYPE_UINT64, &counters->rx_packets);
+	connman_dbus_dict_append_basic(dict, "TX.Packets",
+				DBUS_TYPE_UINT64, &counters->tx_packets);
+	connman_dbus_dict_append_basic(dict, "RX.Bytes",
+				DBUS_TYPE_UINT64, &counters->rx_bytes);
+	connman_dbus_dict_append_basic(dict, "TX.Bytes",
+				DBUS_TYPE_UINT64, &counters->tx_bytes);
+}
+
 static void append_notify(DBusMessageIter *dict,
 					struct connman_session *session)
 {
@@ -698,6 +753,17 @@ static void append_notify(DBusMessageIter *dict,
 		info_last->config.allowed_bearers = info->config.allowed_bearers;
 	}
 
+	if (session->acct != NULL && (session->append_all == TRUE ||
+			memcmp(&session->acct->counters,
+				&session->counters_last,
+				sizeof(struct session_counters)) != 0)) {
+		connman_dbus_dict_append_dict(dict, "Counters",
+						append_counters,
+						&session->acct->counters);
+		memcpy(&session->counters_last, &session->acct->counters,
+				sizeof(struct session_counters));
+	}
+
 	session->append_all = FALSE;
 }
 
@@ -744,6 +810,11 @@ static connman_bool_t compute_notifiable_changes(struct connman_session *session
 			info->config.type != info_last->config.type)
 		return TRUE;
 
+	if (session->acct != NULL && memcmp(&session->acct->counters,
+				&session->counters_last,
+				sizeof(struct session_counters)) != 0)
+		return TRUE;
+
 	return FALSE;
 }
 
@@ -777,6 +848,332 @@ static gboolean session_notify(gpointer user_data)
 	return FALSE;
 }
 
+static void acct_hooks(const char *op)
+{
+	__connman_iptables_command("-t mangle %s OUTPUT -j "
+					SESSION_MARK_CHAIN, op);
+	__connman_iptables_command("-t mangle %s OUTPUT "
+				"-m mark ! --mark 0/0x%x "
+				"-j CONNMARK --save-mark "
+				"--nfmask 0x%x --ctmask 0x%x", op,
+				SESSION_MARK_MASK, SESSION_MARK_MASK,
+				SESSION_MARK_MASK);
+	__connman_iptables_command("-t mangle %s PREROUTING "
+				"-m connmark ! --mark 0/0x%x "
+				"-j CONNMARK --restore-mark "
+				"--nfmask 0x%x --ctmask 0x%x", op,
+				SESSION_MARK_MASK, SESSION_MARK_MASK,
+				SESSION_MARK_MASK);
+	__connman_iptables_command("-t mangle %s INPUT -j "
+					SESSION_ACCT_IN_CHAIN, op);
+	__connman_iptables_command("-t mangle %s POSTROUTING -j "
+					SESSION_ACCT_OUT_CHAIN, op);
+}
+
+static void acct_chains_remove(void)
+{
+	acct_hooks("-D");
+
+	__connman_iptables_command("-t mangle -F " SESSION_MARK_CHAIN);
+	__connman_iptables_command("-t mangle -X " SESSION_MARK_CHAIN);
+	__connman_iptables_command("-t mangle -F " SESSION_ACCT_IN_CHAIN);
+	__connman_iptables_command("-t mangle -X " SESSION_ACCT_IN_CHAIN);
+	__connman_iptables_command("-t mangle -F " SESSION_ACCT_OUT_CHAIN);
+	__connman_iptables_command("-t mangle -X " SESSION_ACCT_OUT_CHAIN);
+}
+
+static int acct_chains_add(void)
+{
+	int err;
+
+	/* left over from a previous run */
+	acct_chains_remove();
+
+	err = __connman_iptables_command("-t mangle -N " SESSION_MARK_CHAIN);
+	if (err < 0)
+		return err;
+
+	err = __connman_iptables_command("-t mangle -N "
+						SESSION_ACCT_IN_CHAIN);
+	if (err < 0)
+		return err;
+
+	err = __connman_iptables_command("-t mangle -N "
+						SESSION_ACCT_OUT_CHAIN);
+	if (err < 0)
+		return err;
+
+	acct_hooks("-A");
+
+	return 0;
+}
+
+static void acct_rules(struct session_acct *acct, const char *op)
+{
+	__connman_iptables_command("-t mangle %s " SESSION_MARK_CHAIN
+				" -m owner --uid-owner %u"
+				" -j MARK --set-xmark 0x%x/0x%x",
+				op, acct->uid, acct->mark, SESSION_MARK_MASK);
+	__connman_iptables_command("-t mangle %s " SESSION_ACCT_IN_CHAIN
+				" -m mark --mark 0x%x/0x%x -j RETURN",
+				op, acct->mark, SESSION_MARK_MASK);
+	__connman_iptables_command("-t mangle %s " SESSION_ACCT_OUT_CHAIN
+				" -m mark --mark 0x%x/0x%x -j RETURN",
+				op, acct->mark, SESSION_MARK_MASK);
+}
+
+/*
+ * The rules of a chain are reported in the order of acct_list, so the
+ * list is walked along with them instead of looking up every index.
+ */
+struct acct_read_data {
+	const char *chain_name;
+	unsigned int index;
+	GSList *list;
+};
+
+static void acct_counters_cb(const char *chain_name, unsigned int index,
+				uint64_t packets, uint64_t bytes,
+				void *user_data)
+{
+	struct acct_read_data *data = user_data;
+	struct session_acct *acct;
+
+	if (g_strcmp0(data->chain_name, chain_name) != 0 ||
+						index < data->index) {
+		data->chain_name = chain_name;
+		data->index = 0;
+		data->list = acct_list;
+	}
+
+	for (; data->index < index && data->list != NULL; data->index++)
+		data->list = data->list->next;
+
+	if (data->list == NULL)
+		return;
+
+	acct = data->list->data;
+
+	if (g_strcmp0(chain_name, SESSION_ACCT_IN_CHAIN) == 0) {
+		acct->counters.rx_packets = acct->base.rx_packets + packets;
+		acct->counters.rx_bytes = acct->base.rx_bytes + bytes;
+	} else if (g_strcmp0(chain_name, SESSION_ACCT_OUT_CHAIN) == 0) {
+		acct->counters.tx_packets = acct->base.tx_packets + packets;
+		acct->counters.tx_bytes = acct->base.tx_bytes + bytes;
+	}
+}
+
+static void acct_read(void)
+{
+	struct acct_read_data data = { NULL, 0, NULL };
+	int err;
+
+	if (acct_list == NULL)
+		return;
+
+	err = __connman_iptables_get_counters("mangle", acct_counters_cb,
+									&data);
+	if (err < 0)
+		DBG("reading counters failed %s", strerror(-err));
+}
+
+/*
+ * Replacing the table resets the rule counters, the current values
+ * become the base of the new rules. The old bases are restored when
+ * the table could not be replaced.
+ */
+static int acct_commit(void)
+{
+	struct session_counters *saved;
+	struct session_acct *acct;
+	GSList *list;
+	int i, err;
+
+	saved = g_try_new(struct session_counters, g_slist_length(acct_list));
+	if (saved == NULL && acct_list != NULL)
+		return -ENOMEM;
+
+	for (list = acct_list, i = 0; list != NULL; list = list->next, i++) {
+		acct = list->data;
+
+		memcpy(&saved[i], &acct->base, sizeof(struct session_counters));
+		memcpy(&acct->base, &acct->counters,
+				sizeof(struct session_counters));
+	}
+
+	err = __connman_iptables_commit("mangle");
+	if (err < 0) {
+		for (list = acct_list, i = 0; list != NULL;
+						list = list->next, i++) {
+			acct = list->data;
+
+			memcpy(&acct->base, &saved[i],
+					sizeof(struct session_counters));
+		}
+	}
+
+	g_free(saved);
+
+	return err;
+}
+
+static void acct_notify(gpointer key, gpointer value, gpointer user_data)
+{
+	struct connman_session *session = value;
+
+	if (session->acct == NULL)
+		return;
+
+	if (memcmp(&session->acct->counters, &session->counters_last,
+				sizeof(struct session_counters)) == 0)
+		return;
+
+	session_notify(session);
+}
+
+static gboolean acct_timeout(gpointer user_data)
+{
+	acct_read();
+
+	g_hash_table_foreach(session_hash, acct_notify, NULL);
+
+	return TRUE;
+}
+
+/* Returns 0 when all marks within SESSION_MARK_MASK are taken */
+static unsigned int acct_new_mark(void)
+{
+	unsigned int mark;
+	GSList *list;
+
+	for (mark = 1 << SESSION_MARK_SHIFT; mark <= SESSION_MARK_MASK;
+					mark += 1 << SESSION_MARK_SHIFT) {
+		for (list = acct_list; list != NULL; list = list->next) {
+			struct session_acct *acct = list->data;
+
+			if (acct->mark == mark)
+				break;
+		}
+
+		if (list == NULL)
+			return mark;
+	}
+
+	return 0;
+}
+
+static struct session_acct *acct_get(unsigned int uid)
+{
+	struct session_acct *acct;
+	GSList *list;
+	int err;
+
+	for (list = acct_list; list != NULL; list = list->next) {
+		acct = list->data;
+
+		if (acct->uid == uid) {
+			acct->refcount++;
+			return acct;
+		}
+	}
+
+	acct = g_try_new0(struct session_acct, 1);
+	if (acct == NULL)
+		return NULL;
+
+	acct->uid = uid;
+	acct->mark = acct_new_mark();
+	acct->refcount = 1;
+
+	if (acct->mark == 0) {
+		connman_warn("No session accounting mark left for uid %u",
+									uid);
+		g_free(acct);
+		return NULL;
+	}
+
+	if (acct_list == NULL) {
+		err = acct_chains_add();
+		if (err < 0) {
+			connman_warn("Session accounting not available");
+			acct_chains_remove();
+			__connman_iptables_commit("mangle");
+			g_free(acct);
+			return NULL;
+		}
+	} else {
+		acct_read();
+	}
+
+	acct_list = g_slist_append(acct_list, acct);
+
+	acct_rules(acct, "-A");
+
+	if (acct_commit() < 0) {
+		connman_warn("Failed to add session accounting for uid %u",
+									uid);
+		/* keep the staged table in sync with acct_list */
+		acct_rules(acct, "-D");
+		acct_list = g_slist_remove(acct_list, acct);
+
+		if (acct_list == NULL)
+			acct_chains_remove();
+
+		g_free(acct);
+		return NULL;
+	}
+
+	if (acct_timer == 0)
+		acct_timer = g_timeout_add_seconds(SESSION_ACCT_INTERVAL,
+							acct_timeout, NULL);
+
+	return acct;
+}
+
+static void acct_put(struct session_acct *acct)
+{
+	if (acct == NULL)
+		return;
+
+	if (--acct->refcount > 0)
+		return;
+
+	acct_read();
+
+	acct_list = g_slist_remove(acct_list, acct);
+
+	acct_rules(acct, "-D");
+
+	if (acct_list == NULL) {
+		acct_chains_remove();
+
+		if (acct_timer > 0) {
+			g_source_remove(acct_timer);
+			acct_timer = 0;
+		}
+	}
+
+	acct_commit();
+
+	g_free(acct);
+}
+
+static void acct_uid_cb(unsigned int uid, void *user_data, int err)
+{
+	char *session_path = user_data;
+	struct connman_session *session;
+
+	session = g_hash_table_lookup(session_hash, session_path);
+	g_free(session_path);
+
+	if (session == NULL || err < 0)
+		return;
+
+	DBG("session %p uid %u", session, uid);
+
+	session->acct = acct_get(uid);
+}
+
 static void ipconfig_ipv4_changed(struct connman_session *session)
 {
 	struct session_info *info = session->info;
@@ -1633,6 +2030,7 @@ static int session_create_cb(struct connman_session *session,
 	DBusMessage *reply;
 	struct user_config *user_config = user_data;
 	struct session_info *info, *info_last;
+	char *session_path;
 
 	DBG("session %p config %p", session, config);
 
@@ -1685,6 +2083,11 @@ static int session_create_cb(struct connman_session *session,
 	g_dbus_send_message(connection, reply);
 	user_config->pending = NULL;
 
+	session_path = g_strdup(session->session_path);
+	if (connman_dbus_get_connection_unix_user(connection, session->owner,
+					acct_uid_cb, session_path) < 0)
+		g_free(session_path);
+
 	populate_service_list(session);
 
 	info_last->state = info->state;
@@ -46,7 +46,26 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC		0xFA01B916
+#define MAGIC_V1	0xFA00B916
+
+#define STATS_FILE_VERSION	3
+
+#define STATS_BLOCK_SIZE	512
+#define STATS_BLOCK_DATA_SIZE	(STATS_BLOCK_SIZE - sizeof(unsigned int))
+
+/* timestamp, eight counters and the online time */
+#define STATS_FIELDS		10
+#define STATS_RECORD_MAX_LEN	(STATS_FIELDS * 10)
+
+#define HISTORY_MAGIC		0xFA10B916
+#define HISTORY_VERSION		1
+
+#define HISTORY_DAYS		93
+#define HISTORY_MONTHS		60
+
+#define STATS_BUCKET_HOME	0x01
+#define STATS_BUCKET_ROAMING	0x02
 
 /*
  * Statistics counters are stored into a ring buffer which is stored
@@ -58,35 +77,66 @@
  *   The files grow to the configured maximal size
  *   The grows by _SC_PAGESIZE step size
  *   For each service a file is created
- *   Each file has a header where the indexes are stored
+ *   Each file has a header where the format version and the indexes
+ *   are stored
  *
  * Entries properties:
  *   Each entry has a timestamp
  *   A flag to mark if the entry is either home (0) or roaming (1) entry
- *   The entries are fixed sized (stats_record)
+ *   The entries are stored in fixed sized blocks (stats_block)
+ *   The first entry of a block is stored with its absolute values,
+ *   the following ones as the difference to the previous entry
+ *   All values are stored as variable length integers (7 bits per
+ *   byte), the differences zigzag encoded
  *
  * Ring buffer properties:
- *   There are to indexes 'begin', 'end', 'home' and 'roaming'
- *   'begin' points to the oldest entry
- *   'end' points to the newest/current entry
- *   'home' points to the current home entry
- *   'roaming' points to the current roaming entry
- *   If 'begin' == 'end' then the buffer is empty
- *   If 'end' + 1 == 'begin then it's full
- *   The ring buffer is valid in the range (begin, end]
- *   If 'home' has the value UINT_MAX', 'home' is invalid
- *   if 'roaming' has the value UINT_MAX', 'roaming' is invalid
- *   'first' points to the first entry in the ring buffer
- *   'last' points to the last entry in the ring buffer
+ *   The header takes the first block of the file
+ *   There are three indexes 'first', 'last' and 'used'
+ *   'first' is the block with the oldest entries
+ *   'last' is the block the newest entry was appended to
+ *   'used' is the number of blocks in use, if 0 the buffer is empty
+ *   If all blocks are used and the file can not grow anymore, the
+ *   oldest block is reused
+ *   The newest entry and the current home and roaming entries are
+ *   cached in memory
+ *
+ * Format versions:
+ *   1: 32 bit counters, no version field in the header (MAGIC_V1)
+ *   2: 64 bit counters, fixed sized entries
+ *   3: delta encoded entries in blocks
+ *   Files in an older format are converted when they are opened
  *
  * History file:
- *   Same format as the ring buffer file
- *   For a period of at least 2 months dayly records are keept
- *   If older, then only a monthly record is keept
+ *   Two rings of buckets which are updated with every new entry
+ *   A daily bucket for the last HISTORY_DAYS days and a monthly
+ *   bucket for the last HISTORY_MONTHS accounting periods
+ *   Each bucket holds the latest home and roaming values of its period
+ *   The file is only rewritten when it is created from the records
+ *   of the ring buffer and of a history file in the older format,
+ *   which was the ring buffer format
  */
 
 
 struct stats_file_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int first;
+	unsigned int last;
+	unsigned int used;
+};
+
+struct stats_block {
+	unsigned int len;
+	unsigned char data[STATS_BLOCK_DATA_SIZE];
+};
+
+struct stats_record {
+	time_t ts;
+	unsigned int roaming;
+	struct connman_stats_data data;
+};
+
+struct stats_file_header_v1 {
 	unsigned int magic;
 	unsigned int begin;
 	unsigned int end;
@@ -94,10 +144,46 @@ struct stats_file_header {
 	unsigned int roaming;
 };
 
-struct stats_record {
+struct stats_record_v1 {
 	time_t ts;
 	unsigned int roaming;
-	struct connman_stats_data data;
+	unsigned int rx_packets;
+	unsigned int tx_packets;
+	unsigned int rx_bytes;
+	unsigned int tx_bytes;
+	unsigned int rx_errors;
+	unsigned int tx_errors;
+	unsigned int rx_dropped;
+	unsigned int tx_dropped;
+	unsigned int time;
+};
+
+/* the version 2 entries have the layout of struct stats_record */
+struct stats_file_header_v2 {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int home;
+	unsigned int roaming;
+};
+
+struct stats_bucket {
+	time_t ts;
+	unsigned int valid;
+	struct connman_stats_data home;
+	struct connman_stats_data roaming;
+};
+
+struct stats_history_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int day_first;
+	unsigned int day_used;
+	unsigned int month_first;
+	unsigned int month_used;
+	struct stats_bucket day[HISTORY_DAYS];
+	struct stats_bucket month[HISTORY_MONTHS];
 };
 
 struct stats_file {
@@ -108,21 +194,24 @@ struct stats_file {
 	size_t max_len;
 
 	/* cached values */
-	struct stats_record *first;
-	struct stats_record *last;
-	struct stats_record *home;
-	struct stats_record *roaming;
+	unsigned int nr_blocks;
+	struct stats_record tail;
+	struct stats_record home;
+	struct stats_record roaming;
+	connman_bool_t home_valid;
+	connman_bool_t roaming_valid;
 
 	/* history */
+	struct stats_file *history;
 	char *history_name;
 	int account_period_offset;
 };
 
 struct stats_iter {
 	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
+	unsigned int block;
+	unsigned int offset;
+	struct stats_record rec;
 };
 
 GHashTable *stats_hash = NULL;
@@ -132,87 +221,159 @@ static struct stats_file_header *get_hdr(struct stats_file *file)
 	return (struct stats_file_header *)file->addr;
 }
 
-static struct stats_record *get_begin(struct stats_file *file)
+static struct stats_block *get_block(struct stats_file *file,
+					unsigned int index)
 {
-	unsigned int off = get_hdr(file)->begin;
-
-	return (struct stats_record *)(file->addr + off);
+	return (struct stats_block *)
+			(file->addr + (index + 1) * STATS_BLOCK_SIZE);
 }
 
-static struct stats_record *get_end(struct stats_file *file)
+static unsigned int put_varint(unsigned char *buf, uint64_t val)
 {
-	unsigned int off = get_hdr(file)->end;
-
-	return (struct stats_record *)(file->addr + off);
-}
+	unsigned int len = 0;
 
-static struct stats_record *get_home(struct stats_file *file)
-{
-	struct stats_file_header *hdr;
+	while (val >= 0x80) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
 
-	hdr = get_hdr(file);
+	buf[len++] = val;
 
-	if (hdr->home == UINT_MAX)
-		return NULL;
-
-	return (struct stats_record *)(file->addr + hdr->home);
+	return len;
 }
 
-static struct stats_record *get_roaming(struct stats_file *file)
+static int get_varint(const unsigned char *buf, unsigned int len,
+							uint64_t *val)
 {
-	struct stats_file_header *hdr;
+	unsigned int i, shift = 0;
 
-	hdr = get_hdr(file);
+	*val = 0;
 
-	if (hdr->roaming == UINT_MAX)
-		return NULL;
+	for (i = 0; i < len && shift < 64; i++) {
+		*val |= (uint64_t) (buf[i] & 0x7f) << shift;
 
-	return (struct stats_record *)(file->addr + hdr->roaming);
-}
+		if ((buf[i] & 0x80) == 0)
+			return i + 1;
 
-static void set_end(struct stats_file *file, struct stats_record *end)
-{
-	struct stats_file_header *hdr;
+		shift += 7;
+	}
 
-	hdr = get_hdr(file);
-	hdr->end = (char *)end - file->addr;
+	return -EINVAL;
 }
 
-static void set_home(struct stats_file *file, struct stats_record *home)
+static uint64_t zigzag_encode(uint64_t delta)
 {
-	struct stats_file_header *hdr;
+	return (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63);
+}
 
-	hdr = get_hdr(file);
-	hdr->home = (char *)home - file->addr;
+static uint64_t zigzag_decode(uint64_t val)
+{
+	return (val >> 1) ^ -(val & 1);
 }
 
-static void set_roaming(struct stats_file *file, struct stats_record *roaming)
+static void record_to_fields(const struct stats_record *rec,
+							uint64_t *fields)
 {
-	struct stats_file_header *hdr;
+	fields[0] = (int64_t) rec->ts;
+	fields[1] = rec->data.rx_packets;
+	fields[2] = rec->data.tx_packets;
+	fields[3] = rec->data.rx_bytes;
+	fields[4] = rec->data.tx_bytes;
+	fields[5] = rec->data.rx_errors;
+	fields[6] = rec->data.tx_errors;
+	fields[7] = rec->data.rx_dropped;
+	fields[8] = rec->data.tx_dropped;
+	fields[9] = rec->data.time;
+}
 
-	hdr = get_hdr(file);
-	hdr->roaming = (char *)roaming - file->addr;
+static void fields_to_record(const uint64_t *fields,
+					struct stats_record *rec)
+{
+	rec->ts = (int64_t) fields[0];
+	rec->data.rx_packets = fields[1];
+	rec->data.tx_packets = fields[2];
+	rec->data.rx_bytes = fields[3];
+	rec->data.tx_bytes = fields[4];
+	rec->data.rx_errors = fields[5];
+	rec->data.tx_errors = fields[6];
+	rec->data.rx_dropped = fields[7];
+	rec->data.tx_dropped = fields[8];
+	rec->data.time = fields[9];
 }
 
-static struct stats_record *get_next(struct stats_file *file,
-					struct stats_record *cur)
+/*
+ * The roaming flag is stored in the lowest bit of the timestamp
+ * difference. Without a previous entry the absolute values are stored.
+ */
+static unsigned int encode_record(unsigned char *buf,
+					const struct stats_record *rec,
+					const struct stats_record *prev)
 {
-	cur++;
+	uint64_t fields[STATS_FIELDS], prev_fields[STATS_FIELDS];
+	unsigned int i, len;
+
+	record_to_fields(rec, fields);
+
+	if (prev != NULL)
+		record_to_fields(prev, prev_fields);
+	else
+		memset(prev_fields, 0, sizeof(prev_fields));
+
+	len = put_varint(buf, zigzag_encode(fields[0] - prev_fields[0]) << 1 |
+					(rec->roaming == TRUE ? 1 : 0));
 
-	if (cur > file->last)
-		cur = file->first;
+	for (i = 1; i < STATS_FIELDS; i++)
+		len += put_varint(buf + len,
+				zigzag_encode(fields[i] - prev_fields[i]));
 
-	return cur;
+	return len;
 }
 
-static struct stats_record *get_iterator_begin(struct stats_file *file)
+static int decode_record(const unsigned char *buf, unsigned int len,
+					struct stats_record *rec,
+					const struct stats_record *prev)
 {
-	return get_next(file, get_begin(file));
+	uint64_t fields[STATS_FIELDS], prev_fields[STATS_FIELDS], val;
+	unsigned int i, offset = 0, roaming = FALSE;
+	int n;
+
+	if (prev != NULL)
+		record_to_fields(prev, prev_fields);
+	else
+		memset(prev_fields, 0, sizeof(prev_fields));
+
+	for (i = 0; i < STATS_FIELDS; i++) {
+		n = get_varint(buf + offset, len - offset, &val);
+		if (n < 0)
+			return n;
+
+		offset += n;
+
+		if (i == 0) {
+			roaming = val & 1 ? TRUE : FALSE;
+			val >>= 1;
+		}
+
+		fields[i] = prev_fields[i] + zigzag_decode(val);
+	}
+
+	fields_to_record(fields, rec);
+	rec->roaming = roaming;
+
+	return offset;
 }
 
-static struct stats_record *get_iterator_end(struct stats_file *file)
+static void cache_record(struct stats_file *file, struct stats_record *rec)
 {
-	return get_next(file, get_end(file));
+	memcpy(&file->tail, rec, sizeof(struct stats_record));
+
+	if (rec->roaming == TRUE) {
+		memcpy(&file->roaming, rec, sizeof(struct stats_record));
+		file->roaming_valid = TRUE;
+	} else {
+		memcpy(&file->home, rec, sizeof(struct stats_record));
+		file->home_valid = TRUE;
+	}
 }
 
 static void stats_free(gpointer user_data)
@@ -222,6 +383,11 @@ static void stats_free(gpointer user_data)
 	if (file == NULL)
 		return;
 
+	if (file->history != NULL) {
+		stats_free(file->history);
+		file->history = NULL;
+	}
+
 	msync(file->addr, file->len, MS_SYNC);
 
 	munmap(file->addr, file->len);
@@ -243,37 +409,9 @@ static void stats_free(gpointer user_data)
 	g_free(file);
 }
 
-static void update_first(struct stats_file *file)
-{
-	file->first = (struct stats_record *)
-			(file->addr + sizeof(struct stats_file_header));
-}
-
-static void update_last(struct stats_file *file)
-{
-	unsigned int max_entries;
-
-	max_entries = (file->len - sizeof(struct stats_file_header)) /
-			sizeof(struct stats_record);
-	file->last = file->first + max_entries - 1;
-}
-
-static void update_home(struct stats_file *file)
-{
-	file->home = get_home(file);
-}
-
-static void update_roaming(struct stats_file *file)
-{
-	file->roaming = get_roaming(file);
-}
-
 static void stats_file_update_cache(struct stats_file *file)
 {
-	update_first(file);
-	update_last(file);
-	update_home(file);
-	update_roaming(file);
+	file->nr_blocks = file->len / STATS_BLOCK_SIZE - 1;
 }
 
 static int stats_file_remap(struct stats_file *file, size_t size)
@@ -363,240 +501,339 @@ static int stats_open_temp(struct stats_file *file)
 	return 0;
 }
 
-static int stats_file_setup(struct stats_file *file)
+static void stats_file_reset(struct stats_file *file)
 {
-	struct stats_file_header *hdr;
-	struct stat st;
-	size_t size = 0;
-	int err;
+	struct stats_file_header *hdr = get_hdr(file);
 
-	DBG("file %p fd %d name %s", file, file->fd, file->name);
+	hdr->magic = MAGIC;
+	hdr->version = STATS_FILE_VERSION;
+	hdr->first = 0;
+	hdr->last = 0;
+	hdr->used = 0;
 
-	err = fstat(file->fd, &st);
-	if (err < 0) {
-		connman_error("fstat error %s for %s\n",
-			strerror(errno), file->name);
+	file->home_valid = FALSE;
+	file->roaming_valid = FALSE;
+}
 
-		TFR(close(file->fd));
-		g_free(file->name);
-		file->name = NULL;
+static int new_block(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	int err;
 
-		return -errno;
+	if (hdr->used == 0) {
+		hdr->first = 0;
+		hdr->last = 0;
+		hdr->used = 1;
+	} else if (hdr->used < file->nr_blocks) {
+		hdr->last = (hdr->last + 1) % file->nr_blocks;
+		hdr->used++;
+	} else if (file->len < file->max_len && hdr->first == 0) {
+		err = stats_file_remap(file, file->len +
+					sysconf(_SC_PAGESIZE));
+		if (err < 0)
+			return err;
+
+		hdr = get_hdr(file);
+		hdr->last++;
+		hdr->used++;
+	} else {
+		/* reuse the oldest block */
+		hdr->first = (hdr->first + 1) % file->nr_blocks;
+		hdr->last = (hdr->last + 1) % file->nr_blocks;
 	}
 
-	size = (size_t)st.st_size;
-	file->max_len = STATS_MAX_FILE_SIZE;
+	get_block(file, hdr->last)->len = 0;
 
-	if (size < (size_t)sysconf(_SC_PAGESIZE))
-		size = sysconf(_SC_PAGESIZE);
+	return 0;
+}
 
-	err = stats_file_remap(file, size);
-	if (err < 0) {
-		TFR(close(file->fd));
-		g_free(file->name);
-		file->name = NULL;
+static int append_record(struct stats_file *file,
+				struct stats_record *rec)
+{
+	unsigned char buf[STATS_RECORD_MAX_LEN];
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block = NULL;
+	unsigned int len = 0;
+	int err;
 
-		return err;
-	}
+	if (hdr->used > 0) {
+		block = get_block(file, hdr->last);
 
-	hdr = get_hdr(file);
+		if (block->len > 0)
+			len = encode_record(buf, rec, &file->tail);
+		else
+			len = encode_record(buf, rec, NULL);
 
-	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
-		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
+		if (block->len + len > STATS_BLOCK_DATA_SIZE)
+			block = NULL;
+	}
+
+	if (block == NULL) {
+		err = new_block(file);
+		if (err < 0)
+			return err;
 
-		stats_file_update_cache(file);
+		block = get_block(file, get_hdr(file)->last);
+		len = encode_record(buf, rec, NULL);
 	}
 
+	memcpy(block->data + block->len, buf, len);
+	block->len += len;
+
+	cache_record(file, rec);
+
 	return 0;
 }
 
-
-static struct stats_record *get_next_record(struct stats_iter *iter)
+/*
+ * Read the entries of the formats with fixed sized entries. The valid
+ * entries are in the range (begin, end] of the ring buffer.
+ */
+static struct stats_record *read_fixed_records(struct stats_file *file,
+					size_t hdr_size, size_t rec_size,
+					unsigned int begin, unsigned int end,
+					unsigned int *nr)
 {
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
+	struct stats_record *records;
+	unsigned int max_nr, cur, i;
 
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
+	*nr = 0;
 
-		return tmp;
+	if (begin < hdr_size || end < hdr_size ||
+			begin + rec_size > file->len ||
+			end + rec_size > file->len ||
+			(begin - hdr_size) % rec_size != 0 ||
+			(end - hdr_size) % rec_size != 0)
+		return NULL;
+
+	max_nr = (file->len - hdr_size) / rec_size;
+
+	records = g_try_new0(struct stats_record, max_nr);
+	if (records == NULL)
+		return NULL;
+
+	for (i = 0, cur = begin; cur != end; i++) {
+		cur += rec_size;
+		if (cur + rec_size > file->len)
+			cur = hdr_size;
+
+		if (rec_size == sizeof(struct stats_record)) {
+			memcpy(&records[i], file->addr + cur, rec_size);
+		} else {
+			struct stats_record_v1 v1;
+
+			/* the version 1 entries are not aligned */
+			memcpy(&v1, file->addr + cur, rec_size);
+
+			records[i].ts = v1.ts;
+			records[i].roaming = v1.roaming;
+			records[i].data.rx_packets = v1.rx_packets;
+			records[i].data.tx_packets = v1.tx_packets;
+			records[i].data.rx_bytes = v1.rx_bytes;
+			records[i].data.tx_bytes = v1.tx_bytes;
+			records[i].data.rx_errors = v1.rx_errors;
+			records[i].data.tx_errors = v1.tx_errors;
+			records[i].data.rx_dropped = v1.rx_dropped;
+			records[i].data.tx_dropped = v1.tx_dropped;
+			records[i].data.time = v1.time;
+		}
 	}
 
-	return NULL;
+	*nr = i;
+
+	return records;
 }
 
-static int append_record(struct stats_file *file,
-				struct stats_record *rec)
+/*
+ * Rewrite a file of an older format in the current one. Only the
+ * newest entries are kept when they do not all fit into the maximal
+ * file size.
+ */
+static int stats_file_convert(struct stats_file *file)
 {
-	struct stats_record *cur, *next;
-	int err;
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_record *records;
+	unsigned int nr, i;
+	int err = 0;
 
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
+	if (hdr->magic == MAGIC_V1) {
+		struct stats_file_header_v1 *hdr_v1 = (void *) hdr;
 
-		stats_file_update_cache(file);
+		records = read_fixed_records(file, sizeof(*hdr_v1),
+					sizeof(struct stats_record_v1),
+					hdr_v1->begin, hdr_v1->end, &nr);
+	} else {
+		struct stats_file_header_v2 *hdr_v2 = (void *) hdr;
+
+		records = read_fixed_records(file, sizeof(*hdr_v2),
+					sizeof(struct stats_record),
+					hdr_v2->begin, hdr_v2->end, &nr);
 	}
 
-	cur = get_end(file);
-	next = get_next(file, cur);
+	if (records == NULL)
+		return -EINVAL;
 
-	memcpy(next, rec, sizeof(struct stats_record));
+	DBG("file %s converting %u records", file->name, nr);
 
-	set_end(file, next);
+	stats_file_reset(file);
 
-	return 0;
+	for (i = 0; i < nr; i++) {
+		err = append_record(file, &records[i]);
+		if (err < 0)
+			break;
+	}
+
+	g_free(records);
+
+	return err;
 }
 
-static struct stats_record *process_file(struct stats_iter *iter,
-					struct stats_file *temp_file,
-					struct stats_record *cur,
-					GDate *date_change_step_size,
-					int account_period_offset)
+/*
+ * Fill the cache from the entries. A block which can not be decoded
+ * ends the ring buffer.
+ */
+static void stats_file_load(struct stats_file *file)
 {
-	struct stats_record *home, *roaming;
-	struct stats_record *next;
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_record rec;
+	unsigned int i, index, offset;
+	int n;
+
+	file->home_valid = FALSE;
+	file->roaming_valid = FALSE;
+
+	for (i = 0; i < hdr->used; i++) {
+		struct stats_block *block;
+
+		index = (hdr->first + i) % file->nr_blocks;
+		block = get_block(file, index);
+		offset = 0;
+
+		while (block->len <= STATS_BLOCK_DATA_SIZE &&
+						offset < block->len) {
+			n = decode_record(block->data + offset,
+					block->len - offset, &rec,
+					offset > 0 ? &rec : NULL);
+			if (n < 0)
+				break;
+
+			offset += n;
+			cache_record(file, &rec);
+		}
 
-	home = NULL;
-	roaming = NULL;
+		if (offset == block->len)
+			continue;
 
-	if (cur == NULL)
-		cur = get_next_record(iter);
-	next = get_next_record(iter);
+		connman_warn("Dropping corrupted records of %s", file->name);
 
-	while (next != NULL) {
-		GDate date_cur;
-		GDate date_next;
-		int append;
+		block->len = offset;
 
-		append = FALSE;
+		if (offset == 0 && i > 0)
+			index = (index + file->nr_blocks - 1) % file->nr_blocks;
 
-		if (cur->roaming == TRUE)
-			roaming = cur;
-		else
-			home = cur;
+		hdr->used = offset > 0 ? i + 1 : i;
+		hdr->last = index;
+		break;
+	}
+}
 
-		g_date_set_time_t(&date_cur, cur->ts);
-		g_date_set_time_t(&date_next, next->ts);
+static int stats_file_setup(struct stats_file *file)
+{
+	struct stats_file_header *hdr;
+	struct stat st;
+	size_t size = 0;
+	int err;
 
-		if (g_date_compare(&date_cur, date_change_step_size) < 0) {
-			/* month period size */
-			GDateDay day_cur, day_next;
-			GDateMonth month_cur, month_next;
+	DBG("file %p fd %d name %s", file, file->fd, file->name);
 
-			month_cur = g_date_get_month(&date_cur);
-			month_next = g_date_get_month(&date_next);
+	err = fstat(file->fd, &st);
+	if (err < 0) {
+		connman_error("fstat error %s for %s\n",
+			strerror(errno), file->name);
 
-			day_cur = g_date_get_day(&date_cur);
-			day_next = g_date_get_day(&date_next);
+		TFR(close(file->fd));
+		g_free(file->name);
+		file->name = NULL;
 
-			if (day_cur == day_next && month_cur != month_next) {
-				append = TRUE;
-			} else if (day_cur < account_period_offset &&
-					day_next >= account_period_offset) {
-				append = TRUE;
-			}
-		} else {
-			/* day period size */
-			if (g_date_days_between(&date_cur, &date_next) > 0)
-				append = TRUE;
-		}
+		return -errno;
+	}
 
-		if (append == TRUE) {
-			if (home != NULL) {
-				append_record(temp_file, home);
-				home = NULL;
-			}
+	size = (size_t)st.st_size;
+	file->max_len = STATS_MAX_FILE_SIZE;
 
-			if (roaming != NULL) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
-			}
-		}
+	if (size < (size_t)sysconf(_SC_PAGESIZE))
+		size = sysconf(_SC_PAGESIZE);
 
-		cur = next;
-		next = get_next_record(iter);
-	}
+	err = stats_file_remap(file, size);
+	if (err < 0) {
+		TFR(close(file->fd));
+		g_free(file->name);
+		file->name = NULL;
 
-	return cur;
-}
+		return err;
+	}
 
-static int summarize(struct stats_file *data_file,
-			struct stats_file *history_file,
-			struct stats_file *temp_file)
-{
-	struct stats_iter data_iter;
-	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
+	hdr = get_hdr(file);
 
-	GDate today, date_change_step_size;
+	if (hdr->magic == MAGIC_V1 ||
+			(hdr->magic == MAGIC && hdr->version == 2)) {
+		err = stats_file_convert(file);
+		if (err < 0)
+			connman_warn("Failed to convert %s", file->name);
 
-	/*
-	 * First calculate the date when switch from monthly
-	 * accounting period size to daily size
-	 */
-	g_date_set_time_t(&today, time(NULL));
+		hdr = get_hdr(file);
+	}
 
-	date_change_step_size = today;
-	if (g_date_get_day(&today) - data_file->account_period_offset >= 0)
-		g_date_subtract_months(&date_change_step_size, 2);
+	if (hdr->magic != MAGIC ||
+			hdr->version != STATS_FILE_VERSION ||
+			hdr->first >= file->nr_blocks ||
+			hdr->last >= file->nr_blocks ||
+			hdr->used > file->nr_blocks ||
+			(hdr->used > 0 && (hdr->first + hdr->used - 1) %
+					file->nr_blocks != hdr->last))
+		stats_file_reset(file);
 	else
-		g_date_subtract_months(&date_change_step_size, 3);
+		stats_file_load(file);
 
-	g_date_set_day(&date_change_step_size,
-			data_file->account_period_offset);
+	return 0;
+}
 
+static void stats_iter_init(struct stats_iter *iter, struct stats_file *file)
+{
+	memset(iter, 0, sizeof(struct stats_iter));
+	iter->file = file;
+}
+
+static struct stats_record *get_next_record(struct stats_iter *iter)
+{
+	struct stats_file *file = iter->file;
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block;
+	int n;
 
-	/* Now process history file */
-	cur = NULL;
+	while (iter->block < hdr->used) {
+		block = get_block(file,
+				(hdr->first + iter->block) % file->nr_blocks);
 
-	if (history_file != NULL) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
+		if (iter->offset < block->len) {
+			n = decode_record(block->data + iter->offset,
+					block->len - iter->offset, &iter->rec,
+					iter->offset > 0 ? &iter->rec : NULL);
+			if (n < 0)
+				break;
 
-		cur = process_file(&history_iter, temp_file, NULL,
-					&date_change_step_size,
-					data_file->account_period_offset);
-	}
+			iter->offset += n;
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
+			return &iter->rec;
+		}
 
-	/*
-	 * Ensure date_file records are newer than the history_file
-	 * record
-	 */
-	if (cur != NULL) {
-		next = get_next_record(&data_iter);
-		while (next != NULL && cur->ts > next->ts)
-			next = get_next_record(&data_iter);
+		iter->block++;
+		iter->offset = 0;
 	}
 
-	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
-				&date_change_step_size,
-				data_file->account_period_offset);
-
-	if (cur != NULL)
-		append_record(temp_file, cur);
+	iter->block = hdr->used;
 
-	return 0;
+	return NULL;
 }
 
 static void stats_file_unmap(struct stats_file *file)
@@ -637,33 +874,304 @@ static int stats_file_close_swap(struct stats_file *history_file,
 	return err;
 }
 
-static int stats_file_history_update(struct stats_file *data_file)
+static struct stats_history_header *get_history_hdr(struct stats_file *file)
 {
-	struct stats_file _history_file, *history_file;
+	return (struct stats_history_header *)file->addr;
+}
+
+static guint32 day_key(time_t ts)
+{
+	GDate date;
+
+	g_date_set_time_t(&date, ts);
+
+	return g_date_get_julian(&date);
+}
+
+/*
+ * The accounting month starts on the account_period_offset day.
+ */
+static guint32 month_key(time_t ts, int account_period_offset)
+{
+	GDate date;
+	guint32 key;
+
+	g_date_set_time_t(&date, ts);
+
+	key = g_date_get_year(&date) * 12 + g_date_get_month(&date) - 1;
+	if (g_date_get_day(&date) < account_period_offset)
+		key--;
+
+	return key;
+}
+
+static struct stats_bucket *get_newest_bucket(struct stats_bucket *buckets,
+					unsigned int size, unsigned int first,
+					unsigned int used)
+{
+	if (used == 0)
+		return NULL;
+
+	return &buckets[(first + used - 1) % size];
+}
+
+/*
+ * A new bucket starts with the values of the previous one, the oldest
+ * bucket is reused when all of them are in use.
+ */
+static struct stats_bucket *new_bucket(struct stats_bucket *buckets,
+					unsigned int size, unsigned int *first,
+					unsigned int *used)
+{
+	struct stats_bucket *prev, *bucket;
+
+	prev = get_newest_bucket(buckets, size, *first, *used);
+
+	if (*used < size)
+		(*used)++;
+	else
+		*first = (*first + 1) % size;
+
+	bucket = get_newest_bucket(buckets, size, *first, *used);
+
+	if (prev != NULL)
+		memcpy(bucket, prev, sizeof(struct stats_bucket));
+	else
+		memset(bucket, 0, sizeof(struct stats_bucket));
+
+	return bucket;
+}
+
+static void bucket_update(struct stats_bucket *bucket,
+					struct stats_record *rec)
+{
+	if (rec->ts > bucket->ts)
+		bucket->ts = rec->ts;
+
+	if (rec->roaming == TRUE) {
+		memcpy(&bucket->roaming, &rec->data,
+				sizeof(struct connman_stats_data));
+		bucket->valid |= STATS_BUCKET_ROAMING;
+	} else {
+		memcpy(&bucket->home, &rec->data,
+				sizeof(struct connman_stats_data));
+		bucket->valid |= STATS_BUCKET_HOME;
+	}
+}
+
+/*
+ * Keep the latest values of each day and of each accounting month.
+ * Records older than the newest bucket, for example after the clock
+ * was set back, update the newest bucket.
+ */
+static void history_add(struct stats_file *history, struct stats_record *rec,
+						int account_period_offset)
+{
+	struct stats_history_header *hdr = get_history_hdr(history);
+	struct stats_bucket *bucket;
+
+	bucket = get_newest_bucket(hdr->day, HISTORY_DAYS,
+					hdr->day_first, hdr->day_used);
+	if (bucket == NULL || day_key(rec->ts) > day_key(bucket->ts))
+		bucket = new_bucket(hdr->day, HISTORY_DAYS,
+					&hdr->day_first, &hdr->day_used);
+	bucket_update(bucket, rec);
+
+	bucket = get_newest_bucket(hdr->month, HISTORY_MONTHS,
+					hdr->month_first, hdr->month_used);
+	if (bucket == NULL || month_key(rec->ts, account_period_offset) >
+			month_key(bucket->ts, account_period_offset))
+		bucket = new_bucket(hdr->month, HISTORY_MONTHS,
+					&hdr->month_first, &hdr->month_used);
+	bucket_update(bucket, rec);
+}
+
+static connman_bool_t history_valid(struct stats_file *history)
+{
+	struct stats_history_header *hdr = get_history_hdr(history);
+
+	if (history->len < sizeof(struct stats_history_header))
+		return FALSE;
+
+	if (hdr->magic != HISTORY_MAGIC || hdr->version != HISTORY_VERSION)
+		return FALSE;
+
+	if (hdr->day_first >= HISTORY_DAYS || hdr->day_used > HISTORY_DAYS ||
+			hdr->month_first >= HISTORY_MONTHS ||
+			hdr->month_used > HISTORY_MONTHS)
+		return FALSE;
+
+	return TRUE;
+}
+
+static int history_map(struct stats_file *history)
+{
+	struct stat st;
+	size_t size;
+
+	if (fstat(history->fd, &st) < 0)
+		return -errno;
+
+	size = MAX((size_t) st.st_size, sizeof(struct stats_history_header));
+
+	return stats_file_remap(history, size);
+}
+
+/*
+ * Create the history file from the records of the older history
+ * formats and the records of the ring buffer. This is the only time
+ * the history file is rewritten.
+ */
+static int history_rebuild(struct stats_file *data_file)
+{
+	struct stats_file _old_file, *old_file;
 	struct stats_file _temp_file, *temp_file;
+	struct stats_history_header *hdr;
+	struct stats_iter iter;
+	struct stats_record *rec;
+	time_t last = 0;
 	int err;
 
-	history_file = &_history_file;
+	DBG("file %s", data_file->history_name);
+
+	old_file = &_old_file;
 	temp_file = &_temp_file;
 
-	bzero(history_file, sizeof(struct stats_file));
+	bzero(old_file, sizeof(struct stats_file));
 	bzero(temp_file, sizeof(struct stats_file));
 
-	err = stats_open(history_file, data_file->history_name);
+	err = stats_open(old_file, data_file->history_name);
+	if (err < 0)
+		return err;
+
+	/* a history file of the older versions has the ring buffer format */
+	err = stats_file_setup(old_file);
 	if (err < 0)
 		return err;
-	stats_file_setup(history_file);
 
 	err = stats_open_temp(temp_file);
+	if (err < 0)
+		goto err;
+
+	err = history_map(temp_file);
 	if (err < 0) {
-		stats_free(history_file);
-		return err;
+		stats_file_unmap(temp_file);
+		TFR(close(temp_file->fd));
+		unlink(temp_file->name);
+		stats_file_cleanup(temp_file);
+		goto err;
+	}
+
+	hdr = get_history_hdr(temp_file);
+	memset(hdr, 0, sizeof(struct stats_history_header));
+	hdr->magic = HISTORY_MAGIC;
+	hdr->version = HISTORY_VERSION;
+
+	stats_iter_init(&iter, old_file);
+	while ((rec = get_next_record(&iter)) != NULL) {
+		history_add(temp_file, rec, data_file->account_period_offset);
+		last = rec->ts;
 	}
-	stats_file_setup(temp_file);
 
-	summarize(data_file, history_file, temp_file);
+	stats_iter_init(&iter, data_file);
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (rec->ts < last)
+			continue;
+
+		history_add(temp_file, rec, data_file->account_period_offset);
+	}
+
+	return stats_file_close_swap(old_file, temp_file);
+
+err:
+	stats_file_unmap(old_file);
+	TFR(close(old_file->fd));
+	stats_file_cleanup(old_file);
+
+	return err;
+}
+
+/*
+ * The ring buffer might not contain a home or roaming entry anymore
+ * after it wrapped, the newest daily bucket still has their values.
+ */
+static void history_load(struct stats_file *data_file)
+{
+	struct stats_history_header *hdr = get_history_hdr(data_file->history);
+	struct stats_bucket *bucket;
+
+	bucket = get_newest_bucket(hdr->day, HISTORY_DAYS,
+					hdr->day_first, hdr->day_used);
+	if (bucket == NULL)
+		return;
+
+	if (data_file->home_valid == FALSE &&
+			(bucket->valid & STATS_BUCKET_HOME) != 0) {
+		data_file->home.ts = bucket->ts;
+		data_file->home.roaming = FALSE;
+		memcpy(&data_file->home.data, &bucket->home,
+				sizeof(struct connman_stats_data));
+		data_file->home_valid = TRUE;
+	}
+
+	if (data_file->roaming_valid == FALSE &&
+			(bucket->valid & STATS_BUCKET_ROAMING) != 0) {
+		data_file->roaming.ts = bucket->ts;
+		data_file->roaming.roaming = TRUE;
+		memcpy(&data_file->roaming.data, &bucket->roaming,
+				sizeof(struct connman_stats_data));
+		data_file->roaming_valid = TRUE;
+	}
+}
+
+static int history_setup(struct stats_file *data_file)
+{
+	struct stats_file *history;
+	int err;
+
+	history = g_try_new0(struct stats_file, 1);
+	if (history == NULL)
+		return -ENOMEM;
+
+	err = stats_open(history, data_file->history_name);
+	if (err < 0)
+		goto err;
+
+	err = history_map(history);
+	if (err < 0)
+		goto err;
+
+	if (history_valid(history) == FALSE) {
+		stats_file_unmap(history);
+		TFR(close(history->fd));
+		stats_file_cleanup(history);
+
+		err = history_rebuild(data_file);
+		if (err < 0)
+			goto err;
+
+		err = stats_open(history, data_file->history_name);
+		if (err < 0)
+			goto err;
+
+		err = history_map(history);
+		if (err < 0)
+			goto err;
+
+		if (history_valid(history) == FALSE) {
+			err = -EINVAL;
+			goto err;
+		}
+	}
+
+	data_file->history = history;
+
+	history_load(data_file);
+
+	return 0;
 
-	err = stats_file_close_swap(history_file, temp_file);
+err:
+	stats_free(history);
 
 	return err;
 }
@@ -721,6 +1229,10 @@ int __connman_stats_service_register(struct connman_service *service)
 	if (err < 0)
 		goto err;
 
+	if (history_setup(file) < 0)
+		connman_warn("Failed to set up history file %s",
+					file->history_name);
+
 	return 0;
 
 err:
@@ -741,66 +1253,313 @@ int  __connman_stats_update(struct connman_service *service,
 				struct connman_stats_data *data)
 {
 	struct stats_file *file;
-	struct stats_record *next;
-	int err;
+	struct stats_record rec;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
-	if (file->len < file->max_len &&
-			file->last == get_end(file)) {
-		DBG("grow file %s", file->name);
+	rec.ts = time(NULL);
+	rec.roaming = roaming;
+	memcpy(&rec.data, data, sizeof(struct connman_stats_data));
 
-		err = stats_file_remap(file, file->len + sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
-	}
+	if (file->history != NULL)
+		history_add(file->history, &rec,
+				file->account_period_offset);
 
-	next = get_next(file, get_end(file));
+	return append_record(file, &rec);
+}
 
-	if (next == get_begin(file)) {
-		DBG("ring buffer is full, update history file");
+int __connman_stats_get(struct connman_service *service,
+				connman_bool_t roaming,
+				struct connman_stats_data *data)
+{
+	struct stats_file *file;
 
-		if (stats_file_history_update(file) < 0) {
-			connman_warn("history file update failed %s",
-					file->history_name);
-		}
-	}
+	file = g_hash_table_lookup(stats_hash, service);
+	if (file == NULL)
+		return -EEXIST;
 
-	next->ts = time(NULL);
-	next->roaming = roaming;
-	memcpy(&next->data, data, sizeof(struct connman_stats_data));
+	if (roaming != TRUE && file->home_valid == TRUE)
+		memcpy(data, &file->home.data,
+			sizeof(struct connman_stats_data));
+	else if (roaming == TRUE && file->roaming_valid == TRUE)
+		memcpy(data, &file->roaming.data,
+			sizeof(struct connman_stats_data));
 
-	if (roaming != TRUE)
-		set_home(file, next);
-	else
-		set_roaming(file, next);
+	return 0;
+}
 
-	set_end(file, next);
+struct stats_range {
+	time_t start;
+	time_t end;
+	unsigned int interval;
+	struct connman_stats_data *home;
+	struct connman_stats_data *roaming;
+
+	/* the values of the previous entries */
+	struct connman_stats_data prev_home;
+	struct connman_stats_data prev_roaming;
+	connman_bool_t home_valid;
+	connman_bool_t roaming_valid;
+	time_t last;
+	connman_bool_t last_valid;
+};
 
-	return 0;
+/*
+ * The counters only go backwards when they were reset.
+ */
+static uint64_t counter_delta(uint64_t cur, uint64_t prev)
+{
+	if (cur < prev)
+		return cur;
+
+	return cur - prev;
 }
 
-int __connman_stats_get(struct connman_service *service,
+static void data_add_delta(struct connman_stats_data *sum,
+				const struct connman_stats_data *cur,
+				const struct connman_stats_data *prev)
+{
+	sum->rx_packets += counter_delta(cur->rx_packets, prev->rx_packets);
+	sum->tx_packets += counter_delta(cur->tx_packets, prev->tx_packets);
+	sum->rx_bytes += counter_delta(cur->rx_bytes, prev->rx_bytes);
+	sum->tx_bytes += counter_delta(cur->tx_bytes, prev->tx_bytes);
+	sum->rx_errors += counter_delta(cur->rx_errors, prev->rx_errors);
+	sum->tx_errors += counter_delta(cur->tx_errors, prev->tx_errors);
+	sum->rx_dropped += counter_delta(cur->rx_dropped, prev->rx_dropped);
+	sum->tx_dropped += counter_delta(cur->tx_dropped, prev->tx_dropped);
+	sum->time += counter_delta(cur->time, prev->time);
+}
+
+/*
+ * The traffic between the previous entry and this one is accounted
+ * to the interval of this entry.
+ */
+static void range_add(struct stats_range *range, time_t ts,
 				connman_bool_t roaming,
 				struct connman_stats_data *data)
+{
+	struct connman_stats_data *prev, *sum;
+	connman_bool_t *valid;
+	unsigned int i;
+
+	if (roaming == TRUE) {
+		prev = &range->prev_roaming;
+		valid = &range->roaming_valid;
+	} else {
+		prev = &range->prev_home;
+		valid = &range->home_valid;
+	}
+
+	if (*valid == TRUE && ts >= range->start && ts < range->end) {
+		i = (ts - range->start) / range->interval;
+
+		if (roaming == TRUE)
+			sum = &range->roaming[i];
+		else
+			sum = &range->home[i];
+
+		data_add_delta(sum, data, prev);
+	}
+
+	memcpy(prev, data, sizeof(struct connman_stats_data));
+	*valid = TRUE;
+
+	range->last = ts;
+	range->last_valid = TRUE;
+}
+
+static void range_add_bucket(struct stats_range *range,
+				struct stats_bucket *bucket)
+{
+	if ((bucket->valid & STATS_BUCKET_HOME) != 0)
+		range_add(range, bucket->ts, FALSE, &bucket->home);
+
+	if ((bucket->valid & STATS_BUCKET_ROAMING) != 0)
+		range_add(range, bucket->ts, TRUE, &bucket->roaming);
+}
+
+/*
+ * Number of the oldest buckets which are older than ts.
+ */
+static unsigned int bucket_search(struct stats_bucket *buckets,
+					unsigned int size, unsigned int first,
+					unsigned int used, time_t ts)
+{
+	unsigned int low = 0, high = used, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+
+		if (buckets[(first + mid) % size].ts < ts)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Add the buckets starting at index until the one which is not older
+ * than until.
+ */
+static void range_add_buckets(struct stats_range *range,
+				struct stats_bucket *buckets,
+				unsigned int size, unsigned int first,
+				unsigned int used, unsigned int index,
+				time_t until)
+{
+	struct stats_bucket *bucket;
+
+	for (; index < used; index++) {
+		bucket = &buckets[(first + index) % size];
+
+		if (bucket->ts >= until || bucket->ts >= range->end)
+			break;
+
+		range_add_bucket(range, bucket);
+	}
+}
+
+/*
+ * The first entry of a block is stored with its absolute values.
+ */
+static connman_bool_t block_first_ts(struct stats_file *file,
+					unsigned int index, time_t *ts)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block;
+	struct stats_record rec;
+
+	block = get_block(file, (hdr->first + index) % file->nr_blocks);
+
+	if (block->len == 0 || block->len > STATS_BLOCK_DATA_SIZE)
+		return FALSE;
+
+	if (decode_record(block->data, block->len, &rec, NULL) < 0)
+		return FALSE;
+
+	*ts = rec.ts;
+
+	return TRUE;
+}
+
+/*
+ * The last block which starts not later than ts.
+ */
+static unsigned int block_search(struct stats_file *file, time_t ts)
+{
+	unsigned int low = 0, high = get_hdr(file)->used, mid;
+	time_t first_ts;
+
+	while (high - low > 1) {
+		mid = low + (high - low) / 2;
+
+		if (block_first_ts(file, mid, &first_ts) == TRUE &&
+							first_ts <= ts)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Sum up the traffic of count intervals starting at start. The older
+ * values come from the daily and monthly history buckets and have
+ * their resolution, the newer ones come from the ring buffer.
+ */
+int __connman_stats_get_range(struct connman_service *service,
+				time_t start, unsigned int interval,
+				unsigned int count,
+				struct connman_stats_data *home,
+				struct connman_stats_data *roaming)
 {
 	struct stats_file *file;
+	struct stats_history_header *hdr = NULL;
+	struct stats_range range;
+	struct stats_iter iter;
 	struct stats_record *rec;
+	time_t ring_first = 0, last;
+	connman_bool_t ring_valid, last_valid;
+	unsigned int index;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
-	if (roaming != TRUE)
-		rec = file->home;
-	else
-		rec = file->roaming;
+	if (interval == 0 || count == 0)
+		return -EINVAL;
 
-	if (rec != NULL) {
-		memcpy(data, &rec->data,
-			sizeof(struct connman_stats_data));
+	memset(&range, 0, sizeof(struct stats_range));
+	range.start = start;
+	range.end = start + (time_t) interval * count;
+	range.interval = interval;
+	range.home = home;
+	range.roaming = roaming;
+
+	memset(home, 0, count * sizeof(struct connman_stats_data));
+	memset(roaming, 0, count * sizeof(struct connman_stats_data));
+
+	ring_valid = block_first_ts(file, 0, &ring_first);
+	if (get_hdr(file)->used == 0)
+		ring_valid = FALSE;
+
+	if (file->history != NULL)
+		hdr = get_history_hdr(file->history);
+
+	if (hdr != NULL) {
+		time_t days_first = range.end;
+
+		if (hdr->day_used > 0)
+			days_first = hdr->day[hdr->day_first].ts;
+
+		/* start from the newest bucket before the range */
+		index = bucket_search(hdr->day, HISTORY_DAYS,
+					hdr->day_first, hdr->day_used, start);
+		if (index == 0) {
+			index = bucket_search(hdr->month, HISTORY_MONTHS,
+						hdr->month_first,
+						hdr->month_used, start);
+			if (index > 0)
+				index--;
+
+			range_add_buckets(&range, hdr->month, HISTORY_MONTHS,
+					hdr->month_first, hdr->month_used,
+					index, days_first);
+
+			index = 0;
+		} else {
+			index--;
+		}
+
+		range_add_buckets(&range, hdr->day, HISTORY_DAYS,
+					hdr->day_first, hdr->day_used, index,
+					ring_valid == TRUE ?
+						ring_first : range.end);
+	}
+
+	if (ring_valid == FALSE)
+		return 0;
+
+	/* the older entries are already in the buckets */
+	last = range.last;
+	last_valid = range.last_valid;
+
+	stats_iter_init(&iter, file);
+	iter.block = block_search(file, last_valid == TRUE ? last : start);
+
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (rec->ts >= range.end)
+			break;
+
+		if (last_valid == TRUE && rec->ts <= last)
+			continue;
+
+		range_add(&range, rec->ts, rec->roaming, &rec->data);
 	}
 
 	return 0;
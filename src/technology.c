@@ -537,6 +537,8 @@ static void technology_added_signal(struct connman_technology *technology)
 							&technology->path);
 	append_properties(&iter, technology);
 
+	__connman_dbus_flush_property_changes();
+
 	dbus_connection_send(connection, signal, NULL);
 	dbus_message_unref(signal);
 }
@@ -966,6 +968,8 @@ static const GDBusMethodTable technology_methods[] = {
 static const GDBusSignalTable technology_signals[] = {
 	{ GDBUS_SIGNAL("PropertyChanged",
 			GDBUS_ARGS({ "name", "s" }, { "value", "v" })) },
+	{ GDBUS_SIGNAL("PropertiesChanged",
+			GDBUS_ARGS({ "properties", "a{sv}" })) },
 	{ },
 };
 
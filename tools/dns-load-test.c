@@ -0,0 +1,281 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+/*
+ * Load generator for the DNS proxy. Sends A queries for the given
+ * host names to the proxy, keeping a window of queries outstanding,
+ * and reports the queries per second and the reply latencies.
+ */
+
+#define QUERY_TIMEOUT 2.0
+
+struct query {
+	gboolean pending;
+	double sent;
+};
+
+static gchar *option_server = NULL;
+static gint option_port = 53;
+static gint option_count = 10000;
+static gint option_window = 64;
+static gint option_type = 1;
+
+static GOptionEntry options[] = {
+	{ "server", 's', 0, G_OPTION_ARG_STRING, &option_server,
+				"DNS proxy address (127.0.0.1)", "ADDRESS" },
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &option_port,
+				"DNS proxy port (53)", "PORT" },
+	{ "count", 'c', 0, G_OPTION_ARG_INT, &option_count,
+				"Number of queries to send (10000)", "COUNT" },
+	{ "window", 'w', 0, G_OPTION_ARG_INT, &option_window,
+				"Queries outstanding at a time (64)", "COUNT" },
+	{ "type", 't', 0, G_OPTION_ARG_INT, &option_type,
+				"Query type (1)", "TYPE" },
+	{ NULL },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int build_query(unsigned char *buf, int size, uint16_t id,
+						const char *name, uint16_t type)
+{
+	unsigned char *ptr = buf + 12;
+	const char *label = name;
+
+	if (size < 12 + (int) strlen(name) + 2 + 4)
+		return -EINVAL;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;		/* recursion desired */
+	buf[5] = 1;		/* one question */
+
+	while (*label != '\0') {
+		const char *dot = strchr(label, '.');
+		int len = dot != NULL ? dot - label : (int) strlen(label);
+
+		if (len == 0 || len > 63)
+			return -EINVAL;
+
+		*ptr++ = len;
+		memcpy(ptr, label, len);
+		ptr += len;
+
+		if (dot == NULL)
+			break;
+
+		label = dot + 1;
+	}
+
+	*ptr++ = 0;
+	*ptr++ = type >> 8;
+	*ptr++ = type & 0xff;
+	*ptr++ = 0;
+	*ptr++ = 1;		/* class IN */
+
+	return ptr - buf;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *default_names[] = { "connman.net", "www.connman.net",
+						"kernel.org", NULL };
+	const char **names = default_names;
+	GOptionContext *context;
+	GError *error = NULL;
+	struct sockaddr_in addr;
+	struct query *queries;
+	double *latency, start, elapsed;
+	unsigned char buf[512];
+	int sk, i, num_names, sent = 0, received = 0, lost = 0;
+	int outstanding = 0;
+
+	context = g_option_context_new("[host names...]");
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_count <= 0 || option_window <= 0 || option_window > 65536) {
+		g_printerr("invalid count or window\n");
+		exit(1);
+	}
+
+	if (argc > 1)
+		names = (const char **) argv + 1;
+
+	for (num_names = 0; names[num_names] != NULL; num_names++)
+		;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(option_port);
+	if (inet_pton(AF_INET, option_server != NULL ? option_server :
+					"127.0.0.1", &addr.sin_addr) != 1) {
+		g_printerr("invalid server address\n");
+		exit(1);
+	}
+
+	sk = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	queries = g_new0(struct query, 65536);
+	latency = g_new0(double, option_count);
+
+	start = now();
+
+	while (received + lost < option_count) {
+		struct pollfd pfd = { .fd = sk, .events = POLLIN };
+		double t;
+		int len;
+
+		/* fill the window */
+		while (outstanding < option_window && sent < option_count) {
+			uint16_t id = sent & 0xffff;
+
+			if (queries[id].pending == TRUE)
+				break;
+
+			len = build_query(buf, sizeof(buf), id,
+					names[sent % num_names], option_type);
+			if (len < 0) {
+				g_printerr("invalid host name %s\n",
+						names[sent % num_names]);
+				exit(1);
+			}
+
+			if (send(sk, buf, len, 0) < 0) {
+				if (errno == EAGAIN || errno == ENOBUFS)
+					break;
+				perror("send");
+				exit(1);
+			}
+
+			queries[id].pending = TRUE;
+			queries[id].sent = now();
+			outstanding++;
+			sent++;
+		}
+
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+
+		while ((len = recv(sk, buf, sizeof(buf), 0)) >= 12) {
+			uint16_t id = buf[0] << 8 | buf[1];
+
+			if (queries[id].pending == FALSE)
+				continue;
+
+			queries[id].pending = FALSE;
+			latency[received++] = now() - queries[id].sent;
+			outstanding--;
+		}
+
+		/* give up on the queries that were not answered */
+		t = now();
+		for (i = 0; i < 65536 && outstanding > 0; i++) {
+			if (queries[i].pending == FALSE ||
+					t - queries[i].sent < QUERY_TIMEOUT)
+				continue;
+
+			queries[i].pending = FALSE;
+			outstanding--;
+			lost++;
+		}
+	}
+
+	elapsed = now() - start;
+
+	printf("sent %d received %d lost %d in %.3f seconds\n",
+					sent, received, lost, elapsed);
+	printf("%.0f queries/sec\n", received / elapsed);
+
+	if (received > 0) {
+		double total = 0;
+
+		for (i = 0; i < received; i++)
+			total += latency[i];
+
+		qsort(latency, received, sizeof(double), compare_double);
+
+		printf("latency avg %.3f ms p50 %.3f ms p99 %.3f ms "
+			"max %.3f ms\n", total / received * 1000,
+			latency[received / 2] * 1000,
+			latency[(int) (received * 0.99)] * 1000,
+			latency[received - 1] * 1000);
+	}
+
+	g_free(latency);
+	g_free(queries);
+	close(sk);
+
+	return 0;
+}
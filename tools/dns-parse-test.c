@@ -0,0 +1,453 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "../src/connman.h"
+
+/*
+ * Fuzz harness and benchmark for the DNS packet parser of the DNS
+ * proxy. The fuzzer mutates a few well formed responses, and the
+ * packets given on the command line, and walks them the way the proxy
+ * does, checking that the parser agrees with itself. It is best run
+ * under valgrind or built with -fsanitize=address to catch the out of
+ * bounds accesses.
+ */
+
+#define MAX_PACKET 1024
+
+struct packet {
+	unsigned char buf[MAX_PACKET];
+	unsigned int len;
+};
+
+static gint option_fuzz = 0;
+static gint option_bench = 0;
+static gint option_seed = 1;
+
+static GOptionEntry options[] = {
+	{ "fuzz", 'f', 0, G_OPTION_ARG_INT, &option_fuzz,
+				"Number of mutated packets to parse", "COUNT" },
+	{ "bench", 'b', 0, G_OPTION_ARG_INT, &option_bench,
+				"Number of parse rounds to time", "COUNT" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &option_seed,
+				"Random seed of the fuzzer (1)", "SEED" },
+	{ NULL },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put_u16(struct packet *pkt, uint16_t value)
+{
+	pkt->buf[pkt->len++] = value >> 8;
+	pkt->buf[pkt->len++] = value & 0xff;
+}
+
+static void put_u32(struct packet *pkt, uint32_t value)
+{
+	put_u16(pkt, value >> 16);
+	put_u16(pkt, value & 0xffff);
+}
+
+/*
+ * Append the dotted name, ending it with a pointer to offset, or with
+ * the root if offset is 0. Returns the offset of the name.
+ */
+static unsigned int put_name(struct packet *pkt, const char *name,
+							unsigned int offset)
+{
+	unsigned int start = pkt->len;
+
+	while (name != NULL && *name != '\0') {
+		const char *dot = strchr(name, '.');
+		int len = dot != NULL ? dot - name : (int) strlen(name);
+
+		pkt->buf[pkt->len++] = len;
+		memcpy(pkt->buf + pkt->len, name, len);
+		pkt->len += len;
+
+		name = dot != NULL ? dot + 1 : NULL;
+	}
+
+	if (offset > 0)
+		put_u16(pkt, 0xc000 | offset);
+	else
+		pkt->buf[pkt->len++] = 0;
+
+	return start;
+}
+
+static unsigned int put_header(struct packet *pkt, uint16_t flags,
+				uint16_t ancount, uint16_t nscount,
+				const char *question, uint16_t type)
+{
+	unsigned int qname;
+
+	pkt->len = 0;
+	put_u16(pkt, 0x1234);
+	put_u16(pkt, flags);
+	put_u16(pkt, 1);
+	put_u16(pkt, ancount);
+	put_u16(pkt, nscount);
+	put_u16(pkt, 0);
+
+	qname = put_name(pkt, question, 0);
+	put_u16(pkt, type);
+	put_u16(pkt, 1);
+
+	return qname;
+}
+
+/* Type, class and TTL of a record, the rdata length is filled in later */
+static unsigned int put_rr(struct packet *pkt, uint16_t type)
+{
+	put_u16(pkt, type);
+	put_u16(pkt, 1);
+	put_u32(pkt, 3600);
+	put_u16(pkt, 0);
+
+	return pkt->len;
+}
+
+static void end_rr(struct packet *pkt, unsigned int rdata)
+{
+	pkt->buf[rdata - 2] = (pkt->len - rdata) >> 8;
+	pkt->buf[rdata - 1] = (pkt->len - rdata) & 0xff;
+}
+
+static GSList *build_seeds(void)
+{
+	GSList *seeds = NULL;
+	struct packet *pkt;
+	unsigned int qname, cname, rdata;
+	int i;
+
+	/* www.connman.net CNAME web.connman.net, A of the alias */
+	pkt = g_new0(struct packet, 1);
+	qname = put_header(pkt, 0x8180, 2, 0, "www.connman.net", 1);
+	put_name(pkt, NULL, qname);
+	rdata = put_rr(pkt, 5);
+	cname = put_name(pkt, "web", qname + 4);
+	end_rr(pkt, rdata);
+	put_name(pkt, NULL, cname);
+	rdata = put_rr(pkt, 1);
+	put_u32(pkt, 0x0a000001);
+	end_rr(pkt, rdata);
+	seeds = g_slist_append(seeds, pkt);
+
+	/* NXDOMAIN with the SOA in the authority section */
+	pkt = g_new0(struct packet, 1);
+	qname = put_header(pkt, 0x8183, 0, 1, "nothere.connman.net", 28);
+	put_name(pkt, NULL, qname + 8);
+	rdata = put_rr(pkt, 6);
+	put_name(pkt, "ns1", qname + 8);
+	put_name(pkt, "hostmaster", qname + 8);
+	for (i = 0; i < 5; i++)
+		put_u32(pkt, 300 * (i + 1));
+	end_rr(pkt, rdata);
+	seeds = g_slist_append(seeds, pkt);
+
+	/* MX and SRV records with compressed names */
+	pkt = g_new0(struct packet, 1);
+	qname = put_header(pkt, 0x8180, 2, 0, "connman.net", 15);
+	put_name(pkt, NULL, qname);
+	rdata = put_rr(pkt, 15);
+	put_u16(pkt, 10);
+	put_name(pkt, "mail", qname);
+	end_rr(pkt, rdata);
+	put_name(pkt, "_sip._udp", qname);
+	rdata = put_rr(pkt, 33);
+	put_u16(pkt, 0);
+	put_u16(pkt, 5);
+	put_u16(pkt, 5060);
+	put_name(pkt, "sip", qname);
+	end_rr(pkt, rdata);
+	seeds = g_slist_append(seeds, pkt);
+
+	/* a larger set of address records */
+	pkt = g_new0(struct packet, 1);
+	qname = put_header(pkt, 0x8180, 24, 0, "pool.ntp.connman.net", 1);
+	for (i = 0; i < 24; i++) {
+		put_name(pkt, NULL, qname);
+		rdata = put_rr(pkt, 1);
+		put_u32(pkt, 0x0a000000 + i);
+		end_rr(pkt, rdata);
+	}
+	seeds = g_slist_append(seeds, pkt);
+
+	return seeds;
+}
+
+static struct packet *load_packet(const char *filename)
+{
+	struct packet *pkt;
+	gchar *content;
+	gsize length;
+
+	if (g_file_get_contents(filename, &content, &length, NULL) == FALSE) {
+		g_printerr("Cannot read %s\n", filename);
+		return NULL;
+	}
+
+	pkt = g_new0(struct packet, 1);
+	pkt->len = MIN(length, sizeof(pkt->buf));
+	memcpy(pkt->buf, content, pkt->len);
+	g_free(content);
+
+	return pkt;
+}
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		g_printerr("%s:%d: check failed: %s\n",			\
+				__FILE__, __LINE__, #cond);		\
+		abort();						\
+	}								\
+} while (0)
+
+/*
+ * Walk all the records of the packet like the DNS proxy does when it
+ * caches a response, and check the results if verify is set. Returns
+ * the number of records or a negative error.
+ */
+static int walk_packet(const unsigned char *buf, unsigned int len,
+							gboolean verify)
+{
+	unsigned char out[MAX_PACKET * 4];
+	struct dns_packet pkt;
+	unsigned int offset;
+	int err, i, n, m = 0, count;
+
+	err = __connman_dns_parse(&pkt, buf, len);
+	if (err < 0)
+		return err;
+
+	if (verify == TRUE && pkt.qdcount > 0) {
+		check(pkt.qname + pkt.qname_len + 4 <= len);
+		check(strlen((const char *) buf + pkt.qname) + 1 ==
+							pkt.qname_len);
+	}
+
+	count = pkt.ancount + pkt.nscount + pkt.arcount;
+	offset = pkt.records;
+
+	for (i = 0; i < count; i++) {
+		struct dns_rr rr;
+
+		err = __connman_dns_parse_rr(&pkt, &offset, &rr);
+		if (err < 0)
+			return err;
+
+		if (pkt.qdcount > 0)
+			__connman_dns_name_equal(&pkt, rr.name, pkt.qname);
+
+		n = __connman_dns_rdata_length(&pkt, &rr);
+		if (n >= 0)
+			m = __connman_dns_rdata_copy(&pkt, &rr, out,
+								sizeof(out));
+
+		if (verify == FALSE)
+			continue;
+
+		check(rr.rdata + rr.rdlen == offset);
+		check(offset <= len);
+
+		if (n >= 0) {
+			check(m == n);
+
+			/* a short buffer is reported, not overrun */
+			if (n > 0) {
+				m = __connman_dns_rdata_copy(&pkt, &rr, out,
+									n - 1);
+				check(m == -ENOBUFS);
+			}
+		}
+
+		n = __connman_dns_name_length(&pkt, rr.name);
+		if (n >= 0) {
+			check(n > 0 && n <= 255);
+
+			m = __connman_dns_name_copy(&pkt, rr.name, out,
+								sizeof(out));
+			check(m == n);
+
+			check(__connman_dns_name_equal(&pkt, rr.name,
+							rr.name) == TRUE);
+		}
+	}
+
+	return count;
+}
+
+static void mutate(struct packet *pkt, const struct packet *seed)
+{
+	int i, mutations = 1 + random() % 8;
+
+	*pkt = *seed;
+
+	for (i = 0; i < mutations; i++) {
+		unsigned int pos = random() % pkt->len;
+
+		switch (random() % 6) {
+		case 0:
+			pkt->buf[pos] ^= 1 << (random() % 8);
+			break;
+		case 1:
+			pkt->buf[pos] = random();
+			break;
+		case 2:
+			/* a compression pointer to anywhere */
+			if (pos + 1 < pkt->len) {
+				pkt->buf[pos] = 0xc0 | (random() % 4);
+				pkt->buf[pos + 1] = random();
+			}
+			break;
+		case 3:
+			/* a label length running off the packet */
+			pkt->buf[pos] = 0x3f;
+			break;
+		case 4:
+			pkt->len = pos;
+			break;
+		case 5:
+			/* the record counts */
+			pkt->buf[4 + random() % 8] = random();
+			break;
+		}
+
+		if (pkt->len == 0)
+			break;
+	}
+}
+
+static void fuzz(GSList *seeds, int rounds)
+{
+	int i, num_seeds = g_slist_length(seeds), parsed = 0;
+	struct packet pkt;
+
+	srandom(option_seed);
+
+	for (i = 0; i < rounds; i++) {
+		struct packet *seed = g_slist_nth_data(seeds, i % num_seeds);
+
+		mutate(&pkt, seed);
+
+		if (walk_packet(pkt.buf, pkt.len, TRUE) >= 0)
+			parsed++;
+	}
+
+	printf("fuzzed %d packets, %d parsed without errors\n",
+							rounds, parsed);
+}
+
+static void bench(GSList *seeds, int rounds)
+{
+	GSList *list;
+	double start, elapsed;
+	unsigned long bytes = 0, packets = 0;
+	int i;
+
+	start = now();
+
+	for (i = 0; i < rounds; i++) {
+		for (list = seeds; list; list = list->next) {
+			struct packet *pkt = list->data;
+
+			walk_packet(pkt->buf, pkt->len, FALSE);
+
+			bytes += pkt->len;
+			packets++;
+		}
+	}
+
+	elapsed = now() - start;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	printf("parsed %lu packets in %.3f seconds\n", packets, elapsed);
+	printf("%.0f packets/sec %.1f MB/sec\n", packets / elapsed,
+					bytes / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GSList *seeds, *list;
+	int i;
+
+	context = g_option_context_new("[packet files...]");
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	seeds = build_seeds();
+
+	for (i = 1; i < argc; i++) {
+		struct packet *pkt = load_packet(argv[i]);
+
+		if (pkt != NULL)
+			seeds = g_slist_append(seeds, pkt);
+	}
+
+	for (list = seeds; list; list = list->next) {
+		struct packet *pkt = list->data;
+
+		printf("packet %u bytes: %d records\n", pkt->len,
+				walk_packet(pkt->buf, pkt->len, TRUE));
+	}
+
+	if (option_fuzz > 0)
+		fuzz(seeds, option_fuzz);
+
+	if (option_bench > 0)
+		bench(seeds, option_bench);
+
+	g_slist_free_full(seeds, g_free);
+
+	return 0;
+}
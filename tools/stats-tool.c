@@ -30,6 +30,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <sys/time.h>
 #include <time.h>
@@ -46,26 +47,49 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC		0xFA01B916
+#define MAGIC_V1	0xFA00B916
+
+#define STATS_FILE_VERSION	3
+
+#define STATS_BLOCK_SIZE	512
+#define STATS_BLOCK_DATA_SIZE	(STATS_BLOCK_SIZE - sizeof(unsigned int))
+
+#define STATS_FIELDS		10
+#define STATS_RECORD_MAX_LEN	(STATS_FIELDS * 10)
+
+#define HISTORY_MAGIC		0xFA10B916
+#define HISTORY_VERSION		1
+
+#define HISTORY_DAYS		93
+#define HISTORY_MONTHS		60
+
+#define STATS_BUCKET_HOME	0x01
+#define STATS_BUCKET_ROAMING	0x02
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
 struct stats_file_header {
 	unsigned int magic;
-	unsigned int begin;
-	unsigned int end;
-	unsigned int home;
-	unsigned int roaming;
+	unsigned int version;
+	unsigned int first;
+	unsigned int last;
+	unsigned int used;
+};
+
+struct stats_block {
+	unsigned int len;
+	unsigned char data[STATS_BLOCK_DATA_SIZE];
 };
 
 struct stats_record {
@@ -74,6 +98,24 @@ struct stats_record {
 	struct connman_stats_data data;
 };
 
+struct stats_bucket {
+	time_t ts;
+	unsigned int valid;
+	struct connman_stats_data home;
+	struct connman_stats_data roaming;
+};
+
+struct stats_history_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int day_first;
+	unsigned int day_used;
+	unsigned int month_first;
+	unsigned int month_used;
+	struct stats_bucket day[HISTORY_DAYS];
+	struct stats_bucket month[HISTORY_MONTHS];
+};
+
 struct stats_file {
 	int fd;
 	char *name;
@@ -82,19 +124,23 @@ struct stats_file {
 	size_t max_len;
 
 	/* cached values */
-	int max_nr;
+	unsigned int nr_blocks;
 	int nr;
-	struct stats_record *first;
-	struct stats_record *last;
-	struct stats_record *home_first;
-	struct stats_record *roaming_first;
+	struct stats_record tail;
+	struct stats_record first;
+	struct stats_record home_first;
+	struct stats_record home_last;
+	struct stats_record roaming_first;
+	struct stats_record roaming_last;
+	gboolean home_valid;
+	gboolean roaming_valid;
 };
 
 struct stats_iter {
 	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
+	unsigned int block;
+	unsigned int offset;
+	struct stats_record rec;
 };
 
 static gint option_create = 0;
@@ -142,76 +188,181 @@ static struct stats_file_header *get_hdr(struct stats_file *file)
 	return (struct stats_file_header *)file->addr;
 }
 
-static struct stats_record *get_begin(struct stats_file *file)
+static struct stats_block *get_block(struct stats_file *file,
+					unsigned int index)
 {
-	unsigned int off = get_hdr(file)->begin;
-
-	return (struct stats_record *)(file->addr + off);
+	return (struct stats_block *)
+			(file->addr + (index + 1) * STATS_BLOCK_SIZE);
 }
 
-static struct stats_record *get_end(struct stats_file *file)
+static unsigned int put_varint(unsigned char *buf, uint64_t val)
 {
-	unsigned int off = get_hdr(file)->end;
+	unsigned int len = 0;
 
-	return (struct stats_record *)(file->addr + off);
+	while (val >= 0x80) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+
+	buf[len++] = val;
+
+	return len;
 }
 
-static struct stats_record *get_home(struct stats_file *file)
+static int get_varint(const unsigned char *buf, unsigned int len,
+							uint64_t *val)
 {
-	struct stats_file_header *hdr;
+	unsigned int i, shift = 0;
 
-	hdr = get_hdr(file);
+	*val = 0;
 
-	if (hdr->home == UINT_MAX)
-		return NULL;
+	for (i = 0; i < len && shift < 64; i++) {
+		*val |= (uint64_t) (buf[i] & 0x7f) << shift;
 
-	return (struct stats_record *)(file->addr + hdr->home);
-}
+		if ((buf[i] & 0x80) == 0)
+			return i + 1;
 
-static struct stats_record *get_roaming(struct stats_file *file)
-{
-	struct stats_file_header *hdr;
+		shift += 7;
+	}
 
-	hdr = get_hdr(file);
+	return -EINVAL;
+}
 
-	if (hdr->roaming == UINT_MAX)
-		return NULL;
+static uint64_t zigzag_encode(uint64_t delta)
+{
+	return (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63);
+}
 
-	return (struct stats_record *)(file->addr + hdr->roaming);
+static uint64_t zigzag_decode(uint64_t val)
+{
+	return (val >> 1) ^ -(val & 1);
 }
 
-static void set_end(struct stats_file *file, struct stats_record *end)
+static void record_to_fields(const struct stats_record *rec,
+							uint64_t *fields)
 {
-	struct stats_file_header *hdr;
+	fields[0] = (int64_t) rec->ts;
+	fields[1] = rec->data.rx_packets;
+	fields[2] = rec->data.tx_packets;
+	fields[3] = rec->data.rx_bytes;
+	fields[4] = rec->data.tx_bytes;
+	fields[5] = rec->data.rx_errors;
+	fields[6] = rec->data.tx_errors;
+	fields[7] = rec->data.rx_dropped;
+	fields[8] = rec->data.tx_dropped;
+	fields[9] = rec->data.time;
+}
 
-	hdr = get_hdr(file);
-	hdr->end = (char *)end - file->addr;
+static void fields_to_record(const uint64_t *fields,
+					struct stats_record *rec)
+{
+	rec->ts = (int64_t) fields[0];
+	rec->data.rx_packets = fields[1];
+	rec->data.tx_packets = fields[2];
+	rec->data.rx_bytes = fields[3];
+	rec->data.tx_bytes = fields[4];
+	rec->data.rx_errors = fields[5];
+	rec->data.tx_errors = fields[6];
+	rec->data.rx_dropped = fields[7];
+	rec->data.tx_dropped = fields[8];
+	rec->data.time = fields[9];
 }
 
-static int get_index(struct stats_file *file, struct stats_record *rec)
+static unsigned int encode_record(unsigned char *buf,
+					const struct stats_record *rec,
+					const struct stats_record *prev)
 {
-	return rec - file->first;
+	uint64_t fields[STATS_FIELDS], prev_fields[STATS_FIELDS];
+	unsigned int i, len;
+
+	record_to_fields(rec, fields);
+
+	if (prev != NULL)
+		record_to_fields(prev, prev_fields);
+	else
+		memset(prev_fields, 0, sizeof(prev_fields));
+
+	len = put_varint(buf, zigzag_encode(fields[0] - prev_fields[0]) << 1 |
+					(rec->roaming == TRUE ? 1 : 0));
+
+	for (i = 1; i < STATS_FIELDS; i++)
+		len += put_varint(buf + len,
+				zigzag_encode(fields[i] - prev_fields[i]));
+
+	return len;
 }
 
-static struct stats_record *get_next(struct stats_file *file,
-					struct stats_record *cur)
+static int decode_record(const unsigned char *buf, unsigned int len,
+					struct stats_record *rec,
+					const struct stats_record *prev)
 {
-	cur++;
+	uint64_t fields[STATS_FIELDS], prev_fields[STATS_FIELDS], val;
+	unsigned int i, offset = 0, roaming = FALSE;
+	int n;
 
-	if (cur > file->last)
-		cur = file->first;
+	if (prev != NULL)
+		record_to_fields(prev, prev_fields);
+	else
+		memset(prev_fields, 0, sizeof(prev_fields));
 
-	return cur;
+	for (i = 0; i < STATS_FIELDS; i++) {
+		n = get_varint(buf + offset, len - offset, &val);
+		if (n < 0)
+			return n;
+
+		offset += n;
+
+		if (i == 0) {
+			roaming = val & 1 ? TRUE : FALSE;
+			val >>= 1;
+		}
+
+		fields[i] = prev_fields[i] + zigzag_decode(val);
+	}
+
+	fields_to_record(fields, rec);
+	rec->roaming = roaming;
+
+	return offset;
 }
 
-static struct stats_record *get_iterator_begin(struct stats_file *file)
+static void stats_iter_init(struct stats_iter *iter, struct stats_file *file)
 {
-	return get_next(file, get_begin(file));
+	memset(iter, 0, sizeof(struct stats_iter));
+	iter->file = file;
 }
 
-static struct stats_record *get_iterator_end(struct stats_file *file)
+static struct stats_record *get_next_record(struct stats_iter *iter)
 {
-	return get_next(file, get_end(file));
+	struct stats_file *file = iter->file;
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block;
+	int n;
+
+	while (iter->block < hdr->used) {
+		block = get_block(file,
+				(hdr->first + iter->block) % file->nr_blocks);
+
+		if (iter->offset < block->len &&
+				block->len <= STATS_BLOCK_DATA_SIZE) {
+			n = decode_record(block->data + iter->offset,
+					block->len - iter->offset, &iter->rec,
+					iter->offset > 0 ? &iter->rec : NULL);
+			if (n < 0)
+				break;
+
+			iter->offset += n;
+
+			return &iter->rec;
+		}
+
+		iter->block++;
+		iter->offset = 0;
+	}
+
+	iter->block = hdr->used;
+
+	return NULL;
 }
 
 static void stats_print_record(struct stats_record *rec)
@@ -219,47 +370,33 @@ static void stats_print_record(struct stats_record *rec)
 	char buffer[30];
 
 	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&rec->ts));
-	printf("%p %lld %s %01d %d %d %d %d %d %d %d %d %d\n",
-		rec, (long long int)rec->ts, buffer,
+	printf("%lld %s %01d %llu %llu %llu %llu %llu %llu %llu %llu %u\n",
+		(long long int)rec->ts, buffer,
 		rec->roaming,
-		rec->data.rx_packets,
-		rec->data.tx_packets,
-		rec->data.rx_bytes,
-		rec->data.tx_bytes,
-		rec->data.rx_errors,
-		rec->data.tx_errors,
-		rec->data.rx_dropped,
-		rec->data.tx_dropped,
+		(unsigned long long) rec->data.rx_packets,
+		(unsigned long long) rec->data.tx_packets,
+		(unsigned long long) rec->data.rx_bytes,
+		(unsigned long long) rec->data.tx_bytes,
+		(unsigned long long) rec->data.rx_errors,
+		(unsigned long long) rec->data.tx_errors,
+		(unsigned long long) rec->data.rx_dropped,
+		(unsigned long long) rec->data.tx_dropped,
 		rec->data.time);
 }
 
 static void stats_hdr_info(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
-	struct stats_record *begin, *end, *home, *roaming;
-	unsigned int home_idx, roaming_idx;
 
 	hdr = get_hdr(file);
-	begin = get_begin(file);
-	end = get_end(file);
-
-	home = get_home(file);
-	if (home == NULL)
-		home_idx = UINT_MAX;
-	else
-		home_idx = get_index(file, home);
-
-	roaming = get_roaming(file);
-	if (roaming == NULL)
-		roaming_idx = UINT_MAX;
-	else
-		roaming_idx = get_index(file, roaming);
 
 	printf("Data Structure Sizes\n");
 	printf("  sizeof header   %zd/0x%02zx\n",
 		sizeof(struct stats_file_header),
 		sizeof(struct stats_file_header));
-	printf("  sizeof entry    %zd/0%02zx\n\n",
+	printf("  sizeof block    %d/0x%02x\n",
+		STATS_BLOCK_SIZE, STATS_BLOCK_SIZE);
+	printf("  sizeof entry    %zd/0x%02zx\n\n",
 		sizeof(struct stats_record),
 		sizeof(struct stats_record));
 
@@ -267,156 +404,119 @@ static void stats_hdr_info(struct stats_file *file)
 	printf("  addr            %p\n",  file->addr);
 	printf("  len             %zd\n", file->len);
 
-	printf("  max nr entries  %d\n", file->max_nr);
+	printf("  nr blocks       %u\n", file->nr_blocks);
 	printf("  nr entries      %d\n\n", file->nr);
 
 	printf("Header\n");
 	printf("  magic           0x%08x\n", hdr->magic);
-	printf("  begin           [%d] 0x%08x\n",
-		get_index(file, begin), hdr->begin);
-	printf("  end             [%d] 0x%08x\n",
-		get_index(file, end), hdr->end);
-	printf("  home            [%d] 0x%08x\n",
-		home_idx, hdr->home);
-	printf("  roaming         [%d] 0x%08x\n\n",
-		roaming_idx, hdr->roaming);
-
-
-	printf("Pointers\n");
-	printf("  hdr             %p\n", hdr);
-	printf("  begin           %p\n", begin);
-	printf("  end             %p\n", end);
-	printf("  home            %p\n", home);
-	printf("  romaing         %p\n", roaming);
-	printf("  first           %p\n", file->first);
-	printf("  last            %p\n\n", file->last);
+	printf("  version         %u\n", hdr->version);
+	printf("  first           %u\n", hdr->first);
+	printf("  last            %u\n", hdr->last);
+	printf("  used            %u\n\n", hdr->used);
 }
 
 static void stats_print_entries(struct stats_file *file)
 {
-	struct stats_record *it;
+	struct stats_iter iter;
+	struct stats_record *rec;
 	int i;
 
-	printf("[ idx] ptr ts ts rx_packets tx_packets rx_bytes "
+	printf("[ idx] ts ts rx_packets tx_packets rx_bytes "
 		"tx_bytes rx_errors tx_errors rx_dropped tx_dropped time\n\n");
 
-	for (i = 0, it = file->first; it <= file->last; it++, i++) {
+	stats_iter_init(&iter, file);
+
+	for (i = 0; (rec = get_next_record(&iter)) != NULL; i++) {
 		printf("[%04d] ", i);
-		stats_print_record(it);
+		stats_print_record(rec);
 	}
 }
 
 static void stats_print_rec_diff(struct stats_record *begin,
 					struct stats_record *end)
 {
-	printf("\trx_packets: %d\n",
-		end->data.rx_packets - begin->data.rx_packets);
-	printf("\ttx_packets: %d\n",
-		end->data.tx_packets - begin->data.tx_packets);
-	printf("\trx_bytes:   %d\n",
-		end->data.rx_bytes - begin->data.rx_bytes);
-	printf("\ttx_bytes:   %d\n",
-		end->data.tx_bytes - begin->data.tx_bytes);
-	printf("\trx_errors:  %d\n",
-		end->data.rx_errors - begin->data.rx_errors);
-	printf("\ttx_errors:  %d\n",
-		end->data.tx_errors - begin->data.tx_errors);
-	printf("\trx_dropped: %d\n",
-		end->data.rx_dropped - begin->data.rx_dropped);
-	printf("\ttx_dropped: %d\n",
-		end->data.tx_dropped - begin->data.tx_dropped);
-	printf("\ttime:       %d\n",
+	printf("\trx_packets: %llu\n",
+		(unsigned long long)
+		(end->data.rx_packets - begin->data.rx_packets));
+	printf("\ttx_packets: %llu\n",
+		(unsigned long long)
+		(end->data.tx_packets - begin->data.tx_packets));
+	printf("\trx_bytes:   %llu\n",
+		(unsigned long long)
+		(end->data.rx_bytes - begin->data.rx_bytes));
+	printf("\ttx_bytes:   %llu\n",
+		(unsigned long long)
+		(end->data.tx_bytes - begin->data.tx_bytes));
+	printf("\trx_errors:  %llu\n",
+		(unsigned long long)
+		(end->data.rx_errors - begin->data.rx_errors));
+	printf("\ttx_errors:  %llu\n",
+		(unsigned long long)
+		(end->data.tx_errors - begin->data.tx_errors));
+	printf("\trx_dropped: %llu\n",
+		(unsigned long long)
+		(end->data.rx_dropped - begin->data.rx_dropped));
+	printf("\ttx_dropped: %llu\n",
+		(unsigned long long)
+		(end->data.tx_dropped - begin->data.tx_dropped));
+	printf("\ttime:       %u\n",
 		end->data.time - begin->data.time);
 }
 
 static void stats_print_diff(struct stats_file *file)
 {
-	struct stats_record *begin, *end;
-
-	begin = get_begin(file);
-	begin = get_next(file, begin);
-	end = get_end(file);
+	if (file->nr == 0)
+		return;
 
-	printf("\n(begin + 1)\n");
-	printf("\t[%04d] ", get_index(file, begin));
-	stats_print_record(begin);
+	printf("\nbegin\n");
+	printf("\t[%04d] ", 0);
+	stats_print_record(&file->first);
 	printf("end\n");
-	printf("\t[%04d] ", get_index(file, end));
-	stats_print_record(end);
+	printf("\t[%04d] ", file->nr - 1);
+	stats_print_record(&file->tail);
 
-	if (file->home_first != NULL && get_home(file) != NULL) {
+	if (file->home_valid == TRUE) {
 		printf("\nhome\n");
-		stats_print_rec_diff(file->home_first, get_home(file));
+		stats_print_rec_diff(&file->home_first, &file->home_last);
 	}
 
-	if (file->roaming_first != NULL && get_roaming(file) != NULL) {
-		printf("\roaming\n");
-		stats_print_rec_diff(file->roaming_first, get_roaming(file));
+	if (file->roaming_valid == TRUE) {
+		printf("\nroaming\n");
+		stats_print_rec_diff(&file->roaming_first,
+					&file->roaming_last);
 	}
 }
 
-static void update_max_nr_entries(struct stats_file *file)
-{
-	file->max_nr = (file->len - sizeof(struct stats_file_header)) /
-		sizeof(struct stats_record);
-}
-
-static void update_nr_entries(struct stats_file *file)
-{
-	struct stats_record *begin, *end;
-	int nr;
-
-	begin = get_begin(file);
-	end = get_end(file);
-
-	nr = get_index(file, end) - get_index(file, begin);
-
-	if (nr < 0)
-		nr += file->max_nr;
-
-	file->nr = nr;
-}
-
-static void update_first(struct stats_file *file)
-{
-	file->first = (struct stats_record *)(file->addr +
-					sizeof(struct stats_file_header));
-}
-
-static void update_last(struct stats_file *file)
-{
-	struct stats_record *last;
-
-	last = file->first;
-	last += file->max_nr - 1;
-
-	file->last = last;
-}
-
 static int stats_file_update_cache(struct stats_file *file)
 {
-	struct stats_record *it, *end;
+	struct stats_iter iter;
+	struct stats_record *rec;
 
-	update_max_nr_entries(file);
-	update_nr_entries(file);
-	update_first(file);
-	update_last(file);
-	file->home_first = NULL;
-	file->roaming_first = NULL;
+	file->nr_blocks = file->len / STATS_BLOCK_SIZE - 1;
+	file->nr = 0;
+	file->home_valid = FALSE;
+	file->roaming_valid = FALSE;
 
-	end = get_iterator_end(file);
-	for (it = get_iterator_begin(file);
-			it != end;
-			it = get_next(file, it)) {
+	stats_iter_init(&iter, file);
 
-		if (file->home_first == NULL && it->roaming == 0)
-			file->home_first = it;
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (file->nr == 0)
+			file->first = *rec;
 
-		if (file->roaming_first == NULL && it->roaming == 1)
-			file->roaming_first = it;
+		if (rec->roaming == 0) {
+			if (file->home_valid == FALSE)
+				file->home_first = *rec;
+			file->home_last = *rec;
+			file->home_valid = TRUE;
+		} else {
+			if (file->roaming_valid == FALSE)
+				file->roaming_first = *rec;
+			file->roaming_last = *rec;
+			file->roaming_valid = TRUE;
+		}
 
-		if (file->home_first != NULL && file->roaming_first != NULL)
-			break;
+		file->tail = *rec;
+		file->nr++;
 	}
 
 	return 0;
@@ -504,21 +604,28 @@ static int stats_open(struct stats_file *file, const char *name)
 		return err;
 	}
 
-	/* Initialize new file */
+	file->nr_blocks = file->len / STATS_BLOCK_SIZE - 1;
+
 	hdr = get_hdr(file);
+	if (hdr->magic == MAGIC_V1 ||
+			(hdr->magic == MAGIC &&
+				hdr->version < STATS_FILE_VERSION)) {
+		fprintf(stderr, "%s has an old format, "
+				"it is converted by connmand\n", file->name);
+		return -EINVAL;
+	}
+
+	/* Initialize new file */
 	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
+			hdr->version != STATS_FILE_VERSION ||
+			hdr->first >= file->nr_blocks ||
+			hdr->last >= file->nr_blocks ||
+			hdr->used > file->nr_blocks) {
 		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
-
+		hdr->version = STATS_FILE_VERSION;
+		hdr->first = 0;
+		hdr->last = 0;
+		hdr->used = 0;
 	}
 	stats_file_update_cache(file);
 
@@ -532,13 +639,84 @@ static void stats_close(struct stats_file *file)
 	g_free(file->name);
 }
 
+static int new_block(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	int err;
+
+	if (hdr->used == 0) {
+		hdr->first = 0;
+		hdr->last = 0;
+		hdr->used = 1;
+	} else if (hdr->used < file->nr_blocks) {
+		hdr->last = (hdr->last + 1) % file->nr_blocks;
+		hdr->used++;
+	} else if (hdr->first == 0) {
+		err = stats_file_remap(file, file->len +
+					sysconf(_SC_PAGESIZE));
+		if (err < 0)
+			return err;
+
+		file->nr_blocks = file->len / STATS_BLOCK_SIZE - 1;
+
+		hdr = get_hdr(file);
+		hdr->last++;
+		hdr->used++;
+	} else {
+		hdr->first = (hdr->first + 1) % file->nr_blocks;
+		hdr->last = (hdr->last + 1) % file->nr_blocks;
+	}
+
+	get_block(file, hdr->last)->len = 0;
+
+	return 0;
+}
+
+static int append_record(struct stats_file *file,
+				struct stats_record *rec)
+{
+	unsigned char buf[STATS_RECORD_MAX_LEN];
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block = NULL;
+	unsigned int len = 0;
+	int err;
+
+	if (hdr->used > 0) {
+		block = get_block(file, hdr->last);
+
+		if (block->len > 0)
+			len = encode_record(buf, rec, &file->tail);
+		else
+			len = encode_record(buf, rec, NULL);
+
+		if (block->len + len > STATS_BLOCK_DATA_SIZE)
+			block = NULL;
+	}
+
+	if (block == NULL) {
+		err = new_block(file);
+		if (err < 0)
+			return err;
+
+		block = get_block(file, get_hdr(file)->last);
+		len = encode_record(buf, rec, NULL);
+	}
+
+	memcpy(block->data + block->len, buf, len);
+	block->len += len;
+
+	file->tail = *rec;
+
+	return 0;
+}
+
 static int stats_create(struct stats_file *file, unsigned int nr,
 			unsigned int interval, time_t start_ts,
 			struct stats_record *start)
 {
 	unsigned int i;
 	int err;
-	struct stats_record *cur, *next;
+	struct stats_record cur, next;
 	struct stats_file_header *hdr;
 	unsigned int pkt;
 	unsigned int step_ts;
@@ -547,61 +725,52 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 	hdr = get_hdr(file);
 
 	hdr->magic = MAGIC;
-	hdr->begin = sizeof(struct stats_file_header);
-	hdr->end = sizeof(struct stats_file_header);
-	hdr->home = UINT_MAX;
-	hdr->roaming = UINT_MAX;
-
-	stats_file_update_cache(file);
+	hdr->version = STATS_FILE_VERSION;
+	hdr->first = 0;
+	hdr->last = 0;
+	hdr->used = 0;
 
-	if (start != NULL) {
-		struct stats_record *rec;
+	memset(&cur, 0, sizeof(struct stats_record));
 
-		rec = get_end(file);
-		memcpy(rec, start, sizeof(struct stats_record));
-	} else {
-		get_end(file)->ts = start_ts;
-	}
+	if (start != NULL)
+		memcpy(&cur, start, sizeof(struct stats_record));
+	else
+		cur.ts = start_ts;
 
 	for (i = 0; i < nr; i++) {
-		if (file->last == get_end(file)) {
-			err = stats_file_remap(file, file->len +
-						sysconf(_SC_PAGESIZE));
-			if (err < 0)
-				return err;
-
-			stats_file_update_cache(file);
-		}
-		cur = get_end(file);
-		next = get_next(file, cur);
+		memset(&next, 0, sizeof(struct stats_record));
 
 		step_ts = (rand() % interval);
 		if (step_ts == 0)
 			step_ts = 1;
 
-		next->ts = cur->ts + step_ts;
-		next->roaming = roaming;
-		next->data.time = cur->data.time + step_ts;
+		next.ts = cur.ts + step_ts;
+		next.roaming = roaming;
+		next.data.time = cur.data.time + step_ts;
 
-		next->data.rx_packets = cur->data.rx_packets;
-		next->data.rx_bytes = cur->data.rx_bytes;
+		next.data.rx_packets = cur.data.rx_packets;
+		next.data.rx_bytes = cur.data.rx_bytes;
 
 		if (rand() % 3 == 0) {
 			pkt = rand() % 5;
-			next->data.rx_packets += pkt;
-			next->data.rx_bytes += pkt * (rand() % 1500);
+			next.data.rx_packets += pkt;
+			next.data.rx_bytes += pkt * (rand() % 1500);
 		}
 
-		next->data.tx_packets = cur->data.tx_packets;
-		next->data.tx_bytes = cur->data.tx_bytes;
+		next.data.tx_packets = cur.data.tx_packets;
+		next.data.tx_bytes = cur.data.tx_bytes;
 
 		if (rand() % 3 == 0) {
 			pkt = rand() % 5;
-			next->data.tx_packets += pkt;
-			next->data.tx_bytes += pkt * (rand() % 1500);
+			next.data.tx_packets += pkt;
+			next.data.tx_bytes += pkt * (rand() % 1500);
 		}
 
-		set_end(file, next);
+		err = append_record(file, &next);
+		if (err < 0)
+			return err;
+
+		cur = next;
 
 		if ((rand() % 50) == 0)
 			roaming = roaming == TRUE? FALSE : TRUE;
@@ -611,217 +780,191 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 	return 0;
 }
 
-static struct stats_record *get_next_record(struct stats_iter *iter)
+static guint32 day_key(time_t ts)
 {
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
-
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
+	GDate date;
 
-		return tmp;
-	}
+	g_date_set_time_t(&date, ts);
 
-	return NULL;
+	return g_date_get_julian(&date);
 }
 
-static int append_record(struct stats_file *file,
-				struct stats_record *rec)
+static guint32 month_key(time_t ts, int account_period_offset)
 {
-	struct stats_record *cur, *next;
-	int err;
+	GDate date;
+	guint32 key;
 
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
-
-		stats_file_update_cache(file);
-	}
+	g_date_set_time_t(&date, ts);
 
-	cur = get_end(file);
-	next = get_next(file, cur);
+	key = g_date_get_year(&date) * 12 + g_date_get_month(&date) - 1;
+	if (g_date_get_day(&date) < account_period_offset)
+		key--;
 
-	memcpy(next, rec, sizeof(struct stats_record));
-
-	set_end(file, next);
-
-	return 0;
+	return key;
 }
 
-static struct stats_record *process_file(struct stats_iter *iter,
-					struct stats_file *temp_file,
-					struct stats_record *cur,
-					GDate *date_change_step_size,
-					int account_period_offset)
+static struct stats_bucket *get_newest_bucket(struct stats_bucket *buckets,
+					unsigned int size, unsigned int first,
+					unsigned int used)
 {
-	struct stats_record *home, *roaming;
-	struct stats_record *next;
-
-	home = NULL;
-	roaming = NULL;
-
-	if (cur == NULL)
-		cur = get_next_record(iter);
-	next = get_next_record(iter);
-
-	while (next != NULL) {
-		GDate date_cur;
-		GDate date_next;
-		int append;
-
-		append = FALSE;
+	if (used == 0)
+		return NULL;
 
-		if (cur->roaming == TRUE)
-			roaming = cur;
-		else
-			home = cur;
+	return &buckets[(first + used - 1) % size];
+}
 
-		g_date_set_time_t(&date_cur, cur->ts);
-		g_date_set_time_t(&date_next, next->ts);
+static struct stats_bucket *new_bucket(struct stats_bucket *buckets,
+					unsigned int size, unsigned int *first,
+					unsigned int *used)
+{
+	struct stats_bucket *prev, *bucket;
 
-		if (g_date_compare(&date_cur, date_change_step_size) < 0) {
-			/* month period size */
-			GDateDay day_cur, day_next;
-			GDateMonth month_cur, month_next;
+	prev = get_newest_bucket(buckets, size, *first, *used);
 
-			month_cur = g_date_get_month(&date_cur);
-			month_next = g_date_get_month(&date_next);
+	if (*used < size)
+		(*used)++;
+	else
+		*first = (*first + 1) % size;
 
-			day_cur = g_date_get_day(&date_cur);
-			day_next = g_date_get_day(&date_next);
+	bucket = get_newest_bucket(buckets, size, *first, *used);
 
-			if (day_cur == day_next && month_cur != month_next)
-				append = TRUE;
-			else if (day_cur < account_period_offset && day_next >= account_period_offset)
-				append = TRUE;
-		} else {
-			/* day period size */
-			if (g_date_days_between(&date_cur, &date_next) > 0)
-				append = TRUE;
-		}
+	if (prev != NULL)
+		*bucket = *prev;
+	else
+		memset(bucket, 0, sizeof(struct stats_bucket));
 
-		if (append == TRUE) {
-			if (home != NULL) {
-				append_record(temp_file, home);
-				home = NULL;
-			}
+	return bucket;
+}
 
-			if (roaming != NULL) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
-			}
-		}
+static void bucket_update(struct stats_bucket *bucket,
+					struct stats_record *rec)
+{
+	if (rec->ts > bucket->ts)
+		bucket->ts = rec->ts;
 
-		cur = next;
-		next = get_next_record(iter);
+	if (rec->roaming == TRUE) {
+		bucket->roaming = rec->data;
+		bucket->valid |= STATS_BUCKET_ROAMING;
+	} else {
+		bucket->home = rec->data;
+		bucket->valid |= STATS_BUCKET_HOME;
 	}
-
-	return cur;
 }
 
-static int summarize(struct stats_file *data_file,
-			struct stats_file *history_file,
-			struct stats_file *temp_file,
-			int account_period_offset)
+static void history_add(struct stats_history_header *hdr,
+			struct stats_record *rec, int account_period_offset)
 {
-	struct stats_iter data_iter;
-	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
-
-	GDate today, date_change_step_size;
-
-	/*
-	 * First calculate the date when switch from monthly
-	 * accounting period size to daily size
-	 */
-	g_date_set_time_t(&today, time(NULL));
-
-	date_change_step_size = today;
-	if (g_date_get_day(&today) - account_period_offset >= 0)
-		g_date_subtract_months(&date_change_step_size, 2);
-	else
-		g_date_subtract_months(&date_change_step_size, 3);
-
-	g_date_set_day(&date_change_step_size, account_period_offset);
-
+	struct stats_bucket *bucket;
+
+	bucket = get_newest_bucket(hdr->day, HISTORY_DAYS,
+					hdr->day_first, hdr->day_used);
+	if (bucket == NULL || day_key(rec->ts) > day_key(bucket->ts))
+		bucket = new_bucket(hdr->day, HISTORY_DAYS,
+					&hdr->day_first, &hdr->day_used);
+	bucket_update(bucket, rec);
+
+	bucket = get_newest_bucket(hdr->month, HISTORY_MONTHS,
+					hdr->month_first, hdr->month_used);
+	if (bucket == NULL || month_key(rec->ts, account_period_offset) >
+			month_key(bucket->ts, account_period_offset))
+		bucket = new_bucket(hdr->month, HISTORY_MONTHS,
+					&hdr->month_first, &hdr->month_used);
+	bucket_update(bucket, rec);
+}
 
-	/* Now process history file */
-	cur = NULL;
+static void stats_print_buckets(const char *name,
+					struct stats_bucket *buckets,
+					unsigned int size, unsigned int first,
+					unsigned int used)
+{
+	struct stats_bucket *bucket;
+	char buffer[30];
+	unsigned int i;
 
-	if (history_file != NULL) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
+	printf("%s buckets %u\n", name, used);
 
-		cur = process_file(&history_iter, temp_file, NULL,
-					&date_change_step_size, account_period_offset);
-	}
+	for (i = 0; i < used; i++) {
+		bucket = &buckets[(first + i) % size];
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
-
-	/*
-	 * Ensure date_file records are newer than the history_file
-	 * record
-	 */
-	if (cur != NULL) {
-		next = get_next_record(&data_iter);
-		while(next != NULL && cur->ts > next->ts)
-			next = get_next_record(&data_iter);
+		strftime(buffer, 30, "%d-%m-%Y %T", localtime(&bucket->ts));
+		printf("[%04d] %s home %llu %llu roaming %llu %llu\n", i,
+			buffer,
+			(unsigned long long) bucket->home.rx_bytes,
+			(unsigned long long) bucket->home.tx_bytes,
+			(unsigned long long) bucket->roaming.rx_bytes,
+			(unsigned long long) bucket->roaming.tx_bytes);
 	}
 
-	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
-				&date_change_step_size, account_period_offset);
-
-	if (cur != NULL)
-		append_record(temp_file, cur);
-
-	return 0;
+	printf("\n");
 }
 
-static void swap_and_close_files(struct stats_file *history_file,
-			struct stats_file *temp_file)
+static void history_file_update(struct stats_file *data_file,
+				const char *history_file_name)
 {
-	munmap(history_file->addr, history_file->len);
-	munmap(temp_file->addr, temp_file->len);
+	struct stats_history_header *hdr;
+	struct stats_bucket *newest;
+	struct stats_iter iter;
+	struct stats_record *rec;
+	size_t size;
+	void *addr;
+	int fd;
 
-	TFR(close(temp_file->fd));
+	fd = TFR(open(history_file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+	if (fd < 0) {
+		fprintf(stderr, "open error %s for %s\n",
+			strerror(errno), history_file_name);
+		return;
+	}
 
-	unlink(history_file->name);
+	size = sizeof(struct stats_history_header);
 
-	if (link(temp_file->name, history_file->name) < 0)
-		return;
+	if (ftruncate(fd, size) < 0) {
+		fprintf(stderr, "ftrunctate error %s for %s\n",
+			strerror(errno), history_file_name);
+		goto out;
+	}
 
-	unlink(temp_file->name);
-	TFR(close(history_file->fd));
-}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "mmap error %s for %s\n",
+			strerror(errno), history_file_name);
+		goto out;
+	}
 
-static void history_file_update(struct stats_file *data_file,
-				const char *history_file_name)
-{
-	struct stats_file _history_file;
-	struct stats_file tempory_file;
+	hdr = addr;
+	if (hdr->magic != HISTORY_MAGIC ||
+			hdr->version != HISTORY_VERSION ||
+			hdr->day_first >= HISTORY_DAYS ||
+			hdr->day_used > HISTORY_DAYS ||
+			hdr->month_first >= HISTORY_MONTHS ||
+			hdr->month_used > HISTORY_MONTHS) {
+		memset(hdr, 0, size);
+		hdr->magic = HISTORY_MAGIC;
+		hdr->version = HISTORY_VERSION;
+	}
 
-	struct stats_file *history_file = NULL;
+	newest = get_newest_bucket(hdr->day, HISTORY_DAYS,
+					hdr->day_first, hdr->day_used);
 
-	if (stats_open(&_history_file, history_file_name) == 0)
-		history_file = &_history_file;
+	/* only add the records which are not yet in the history */
+	stats_iter_init(&iter, data_file);
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (newest != NULL && rec->ts <= newest->ts)
+			continue;
 
-	if (stats_open(&tempory_file, NULL) < 0) {
-		if (history_file != NULL)
-			stats_close(history_file);
-		return;
+		history_add(hdr, rec, 13);
 	}
 
-	summarize(data_file, history_file, &tempory_file, 13);
+	stats_print_buckets("Daily", hdr->day, HISTORY_DAYS,
+				hdr->day_first, hdr->day_used);
+	stats_print_buckets("Monthly", hdr->month, HISTORY_MONTHS,
+				hdr->month_first, hdr->month_used);
+
+	msync(addr, size, MS_SYNC);
+	munmap(addr, size);
 
-	swap_and_close_files(history_file, &tempory_file);
+out:
+	TFR(close(fd));
 }
 
 int main(int argc, char *argv[])
@@ -874,7 +1017,8 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 
-		rec = get_end(&last);
+		if (last.nr > 0)
+			rec = &last.tail;
 	}
 
 	if (option_start_ts == -1)
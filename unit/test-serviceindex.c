@@ -0,0 +1,187 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+
+#include <glib.h>
+
+#include "../src/connman.h"
+
+#define SERVICES	300
+#define NETWORKS	3
+
+static char identifiers[SERVICES][32];
+static char paths[SERVICES][64];
+static int data[SERVICES];
+static int networks[SERVICES][NETWORKS];
+
+static void add_services(void)
+{
+	int i, j;
+
+	for (i = 0; i < SERVICES; i++) {
+		g_snprintf(identifiers[i], sizeof(identifiers[i]),
+						"wifi_%04d_managed_psk", i);
+		g_snprintf(paths[i], sizeof(paths[i]),
+					"/net/connman/service/%s",
+					identifiers[i]);
+
+		g_assert(__connman_serviceindex_add(identifiers[i],
+							&data[i]) == 0);
+		g_assert(__connman_serviceindex_set_path(identifiers[i],
+							paths[i]) == 0);
+
+		for (j = 0; j < NETWORKS; j++)
+			g_assert(__connman_serviceindex_add_network(
+						identifiers[i],
+						&networks[i][j]) == 0);
+	}
+
+	g_assert(__connman_serviceindex_size() == SERVICES);
+	g_assert(__connman_serviceindex_check() == TRUE);
+}
+
+static void test_serviceindex_lookup0(void)
+{
+	int i, j;
+
+	__connman_serviceindex_init();
+
+	add_services();
+
+	for (i = 0; i < SERVICES; i++) {
+		g_assert(__connman_serviceindex_lookup(identifiers[i]) ==
+								&data[i]);
+		g_assert(__connman_serviceindex_lookup_path(paths[i]) ==
+								&data[i]);
+
+		for (j = 0; j < NETWORKS; j++)
+			g_assert(__connman_serviceindex_lookup_network(
+						&networks[i][j]) == &data[i]);
+	}
+
+	g_assert(__connman_serviceindex_lookup("unknown") == NULL);
+	g_assert(__connman_serviceindex_lookup_path("/unknown") == NULL);
+	g_assert(__connman_serviceindex_lookup_network(&i) == NULL);
+
+	__connman_serviceindex_cleanup();
+}
+
+static void test_serviceindex_duplicate0(void)
+{
+	int network;
+
+	__connman_serviceindex_init();
+
+	add_services();
+
+	g_assert(__connman_serviceindex_add(identifiers[0], &data[1]) ==
+								-EEXIST);
+	g_assert(__connman_serviceindex_set_path(identifiers[1], paths[0]) ==
+								-EEXIST);
+	g_assert(__connman_serviceindex_add_network(identifiers[1],
+					&networks[0][0]) == -EEXIST);
+
+	g_assert(__connman_serviceindex_set_path("unknown", "/unknown") ==
+								-ENOENT);
+	g_assert(__connman_serviceindex_add_network("unknown", &network) ==
+								-ENOENT);
+
+	g_assert(__connman_serviceindex_lookup(identifiers[0]) == &data[0]);
+	g_assert(__connman_serviceindex_lookup_network(&networks[0][0]) ==
+								&data[0]);
+	g_assert(__connman_serviceindex_check() == TRUE);
+
+	__connman_serviceindex_cleanup();
+}
+
+static void test_serviceindex_remove0(void)
+{
+	int i, j;
+
+	__connman_serviceindex_init();
+
+	add_services();
+
+	/* removing a service drops its path and networks as well */
+	for (i = 0; i < SERVICES; i += 2) {
+		__connman_serviceindex_remove(identifiers[i]);
+		g_assert(__connman_serviceindex_check() == TRUE);
+	}
+
+	for (i = 0; i < SERVICES; i++) {
+		int *expected = i % 2 == 0 ? NULL : &data[i];
+
+		g_assert(__connman_serviceindex_lookup(identifiers[i]) ==
+								expected);
+		g_assert(__connman_serviceindex_lookup_path(paths[i]) ==
+								expected);
+
+		for (j = 0; j < NETWORKS; j++)
+			g_assert(__connman_serviceindex_lookup_network(
+						&networks[i][j]) == expected);
+	}
+
+	g_assert(__connman_serviceindex_size() == SERVICES / 2);
+
+	/* a network can move to another service */
+	__connman_serviceindex_remove_network(&networks[1][0]);
+	g_assert(__connman_serviceindex_lookup_network(&networks[1][0]) ==
+									NULL);
+	g_assert(__connman_serviceindex_lookup_network(&networks[1][1]) ==
+								&data[1]);
+	g_assert(__connman_serviceindex_check() == TRUE);
+
+	g_assert(__connman_serviceindex_add_network(identifiers[3],
+						&networks[1][0]) == 0);
+	g_assert(__connman_serviceindex_lookup_network(&networks[1][0]) ==
+								&data[3]);
+	g_assert(__connman_serviceindex_check() == TRUE);
+
+	/* and a service can be added again under the same identifier */
+	g_assert(__connman_serviceindex_add(identifiers[0], &data[0]) == 0);
+	g_assert(__connman_serviceindex_lookup_path(paths[0]) == NULL);
+	g_assert(__connman_serviceindex_set_path(identifiers[0],
+							paths[0]) == 0);
+	g_assert(__connman_serviceindex_lookup_path(paths[0]) == &data[0]);
+	g_assert(__connman_serviceindex_check() == TRUE);
+
+	__connman_serviceindex_set_path(identifiers[0], NULL);
+	g_assert(__connman_serviceindex_lookup_path(paths[0]) == NULL);
+	g_assert(__connman_serviceindex_check() == TRUE);
+
+	__connman_serviceindex_cleanup();
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/lookup0", test_serviceindex_lookup0);
+	g_test_add_func("/duplicate0", test_serviceindex_duplicate0);
+	g_test_add_func("/remove0", test_serviceindex_remove0);
+
+	return g_test_run();
+}
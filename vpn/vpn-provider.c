@@ -1024,6 +1024,9 @@ static void connection_removed_signal(struct vpn_provider *provider)
 	dbus_message_iter_init_append(signal, &iter);
 	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
 							&provider->path);
+
+	__connman_dbus_flush_property_changes();
+
 	dbus_connection_send(connection, signal, NULL);
 	dbus_message_unref(signal);
 }
@@ -1300,6 +1303,8 @@ static void connection_added_signal(struct vpn_provider *provider)
 							&provider->path);
 	append_properties(&iter, provider);
 
+	__connman_dbus_flush_property_changes();
+
 	dbus_connection_send(connection, signal, NULL);
 	dbus_message_unref(signal);
 }